@@ -0,0 +1,109 @@
+// Benchmark of batched ray queries: closest hits and occlusion of rays in a loaded scene
+#include "rayquery.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "options.h"
+#include "timer.h"
+
+int main(int argc, char** argv)
+{
+	// Arguments are scene path, ray count and thread count
+	const std::string scenePath = argc > 1 ? argv[1] : "input/simple_shapes.scene";
+	const size_t rayCount = argc > 2 ? atoi(argv[2]) : 1 << 20;
+	const int nThreads = argc > 3 ? atoi(argv[3]) : 0;
+
+	options::enableOutput = false;
+	Scene scene(scenePath);
+	if (!scene.sceneLoadSuccess)
+		return 1;
+	options::enableOutput = true;
+	options::collectStatistics = false;
+
+	// Random rays go between points inside bounds of the bounded objects
+	BBox bounds;
+	for (const auto& object : scene.objects) {
+		BBox objectBounds;
+		if (object->getBounds(objectBounds))
+			bounds.extend(objectBounds);
+	}
+	if (bounds.empty())
+		bounds = BBox(Vec3f(-1), Vec3f(1));
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	auto randomPoint = [&]() { return bounds[0] + Vec3f(unit(rng), unit(rng), unit(rng)) * bounds.extent(); };
+
+	// Random segments are incoherent, camera rays in blocks of 8x8 pixels go through neighbouring nodes
+	std::vector<Ray> randomRays(rayCount), cameraRays;
+	std::vector<float> randomDistances(rayCount), cameraDistances;
+	for (size_t r = 0; r < rayCount; r++) {
+		const Vec3f a = randomPoint();
+		Vec3f dir = randomPoint() - a;
+		randomDistances[r] = dir.length();
+		randomRays[r] = Ray(a, dir.normalize());
+	}
+	const float cameraDistance = (bounds.extent().length() + (scene.camera.pos - bounds.centroid()).length());
+	for (size_t by = 0; by < scene.options.height; by += 8)
+		for (size_t bx = 0; bx < scene.options.width; bx += 8)
+			for (size_t y = by; y < std::min(by + 8, scene.options.height); y++)
+				for (size_t x = bx; x < std::min(bx + 8, scene.options.width); x++) {
+					cameraRays.push_back(scene.getCameraRay((float)x + 0.5f, (float)y + 0.5f));
+					cameraDistances.push_back(cameraDistance);
+				}
+	// Image is repeated up to the ray count, so timings of both sets are comparable
+	for (size_t r = 0; cameraRays.size() < rayCount; r++) {
+		cameraRays.push_back(cameraRays[r]);
+		cameraDistances.push_back(cameraDistance);
+	}
+
+	RayQuery query(scene, nThreads);
+	auto run = [&](const std::vector<Ray>& rays, const std::vector<float>& distances)
+	{
+		const size_t count = rays.size();
+		std::vector<IntersectInfo> singleHits(count);
+		std::vector<RayHit> hits(count);
+		std::unique_ptr<bool[]> occluded(new bool[count]);
+		auto report = [&](Timer& t)
+		{
+			const long long ms = std::max(1ll, t.stop());
+			std::cout << "  " << (long long)(count * 1000.0 / ms) << " rays/s\n";
+		};
+		{
+			Timer t("Single rays");
+			for (size_t r = 0; r < count; r++)
+				Render::trace(rays[r], scene, singleHits[r]);
+			report(t);
+		}
+		{
+			Timer t("Closest hits");
+			query.intersect(rays.data(), count, hits.data());
+			report(t);
+		}
+		{
+			Timer t("Occlusion");
+			query.occluded(rays.data(), count, occluded.get(), distances.data());
+			report(t);
+		}
+
+		// Batched queries trace the same rays, so they find the same hits
+		size_t hitCount = 0, occludedCount = 0, mismatchCount = 0;
+		for (size_t r = 0; r < count; r++) {
+			hitCount += hits[r].objectId >= 0;
+			occludedCount += occluded[r];
+			const bool singleHit = singleHits[r].hitObject != nullptr;
+			mismatchCount += singleHit != (hits[r].objectId >= 0) || (singleHit && singleHits[r].tNear != hits[r].t)
+				|| occluded[r] != (singleHit && singleHits[r].tNear < distances[r]);
+		}
+		std::cout << "Rays: " << count << ", hits: " << hitCount << ", occluded: " << occludedCount
+			<< ", mismatches: " << mismatchCount << '\n';
+	};
+
+	std::cout << "Random rays\n";
+	run(randomRays, randomDistances);
+	std::cout << "Camera rays\n";
+	run(cameraRays, cameraDistances);
+	return 0;
+}
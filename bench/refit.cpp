@@ -0,0 +1,101 @@
+// Benchmark of moving meshes: refits and background rebuilds, checked against a mesh loaded in place
+#include "objects.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "options.h"
+#include "timer.h"
+
+int main(int argc, char** argv)
+{
+	// Arguments are OBJ path, frame count, rebuild cost ratio, ray count and tree: bvh, bvh4, bvh8 or qbvh
+	const std::string objPath = argc > 1 ? argv[1] : "input/objects/bunny.obj";
+	const int frameCount = argc > 2 ? atoi(argv[2]) : 30;
+	const float rebuildCostRatio = argc > 3 ? (float)atof(argv[3]) : 1.1f;
+	const size_t rayCount = argc > 4 ? atoi(argv[4]) : 1 << 16;
+	const std::string accel = argc > 5 ? argv[5] : "bvh";
+	AccelType accelType = AccelType::BVH;
+	if (accel == "bvh4")
+		accelType = AccelType::BVH4;
+	else if (accel == "bvh8")
+		accelType = AccelType::BVH8;
+	else if (accel == "qbvh")
+		accelType = AccelType::QBVH;
+
+	Options options;
+	options.rebuildCostRatio = rebuildCostRatio;
+	options::collectStatistics = false;
+	auto placement = [&](int frame, Vec3f& pos, Vec3f& rot)
+	{
+		// Mesh goes around a circle and turns, so its boxes grow until the tree is rebuilt
+		const float angle = frame * 0.2f;
+		pos = Vec3f(std::sin(angle), 0.2f * frame / std::max(1, frameCount), std::cos(angle) - 1.0f);
+		rot = Vec3f(frame * 7.0f, frame * 11.0f, 0.0f);
+	};
+	auto load = [&](Mesh& mesh, int frame)
+	{
+		mesh.size = Vec3f(2);
+		mesh.accelType = accelType;
+		placement(frame, mesh.pos, mesh.rot);
+		options::enableOutput = false;
+		const bool loaded = mesh.loadOBJ(objPath, options) && !mesh.triangles.empty();
+		options::enableOutput = true;
+		return loaded;
+	};
+
+	Mesh mesh;
+	if (!load(mesh, 0))
+		return 1;
+	std::cout << "Triangles: " << mesh.triangles.size() << ", tree: " << accel << ", rebuild cost ratio: "
+		<< rebuildCostRatio << '\n';
+
+	// Started rebuild is waited for, so every one of them is taken by the next frame
+	int rebuildCount = 0;
+	long long refitTime = 0;
+	for (int frame = 1; frame <= frameCount; frame++) {
+		const bool rebuildPending = mesh.rebuiltBVH.valid();
+		if (rebuildPending)
+			mesh.rebuiltBVH.wait();
+		Vec3f pos, rot;
+		placement(frame, pos, rot);
+		options::enableOutput = false;
+		Timer t("Refit");
+		mesh.moveTo(pos, rot, options);
+		refitTime += t.stop();
+		options::enableOutput = true;
+		rebuildCount += rebuildPending;
+	}
+	std::cout << "Frames: " << frameCount << ", rebuilds taken: " << rebuildCount << ", refit time: "
+		<< refitTime << " ms\n";
+
+	// Rays go between random points in the box of the moved mesh
+	Mesh fresh;
+	if (!load(fresh, frameCount))
+		return 1;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	auto randomPoint = [&]() { return fresh.bounds[0] + Vec3f(unit(rng), unit(rng), unit(rng)) * fresh.bounds.extent(); };
+
+	// Moved vertices are rounded differently from loaded ones, so t may differ a bit,
+	// and rays grazing an edge between faces may hit either of them
+	const float tolerance = 1e-4f * fresh.bounds.extent().length();
+	size_t hitCount = 0, mismatchCount = 0;
+	for (size_t r = 0; r < rayCount; r++) {
+		const Vec3f a = randomPoint();
+		const Ray ray(a, (randomPoint() - a).normalize());
+		float tMoved, tFresh;
+		const Triangle* movedTri = nullptr;
+		const Triangle* freshTri = nullptr;
+		Vec2f uv;
+		const bool movedHit = mesh.intersectMesh(ray, tMoved, movedTri, uv);
+		const bool freshHit = fresh.intersectMesh(ray, tFresh, freshTri, uv);
+		hitCount += freshHit;
+		mismatchCount += movedHit != freshHit || (freshHit && (std::abs(tMoved - tFresh) > tolerance
+			|| mesh.faces[movedTri - mesh.triangles.data()] != fresh.faces[freshTri - fresh.triangles.data()]));
+	}
+	std::cout << "Rays: " << rayCount << ", hits: " << hitCount << ", mismatches: " << mismatchCount << '\n';
+	return 0;
+}
@@ -0,0 +1,132 @@
+// Microbenchmark of ray triangle tests: scalar test against the grouped SIMD ones
+#include "objects.h"
+
+#include <random>
+#include <vector>
+
+#include "bvh.h"
+#include "options.h"
+#include "simd.h"
+#include "timer.h"
+
+int main(int argc, char** argv)
+{
+	// Leaves of BVH size, each ray visits one of them. Arguments are visit and leaf counts
+	const uint32_t leafSize = BVH::maxLeafSize;
+	const uint32_t leafCount = argc > 2 ? atoi(argv[2]) : 1 << 16;
+	const int visitCount = argc > 1 ? atoi(argv[1]) : 1 << 22;
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	auto randomPoint = [&]() { return Vec3f(unit(rng), unit(rng), unit(rng)); };
+
+	// Small triangles around a shared center, so some of them are hit, about half face away
+	std::vector<Vec3f> vertices;
+	std::vector<Triangle> tris;
+	for (uint32_t l = 0; l < leafCount; l++) {
+		const Vec3f center = randomPoint() * 2 - Vec3f(1);
+		for (uint32_t i = 0; i < leafSize; i++) {
+			const Vec3f a = center + (randomPoint() - Vec3f(0.5f)) * 0.5f;
+			const uint32_t first = (uint32_t)vertices.size();
+			vertices.push_back(a);
+			vertices.push_back(a + randomPoint() * 0.5f);
+			vertices.push_back(a + randomPoint() * 0.5f);
+			Triangle tri;
+			for (int k = 0; k < 3; k++) {
+				tri.v[k] = first + k;
+				tri.n[k] = tri.t[k] = Triangle::noIndex;
+			}
+			tris.push_back(tri);
+		}
+	}
+	TriangleEdges edges;
+	edges.assign(tris, vertices);
+	TriangleTransforms transforms;
+	transforms.assign(tris, vertices);
+
+	std::vector<Ray> rays(visitCount);
+	std::vector<uint32_t> leaves(visitCount);
+	std::uniform_int_distribution<uint32_t> leafDist(0, leafCount - 1);
+	for (int r = 0; r < visitCount; r++) {
+		rays[r] = Ray(Vec3f(0, 0, 5), (randomPoint() * 2 - Vec3f(1, 1, 6)).normalize());
+		leaves[r] = leafDist(rng);
+	}
+
+#if defined(RT_USE_AVX)
+	const std::string isa = " (AVX)";
+#elif defined(RT_USE_SSE)
+	const std::string isa = " (SSE)";
+#else
+	const std::string isa = " (scalar)";
+#endif
+	options::enableOutput = true;
+	options::collectStatistics = false;
+	for (bool culling : { true, false }) {
+		options::useBackfaceCulling = culling;
+		std::cout << (culling ? "Backface culling on\n" : "Backface culling off\n");
+
+		std::vector<uint32_t> scalarHits(visitCount), groupHits(visitCount), affineHits(visitCount),
+			indexedHits(visitCount);
+		{
+			Timer t("Scalar");
+			for (int r = 0; r < visitCount; r++) {
+				float tMax = std::numeric_limits<float>::max();
+				scalarHits[r] = UINT32_MAX;
+				for (uint32_t i = leaves[r] * leafSize; i < (leaves[r] + 1) * leafSize; i++) {
+					float tri_t;
+					Vec2f uv;
+					if (edges.intersect(rays[r], i, tri_t, uv) && tri_t < tMax) {
+						tMax = tri_t;
+						scalarHits[r] = i;
+					}
+				}
+			}
+		}
+		{
+			Timer t("Indexed");
+			for (int r = 0; r < visitCount; r++) {
+				float tMax = std::numeric_limits<float>::max();
+				indexedHits[r] = UINT32_MAX;
+				for (uint32_t i = leaves[r] * leafSize; i < (leaves[r] + 1) * leafSize; i++) {
+					const Vec3f& a = vertices[tris[i].v[0]];
+					float tri_t;
+					Vec2f uv;
+					if (Triangle::rayTriangleIntersect(rays[r], a, vertices[tris[i].v[1]] - a, vertices[tris[i].v[2]] - a, tri_t, uv)
+						&& tri_t < tMax) {
+						tMax = tri_t;
+						indexedHits[r] = i;
+					}
+				}
+			}
+		}
+		{
+			Timer t("Grouped" + isa);
+			for (int r = 0; r < visitCount; r++) {
+				float tMax = std::numeric_limits<float>::max();
+				Vec2f uv;
+				groupHits[r] = UINT32_MAX;
+				edges.intersect(rays[r], leaves[r] * leafSize, (leaves[r] + 1) * leafSize, tMax, groupHits[r], uv);
+			}
+		}
+		{
+			Timer t("Affine" + isa);
+			for (int r = 0; r < visitCount; r++) {
+				float tMax = std::numeric_limits<float>::max();
+				Vec2f uv;
+				affineHits[r] = UINT32_MAX;
+				transforms.intersect(rays[r], leaves[r] * leafSize, (leaves[r] + 1) * leafSize, tMax, affineHits[r], uv);
+			}
+		}
+
+		// Affine test rounds differently, rays through edges may pick the neighbour
+		int hitCount = 0, mismatchCount = 0, affineMismatchCount = 0;
+		for (int r = 0; r < visitCount; r++) {
+			hitCount += scalarHits[r] != UINT32_MAX;
+			mismatchCount += scalarHits[r] != groupHits[r] || scalarHits[r] != indexedHits[r];
+			affineMismatchCount += scalarHits[r] != affineHits[r];
+		}
+		std::cout << "Leaf visits: " << visitCount << ", hits: " << hitCount
+			<< ", mismatches: " << mismatchCount << ", affine mismatches: " << affineMismatchCount << '\n';
+	}
+	return 0;
+}
@@ -0,0 +1,832 @@
+// Bounding volume hierarchy, built with binned SAH or from Morton codes of primitive centroids
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+#include "geometry.h"
+#include "options.h"
+#include "stats.h"
+#include "simd.h"
+
+class ThreadPool;
+
+// Primitive reference used during build: bounds, centroid and index of the primitive
+struct BVHPrimitive
+{
+	BBox bounds;
+	Vec3f centroid;
+	uint32_t index;
+};
+
+// Node of the tree used during build. Interior node has two children,
+// leaf references primCount primitives starting from firstPrim
+struct BVHBuildNode
+{
+	BBox bounds;
+	std::unique_ptr<BVHBuildNode> children[2];
+	uint32_t firstPrim = 0;
+	uint32_t primCount = 0;
+};
+
+// Node of the flattened tree. Nodes are stored in depth-first order, so first child
+// of interior node directly follows it, and offset points to the second one.
+// For leaves offset is the index of the first primitive in BVH::primIndices
+struct BVHNode
+{
+	Vec3f boundsMin;
+	uint32_t offset;
+	Vec3f boundsMax;
+	uint32_t primCount;		// zero for interior nodes
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fit in half of cache line");
+
+/* Unlike AccelerationStructure, BVH partitions primitives, not space:
+ * every primitive is referenced by exactly one leaf, and child bounds
+ * are fitted tightly around their primitives, so children may overlap */
+class BVH
+{
+public:
+	BVH();
+	~BVH();
+
+	// Build hierarchy, prims are reordered in the process. With pool
+	// big nodes are binned and subtrees are built in parallel.
+	// Linear builders sort prims by Morton code of centroids instead of
+	// binning every node, they are several times faster and trees are worse
+	void build(std::vector<BVHPrimitive>& prims, ThreadPool* pool = nullptr,
+		BVHQuality quality = BVHQuality::SAH);
+
+	// Try intersection. intersectLeaf(begin, end, tMax) is called for every visited leaf
+	// with its range of primIndices, it has to return true and shrink tMax if it found
+	// closer hit. Whole leaf at once lets the caller test several primitives together
+	template<typename F>
+	bool intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const;
+
+	// Trace rays of the mask together. intersectLeaf(begin, end, rayMask) is called for
+	// every visited leaf with rays that may hit it, and shrinks packet.tMax of the rays
+	// it found closer hits for. Packet that is not coherent is traced ray by ray
+	template<typename F>
+	void intersectPacket(RayPacket& packet, uint64_t mask, F&& intersectLeaf) const;
+
+	// Any hit before tMax. occludedLeaf(begin, end, tMax) is called for visited leaves
+	// and returns true if it hits something, then traversal stops. Nearer children are
+	// still visited first, occluders are often close to the ray origin
+	template<typename F>
+	bool occluded(const Ray& ray, float tMax, F&& occludedLeaf) const;
+
+	// Count boxes intersected by ray
+	int countBoxes(const Ray& ray) const;
+
+	// Fit node boxes to moved primitives, shape of the tree is kept.
+	// primBounds is indexed by primitive index
+	void refit(const std::vector<BBox>& primBounds);
+
+	// Expected cost of a ray passing the root box. Refitted tree gets worse
+	// than a new one as boxes grow and overlap
+	float sahCost() const;
+
+	// Ray box slab test, box is skipped if it lies further than tMax.
+	// Inverse direction is computed once per ray, not per box
+	static bool intersectBox(const BVHNode& node, const Vec3f& orig, const Vec3f& invDir,
+		const float tMax, float& tNear);
+
+	// Packet box test. Interval test culls the box for all rays at once, if it passes
+	// rays are tested from both ends of [first, last] until hit ones are found, and
+	// the range is narrowed to them. Rays in between are not tested
+	static bool intersectBox(const BVHNode& node, const RayPacket& packet, uint64_t mask,
+		int& first, int& last);
+
+	// Flattened tree, root is the first node
+	std::vector<BVHNode> nodes;
+
+	// Primitive indices in leaf order
+	std::vector<uint32_t> primIndices;
+
+	// Number of bins for SAH evaluation
+	static constexpr int binCount = 16;
+	// Leaf bigger than that is always split
+	static constexpr uint32_t maxLeafSize = 8;
+	// Cost of traversal step relative to cost of primitive intersection
+	static constexpr float traversalCost = 1.0f;
+	// Deeper nodes are not split, so traversal stack has fixed size
+	static constexpr int maxDepth = 64;
+	// Nodes with more primitives are binned in parallel
+	static constexpr size_t parallelThreshold = 1 << 16;
+	// Subtrees with more primitives are built as separate tasks
+	static constexpr size_t taskThreshold = 1 << 12;
+	// Linear BVH leaves, smaller than SAH ones as splits are not optimized
+	static constexpr uint32_t linearLeafSize = 4;
+	// Hybrid builder groups primitives by that many top Morton bits, groups are joined by SAH
+	static constexpr int hybridTopBits = 12;
+
+private:
+	struct BuildContext;
+	struct Bin;
+	struct MortonGroup;
+
+	std::unique_ptr<BVHBuildNode> buildRecursive(BuildContext& ctx, size_t begin, size_t end, int depth);
+	static void computeBounds(BuildContext& ctx, size_t begin, size_t end, BBox& bounds, BBox& centroidBounds);
+	static void computeBins(BuildContext& ctx, size_t begin, size_t end, int axis,
+		float cMin, float cExtent, Bin bins[binCount]);
+	static int getBin(const BVHPrimitive& prim, int axis, float cMin, float cExtent);
+
+	// Linear builder: sort by Morton code, split ranges by the highest differing bit
+	std::unique_ptr<BVHBuildNode> buildLinear(BuildContext& ctx, bool sahTopLevels);
+	static void sortByMortonCode(BuildContext& ctx, const BBox& centroidBounds);
+	std::unique_ptr<BVHBuildNode> emitLinear(BuildContext& ctx, size_t begin, size_t end, int bit, int depth);
+	std::unique_ptr<BVHBuildNode> buildGroups(BuildContext& ctx, std::vector<MortonGroup>& groups,
+		size_t begin, size_t end, int depth);
+
+	// Store build tree in depth-first order, returns index of the node
+	uint32_t flatten(const BVHBuildNode* node);
+};
+
+// Node of the wide tree. Bounds of all children are stored as structure of arrays,
+// so they are tested against the ray with one SIMD slab test. Leaves are stored
+// in the parent as primitive ranges, empty slots have inverted bounds
+template<int Width>
+struct alignas(32) WideBVHNode
+{
+	float boundsMin[3][Width];
+	float boundsMax[3][Width];
+	uint32_t offset[Width];		// index of child node, or first primitive for leaves
+	uint32_t primCount[Width];	// zero for interior children and empty slots
+};
+
+/* Wide BVH is collapsed from the binary one: children of the biggest boxes are
+ * pulled up into their parent until it has Width children. It halves (BVH4) or
+ * thirds (BVH8) the depth of the tree, and boxes on every level are tested at once */
+template<int Width>
+class WideBVH
+{
+public:
+	static_assert(Width == 4 || Width == 8, "Only 4 and 8 wide trees are supported");
+
+	// Build from binary BVH
+	void collapse(const BVH& bvh);
+
+	// Same contract as BVH::intersect
+	template<typename F>
+	bool intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const;
+
+	// Same contract as BVH::occluded
+	template<typename F>
+	bool occluded(const Ray& ray, float tMax, F&& occludedLeaf) const;
+
+	// Count boxes intersected by ray
+	int countBoxes(const Ray& ray) const;
+
+	// Same as for BVH
+	void refit(const std::vector<BBox>& primBounds);
+	float sahCost() const;
+
+	// Test ray against all children of the node, returns bitmask of hit children.
+	// dirIsNeg selects which plane of the slab the ray enters first
+	static int intersectBoxes(const WideBVHNode<Width>& node, const Vec3f& orig, const Vec3f& invDir,
+		const int dirIsNeg[3], const float tMax, float tNear[Width]);
+
+	// Root is the first node, children are stored after their parent
+	std::vector<WideBVHNode<Width>> nodes;
+
+	// Primitive indices in leaf order
+	std::vector<uint32_t> primIndices;
+
+	// Every visited node leaves at most Width - 1 children on stack
+	static constexpr int stackSize = BVH::maxDepth * (Width - 1) + 1;
+
+private:
+	uint32_t collapseNode(const BVH& bvh, uint32_t binaryIndex);
+};
+
+// Node of the compressed tree, 4 children like WideBVHNode<4> in half of its size.
+// Child boxes are stored in 8 bits per plane on a grid spanning the node box, grid
+// cell is a power of two. Boxes are rounded outwards, so they only grow
+struct alignas(64) QuantizedBVHNode
+{
+	float origin[3];			// minimum corner of the grid
+	int8_t exponent[3];			// grid cell is 2^exponent
+	uint8_t childMask;			// bit per used slot
+	uint8_t qMin[3][4];
+	uint8_t qMax[3][4];
+	uint32_t offset[4];			// index of child node, or first primitive for leaves
+	uint8_t primCount[4];		// zero for interior children and empty slots
+};
+static_assert(sizeof(QuantizedBVHNode) == 64, "QuantizedBVHNode should fit in cache line");
+
+/* Compressed BVH is collapsed from the binary one as BVH4 and then quantized,
+ * it takes half of memory of BVH or BVH4. Boxes are a bit bigger, so
+ * rays visit more nodes, and every box is decoded before the slab test */
+class QuantizedBVH
+{
+public:
+	// Build from binary BVH
+	void compress(const BVH& bvh);
+
+	// Same contract as BVH::intersect
+	template<typename F>
+	bool intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const;
+
+	// Same contract as BVH::occluded
+	template<typename F>
+	bool occluded(const Ray& ray, float tMax, F&& occludedLeaf) const;
+
+	// Count boxes intersected by ray
+	int countBoxes(const Ray& ray) const;
+
+	// Same as for BVH
+	void refit(const std::vector<BBox>& primBounds);
+	float sahCost() const;
+
+	// Same as WideBVH::intersectBoxes, boxes are decoded on the fly
+	static int intersectBoxes(const QuantizedBVHNode& node, const Vec3f& orig, const Vec3f& invDir,
+		const int dirIsNeg[3], const float tMax, float tNear[4]);
+
+	// Decoded box of the child
+	static BBox childBounds(const QuantizedBVHNode& node, int i);
+
+	// Size of grid cell along axis
+	static float cellSize(const QuantizedBVHNode& node, int axis)
+	{
+		// Exponent is kept in the range of normal floats, so the bits are assembled directly
+		const uint32_t bits = (uint32_t)(node.exponent[axis] + 127) << 23;
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	// Root is the first node, children are stored after their parent
+	std::vector<QuantizedBVHNode> nodes;
+
+	// Primitive indices in leaf order
+	std::vector<uint32_t> primIndices;
+
+	// Leaf slot stores primitive count in a byte, bigger leaves are split between extra nodes
+	static constexpr uint32_t maxLeafSize = 255;
+	// Extra nodes of big leaves are not deeper than that
+	static constexpr int maxLeafDepth = 16;
+	static constexpr int stackSize = (BVH::maxDepth + maxLeafDepth) * 3 + 1;
+
+private:
+	// Fit the grid of the node around used slots and store them on it
+	static void quantize(QuantizedBVHNode& node, const BBox slots[4]);
+	uint32_t addLeafNode(uint32_t firstPrim, uint32_t primCount, const BBox& bounds);
+};
+
+inline bool BVH::intersectBox(const BVHNode& node, const Vec3f& orig, const Vec3f& invDir,
+	const float tMax, float& tNear)
+{
+	if (options::collectStatistics) {
+		stats::accelStructTests++;
+	}
+	float t0 = 0.0f, t1 = tMax;
+	for (uint8_t i = 0; i < 3; i++) {
+		float tMin = (node.boundsMin[i] - orig[i]) * invDir[i];
+		float tFar = (node.boundsMax[i] - orig[i]) * invDir[i];
+		if (tMin > tFar) std::swap(tMin, tFar);
+		t0 = tMin > t0 ? tMin : t0;
+		t1 = tFar < t1 ? tFar : t1;
+		if (t0 > t1) return false;
+	}
+	tNear = t0;
+	return true;
+}
+
+template<typename F>
+bool BVH::intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+
+	float tNear;
+	if (!intersectBox(nodes[0], ray.orig, invDir, tMax, tNear))
+		return false;
+
+	// Subtrees still to visit, with distance to their boxes
+	struct StackEntry
+	{
+		uint32_t node;
+		float tNear;
+	} stack[maxDepth];
+	int stackSize = 0;
+
+	bool hit = false;
+	uint32_t nodeIndex = 0;
+	while (true) {
+		const BVHNode& node = nodes[nodeIndex];
+		if (node.primCount > 0) {
+			// Leaf, check all primitives
+			if (intersectLeaf(node.offset, node.offset + node.primCount, tMax))
+				hit = true;
+		}
+		else {
+			// Go to the nearer child first, the other one waits on stack
+			uint32_t nearChild = nodeIndex + 1, farChild = node.offset;
+			float tNearChild, tFarChild;
+			bool hitNear = intersectBox(nodes[nearChild], ray.orig, invDir, tMax, tNearChild);
+			bool hitFar = intersectBox(nodes[farChild], ray.orig, invDir, tMax, tFarChild);
+			if (hitNear && hitFar) {
+				if (tFarChild < tNearChild) {
+					std::swap(nearChild, farChild);
+					std::swap(tNearChild, tFarChild);
+				}
+				stack[stackSize++] = { farChild, tFarChild };
+				nodeIndex = nearChild;
+				continue;
+			}
+			else if (hitNear || hitFar) {
+				nodeIndex = hitNear ? nearChild : farChild;
+				continue;
+			}
+		}
+
+		// Take next subtree, skip those behind the closest hit
+		do {
+			if (stackSize == 0)
+				return hit;
+			stackSize--;
+		} while (stack[stackSize].tNear > tMax);
+		nodeIndex = stack[stackSize].node;
+	}
+}
+
+template<typename F>
+bool BVH::occluded(const Ray& ray, float tMax, F&& occludedLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+
+	float tNear;
+	if (!intersectBox(nodes[0], ray.orig, invDir, tMax, tNear))
+		return false;
+
+	uint32_t stack[maxDepth];
+	int stackSize = 0;
+	uint32_t nodeIndex = 0;
+	while (true) {
+		const BVHNode& node = nodes[nodeIndex];
+		if (node.primCount > 0) {
+			if (occludedLeaf(node.offset, node.offset + node.primCount, tMax))
+				return true;
+		}
+		else {
+			uint32_t nearChild = nodeIndex + 1, farChild = node.offset;
+			float tNearChild, tFarChild;
+			bool hitNear = intersectBox(nodes[nearChild], ray.orig, invDir, tMax, tNearChild);
+			bool hitFar = intersectBox(nodes[farChild], ray.orig, invDir, tMax, tFarChild);
+			if (hitNear && hitFar) {
+				if (tFarChild < tNearChild)
+					std::swap(nearChild, farChild);
+				stack[stackSize++] = farChild;
+			}
+			if (hitNear || hitFar) {
+				nodeIndex = hitNear ? nearChild : farChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			return false;
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+inline bool BVH::intersectBox(const BVHNode& node, const RayPacket& packet, uint64_t mask,
+	int& first, int& last)
+{
+	if (options::collectStatistics) {
+		stats::accelStructTests++;
+	}
+	// No ray of the range goes further than the farthest closest hit
+	float tMax = 0.0f;
+	for (int r = first; r <= last; r++)
+		if ((mask >> r & 1) && packet.tMax[r] > tMax)
+			tMax = packet.tMax[r];
+
+	// Slab test with intervals: the earliest entry and the latest exit of any ray
+	float t0 = 0.0f, t1 = tMax;
+	for (uint8_t i = 0; i < 3; i++) {
+		const float nearPlane = packet.dirIsNeg[i] ? node.boundsMax[i] : node.boundsMin[i];
+		const float farPlane = packet.dirIsNeg[i] ? node.boundsMin[i] : node.boundsMax[i];
+		const float nearLo = nearPlane - packet.origMax[i], nearHi = nearPlane - packet.origMin[i];
+		const float farLo = farPlane - packet.origMax[i], farHi = farPlane - packet.origMin[i];
+		const float tMin = std::min(std::min(nearLo * packet.invDirMin[i], nearLo * packet.invDirMax[i]),
+			std::min(nearHi * packet.invDirMin[i], nearHi * packet.invDirMax[i]));
+		const float tFar = std::max(std::max(farLo * packet.invDirMin[i], farLo * packet.invDirMax[i]),
+			std::max(farHi * packet.invDirMin[i], farHi * packet.invDirMax[i]));
+		t0 = tMin > t0 ? tMin : t0;
+		t1 = tFar < t1 ? tFar : t1;
+		if (t0 > t1) return false;
+	}
+
+	// Narrow the range to the first and the last ray that hit the box
+	float tNear;
+	while (first <= last && !((mask >> first & 1) &&
+		intersectBox(node, packet.rays[first].orig, packet.invDirs[first], packet.tMax[first], tNear)))
+		first++;
+	if (first > last)
+		return false;
+	while (last > first && !((mask >> last & 1) &&
+		intersectBox(node, packet.rays[last].orig, packet.invDirs[last], packet.tMax[last], tNear)))
+		last--;
+	return true;
+}
+
+template<typename F>
+void BVH::intersectPacket(RayPacket& packet, uint64_t mask, F&& intersectLeaf) const
+{
+	if (nodes.empty() || mask == 0) return;
+
+	if (!packet.coherent) {
+		// Intervals are unbounded, so every ray takes its own path
+		for (int r = 0; r < packet.size; r++) {
+			if (!(mask >> r & 1))
+				continue;
+			intersect(packet.rays[r], packet.tMax[r], [&](uint32_t begin, uint32_t end, float& tMax)
+				{
+					const float tBefore = tMax;
+					intersectLeaf(begin, end, 1ull << r);
+					return tMax < tBefore;
+				});
+		}
+		return;
+	}
+
+	// Subtrees still to visit, with the range of rays that reached their parent
+	struct StackEntry
+	{
+		uint32_t node;
+		int first, last;
+	} stack[maxDepth];
+	int stackSize = 0;
+
+	int first = 0, last = packet.size - 1;
+	uint32_t nodeIndex = 0;
+	while (true) {
+		const BVHNode& node = nodes[nodeIndex];
+		if (intersectBox(node, packet, mask, first, last)) {
+			if (node.primCount > 0) {
+				// Leaf, ends of the range hit it, rays in between are tested by the box
+				// first, as testing primitives costs more
+				uint64_t leafMask = (1ull << first) | (1ull << last);
+				float tNear;
+				for (int r = first + 1; r < last; r++)
+					if ((mask >> r & 1) && intersectBox(node, packet.rays[r].orig, packet.invDirs[r], packet.tMax[r], tNear))
+						leafMask |= 1ull << r;
+				intersectLeaf(node.offset, node.offset + node.primCount, leafMask);
+			}
+			else {
+				// Child that is nearer along the packet direction goes first
+				uint32_t nearChild = nodeIndex + 1, farChild = node.offset;
+				const Vec3f toFar = (nodes[farChild].boundsMin + nodes[farChild].boundsMax)
+					- (nodes[nearChild].boundsMin + nodes[nearChild].boundsMax);
+				if (toFar.dotProduct(packet.meanDir) < 0)
+					std::swap(nearChild, farChild);
+				stack[stackSize++] = { farChild, first, last };
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			return;
+		stackSize--;
+		nodeIndex = stack[stackSize].node;
+		first = stack[stackSize].first;
+		last = stack[stackSize].last;
+	}
+}
+
+template<int Width>
+inline int WideBVH<Width>::intersectBoxes(const WideBVHNode<Width>& node, const Vec3f& orig, const Vec3f& invDir,
+	const int dirIsNeg[3], const float tMax, float tNear[Width])
+{
+	if (options::collectStatistics) {
+		for (int i = 0; i < Width; i++) {
+			if (node.primCount[i] > 0 || node.offset[i] > 0)
+				stats::accelStructTests++;
+		}
+	}
+
+	// Planes the ray enters and leaves slab through
+	const float* nearPlane[3];
+	const float* farPlane[3];
+	for (int a = 0; a < 3; a++) {
+		nearPlane[a] = dirIsNeg[a] ? node.boundsMax[a] : node.boundsMin[a];
+		farPlane[a] = dirIsNeg[a] ? node.boundsMin[a] : node.boundsMax[a];
+	}
+
+#if defined(RT_USE_AVX)
+	if constexpr (Width == 8) {
+		__m256 tEnter = _mm256_setzero_ps();
+		__m256 tExit = _mm256_set1_ps(tMax);
+		for (int a = 0; a < 3; a++) {
+			const __m256 o = _mm256_set1_ps(orig[a]);
+			const __m256 inv = _mm256_set1_ps(invDir[a]);
+			tEnter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlane[a]), o), inv), tEnter);
+			tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlane[a]), o), inv), tExit);
+		}
+		_mm256_storeu_ps(tNear, tEnter);
+		return _mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ));
+	}
+#endif
+#if defined(RT_USE_SSE)
+	// 8 wide node without AVX is tested in two halves
+	int mask = 0;
+	for (int i = 0; i < Width; i += 4) {
+		__m128 tEnter = _mm_setzero_ps();
+		__m128 tExit = _mm_set1_ps(tMax);
+		for (int a = 0; a < 3; a++) {
+			const __m128 o = _mm_set1_ps(orig[a]);
+			const __m128 inv = _mm_set1_ps(invDir[a]);
+			tEnter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearPlane[a] + i), o), inv), tEnter);
+			tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farPlane[a] + i), o), inv), tExit);
+		}
+		_mm_storeu_ps(tNear + i, tEnter);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) << i;
+	}
+	return mask;
+#else
+	int mask = 0;
+	for (int i = 0; i < Width; i++) {
+		float tEnter = 0.0f, tExit = tMax;
+		for (int a = 0; a < 3; a++) {
+			tEnter = std::max((nearPlane[a][i] - orig[a]) * invDir[a], tEnter);
+			tExit = std::min((farPlane[a][i] - orig[a]) * invDir[a], tExit);
+		}
+		tNear[i] = tEnter;
+		if (tEnter <= tExit)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+template<int Width>
+template<typename F>
+bool WideBVH<Width>::intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	// Nodes and leaves still to visit, with distance to their boxes
+	struct StackEntry
+	{
+		uint32_t offset;
+		uint32_t primCount;
+		float tNear;
+	} stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = { 0, 0, 0.0f };
+
+	bool hit = false;
+	while (stackTop > 0) {
+		const StackEntry entry = stack[--stackTop];
+		if (entry.tNear > tMax)
+			continue;
+
+		if (entry.primCount > 0) {
+			// Leaf, check all primitives
+			if (intersectLeaf(entry.offset, entry.offset + entry.primCount, tMax))
+				hit = true;
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = nodes[entry.offset];
+		float tNear[Width];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, tMax, tNear);
+
+		// Push hit children from the farthest to the nearest, so the nearest is visited first
+		int order[Width];
+		int hitCount = 0;
+		for (int i = 0; i < Width; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+		for (int j = 0; j < hitCount; j++) {
+			const int i = order[j];
+			stack[stackTop++] = { node.offset[i], node.primCount[i], tNear[i] };
+		}
+	}
+	return hit;
+}
+
+template<int Width>
+template<typename F>
+bool WideBVH<Width>::occluded(const Ray& ray, float tMax, F&& occludedLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	struct StackEntry
+	{
+		uint32_t offset;
+		uint32_t primCount;
+	} stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = { 0, 0 };
+
+	while (stackTop > 0) {
+		const StackEntry entry = stack[--stackTop];
+		if (entry.primCount > 0) {
+			if (occludedLeaf(entry.offset, entry.offset + entry.primCount, tMax))
+				return true;
+			continue;
+		}
+
+		const WideBVHNode<Width>& node = nodes[entry.offset];
+		float tNear[Width];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, tMax, tNear);
+
+		// Push hit children from the farthest to the nearest
+		int order[Width];
+		int hitCount = 0;
+		for (int i = 0; i < Width; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+		for (int j = 0; j < hitCount; j++) {
+			const int i = order[j];
+			stack[stackTop++] = { node.offset[i], node.primCount[i] };
+		}
+	}
+	return false;
+}
+
+inline int QuantizedBVH::intersectBoxes(const QuantizedBVHNode& node, const Vec3f& orig, const Vec3f& invDir,
+	const int dirIsNeg[3], const float tMax, float tNear[4])
+{
+	if (options::collectStatistics) {
+		for (int i = 0; i < 4; i++) {
+			if (node.childMask & (1 << i))
+				stats::accelStructTests++;
+		}
+	}
+
+	// Planes the ray enters and leaves slab through
+	const uint8_t* nearPlane[3];
+	const uint8_t* farPlane[3];
+	for (int a = 0; a < 3; a++) {
+		nearPlane[a] = dirIsNeg[a] ? node.qMax[a] : node.qMin[a];
+		farPlane[a] = dirIsNeg[a] ? node.qMin[a] : node.qMax[a];
+	}
+
+#if defined(RT_USE_SSE)
+	// Widen 4 bytes to 4 floats
+	auto decode = [](const uint8_t* q)
+	{
+		int32_t packed;
+		memcpy(&packed, q, sizeof(packed));
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bytes = _mm_cvtsi32_si128(packed);
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+	};
+	__m128 tEnter = _mm_setzero_ps();
+	__m128 tExit = _mm_set1_ps(tMax);
+	for (int a = 0; a < 3; a++) {
+		const __m128 origin = _mm_set1_ps(node.origin[a]);
+		const __m128 cell = _mm_set1_ps(cellSize(node, a));
+		const __m128 o = _mm_set1_ps(orig[a]);
+		const __m128 inv = _mm_set1_ps(invDir[a]);
+		const __m128 nearBound = _mm_add_ps(origin, _mm_mul_ps(decode(nearPlane[a]), cell));
+		const __m128 farBound = _mm_add_ps(origin, _mm_mul_ps(decode(farPlane[a]), cell));
+		tEnter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearBound, o), inv), tEnter);
+		tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farBound, o), inv), tExit);
+	}
+	_mm_storeu_ps(tNear, tEnter);
+	return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) & node.childMask;
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float tEnter = 0.0f, tExit = tMax;
+		for (int a = 0; a < 3; a++) {
+			const float cell = cellSize(node, a);
+			tEnter = std::max((node.origin[a] + nearPlane[a][i] * cell - orig[a]) * invDir[a], tEnter);
+			tExit = std::min((node.origin[a] + farPlane[a][i] * cell - orig[a]) * invDir[a], tExit);
+		}
+		tNear[i] = tEnter;
+		if (tEnter <= tExit)
+			mask |= 1 << i;
+	}
+	return mask & node.childMask;
+#endif
+}
+
+template<typename F>
+bool QuantizedBVH::intersect(const Ray& ray, float& tMax, F&& intersectLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	// Nodes and leaves still to visit, with distance to their boxes
+	struct StackEntry
+	{
+		uint32_t offset;
+		uint32_t primCount;
+		float tNear;
+	} stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = { 0, 0, 0.0f };
+
+	bool hit = false;
+	while (stackTop > 0) {
+		const StackEntry entry = stack[--stackTop];
+		if (entry.tNear > tMax)
+			continue;
+
+		if (entry.primCount > 0) {
+			// Leaf, check all primitives
+			if (intersectLeaf(entry.offset, entry.offset + entry.primCount, tMax))
+				hit = true;
+			continue;
+		}
+
+		const QuantizedBVHNode& node = nodes[entry.offset];
+		float tNear[4];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, tMax, tNear);
+
+		// Push hit children from the farthest to the nearest, so the nearest is visited first
+		int order[4];
+		int hitCount = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+		for (int j = 0; j < hitCount; j++) {
+			const int i = order[j];
+			stack[stackTop++] = { node.offset[i], node.primCount[i], tNear[i] };
+		}
+	}
+	return hit;
+}
+
+template<typename F>
+bool QuantizedBVH::occluded(const Ray& ray, float tMax, F&& occludedLeaf) const
+{
+	if (nodes.empty()) return false;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	struct StackEntry
+	{
+		uint32_t offset;
+		uint32_t primCount;
+	} stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = { 0, 0 };
+
+	while (stackTop > 0) {
+		const StackEntry entry = stack[--stackTop];
+		if (entry.primCount > 0) {
+			if (occludedLeaf(entry.offset, entry.offset + entry.primCount, tMax))
+				return true;
+			continue;
+		}
+
+		const QuantizedBVHNode& node = nodes[entry.offset];
+		float tNear[4];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, tMax, tNear);
+
+		// Push hit children from the farthest to the nearest
+		int order[4];
+		int hitCount = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+		for (int j = 0; j < hitCount; j++) {
+			const int i = order[j];
+			stack[stackTop++] = { node.offset[i], node.primCount[i] };
+		}
+	}
+	return false;
+}
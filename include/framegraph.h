@@ -0,0 +1,49 @@
+// Tasks of a frame rendered by tiles, started by their dependencies instead of barriers between passes
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "postprocess.h"
+#include "scene.h"
+#include "threadpool.h"
+
+/* Every tile is rendered by a task, which then counts down the tiles waiting for it.
+ * Edges of a tile are found by comparing its pixels with their neighbours, so a tile is
+ * supersampled as soon as it and every tile sharing a side with it are rendered. Edges
+ * come from luminance of the rendered colors, kept apart, since supersampling of a
+ * neighbour changes its colors. A finished tile is added to the image right away, so
+ * rows of the file are written while other tiles are still rendered */
+class FrameGraph
+{
+public:
+	// Tiles cover the image without overlaps. Supersampling uses first hits of
+	// Scene::pixelHits if they are recorded. image may be nullptr
+	FrameGraph(Scene& scene, Vec3f* frameBuffer, const std::vector<tileInfo>& tiles, bool supersample,
+		ImageStream* image);
+
+	// Run tasks of all tiles and return when they are finished.
+	// times are set to render times of tiles without supersampling, in milliseconds
+	void run(ThreadPool& pool, std::vector<float>& times);
+
+private:
+	void renderTile(size_t i);
+	// Supersample edges of tile i and add it to the image
+	void finishTile(size_t i);
+
+	Scene& scene;
+	Vec3f* frameBuffer;
+	const std::vector<tileInfo>& tiles;
+	const bool supersample;
+	ImageStream* image;
+
+	std::vector<std::vector<size_t>> neighbours;		// tiles sharing a side with the tile
+	std::unique_ptr<std::atomic<int>[]> waiting;		// tiles of those and itself not rendered yet
+	std::vector<float> lum;								// of rendered pixels
+	std::unique_ptr<bool[]> edges;
+
+	ThreadPool* pool = nullptr;
+	TaskGroup group;
+	std::vector<float>* times = nullptr;
+};
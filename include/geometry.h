@@ -1,4 +1,4 @@
-// containing geometry objects: 2d vector, 3d vector, 4d matrix, 3d Ray
+// containing geometry objects: 2d vector, 3d vector, 4d matrix, 3d Ray, bounding box
 #pragma once
 
 #include <cstdlib> 
@@ -6,6 +6,9 @@
 #include <iostream> 
 #include <iomanip> 
 #include <cmath> 
+#include <limits>
+#include <cstdint>
+#include <algorithm>
 
 template<typename T>
 class Vec2
@@ -306,6 +309,16 @@ public:
 		return dst;
 	}
 
+	// Transform direction, translation is ignored
+	template<typename S>
+	Vec3<S> multDirMatrix(const Vec3<S>& src) const
+	{
+		return Vec3<S>(
+			src[0] * x[0][0] + src[1] * x[1][0] + src[2] * x[2][0],
+			src[0] * x[0][1] + src[1] * x[1][1] + src[2] * x[2][1],
+			src[0] * x[0][2] + src[1] * x[1][2] + src[2] * x[2][2]);
+	}
+
 	Matrix44 inverse() const
 	{
 		int i, j, k;
@@ -435,3 +448,138 @@ public:
 	Ray(const Vec3f& a_orig = { 0,0,0 }, const Vec3f& a_dir = { 0,0,-1 }, const RayType a_rayType = RayType::PrimaryRay)
 		: orig(a_orig), dir(a_dir), rayType(a_rayType) {}
 };
+
+// Rays traced through a tree together, such as a block of neighbouring primary rays.
+// Intervals of their origins and inverse directions bound the whole packet, so one
+// box test may cull all of them. Rays are addressed by bits of 64 bit masks
+class RayPacket
+{
+public:
+	static constexpr int maxSize = 64;
+
+	void clear()
+	{
+		size = 0;
+	}
+
+	// Add ray, returns its index
+	int add(const Ray& ray, float a_tMax = std::numeric_limits<float>::max())
+	{
+		rays[size] = ray;
+		tMax[size] = a_tMax;
+		return size++;
+	}
+
+	// Compute inverse directions and intervals, after all rays were added
+	void finish()
+	{
+		origMin = invDirMin = Vec3f(std::numeric_limits<float>::max());
+		origMax = invDirMax = Vec3f(-std::numeric_limits<float>::max());
+		meanDir = Vec3f(0);
+		coherent = size > 0;
+		for (uint8_t i = 0; i < 3; i++)
+			dirIsNeg[i] = size > 0 && rays[0].dir[i] < 0;
+		for (int r = 0; r < size; r++) {
+			invDirs[r] = 1 / rays[r].dir;
+			meanDir += rays[r].dir;
+			for (uint8_t i = 0; i < 3; i++) {
+				origMin[i] = std::min(origMin[i], rays[r].orig[i]);
+				origMax[i] = std::max(origMax[i], rays[r].orig[i]);
+				invDirMin[i] = std::min(invDirMin[i], invDirs[r][i]);
+				invDirMax[i] = std::max(invDirMax[i], invDirs[r][i]);
+				// Interval of inverse directions is bounded only if no ray is parallel
+				// to the axis and all of them go the same way along it
+				if (rays[r].dir[i] == 0 || (rays[r].dir[i] < 0) != dirIsNeg[i])
+					coherent = false;
+			}
+		}
+	}
+
+	// Mask of all rays
+	uint64_t fullMask() const
+	{
+		return size == maxSize ? ~0ull : (1ull << size) - 1;
+	}
+
+	Ray rays[maxSize];
+	Vec3f invDirs[maxSize];
+	// Closest hit of every ray so far, shrunk during traversal
+	float tMax[maxSize];
+	int size = 0;
+
+	// Bounds of the packet, box tests use them only when it is coherent.
+	// Otherwise the rays are traced one by one
+	Vec3f origMin, origMax;
+	Vec3f invDirMin, invDirMax;
+	int dirIsNeg[3] = { 0, 0, 0 };
+	Vec3f meanDir;
+	bool coherent = false;
+};
+
+// Axis aligned bounding box, bounds[0] is minimum and bounds[1] is maximum
+class BBox
+{
+public:
+	// Empty box, extending it with any point gives that point
+	BBox() : bounds{ Vec3f(std::numeric_limits<float>::max()), Vec3f(-std::numeric_limits<float>::max()) } {}
+
+	BBox(const Vec3f& a_min, const Vec3f& a_max) : bounds{ a_min, a_max } {}
+
+	void extend(const Vec3f& p)
+	{
+		bounds[0] = Vec3f(std::min(bounds[0].x, p.x), std::min(bounds[0].y, p.y), std::min(bounds[0].z, p.z));
+		bounds[1] = Vec3f(std::max(bounds[1].x, p.x), std::max(bounds[1].y, p.y), std::max(bounds[1].z, p.z));
+	}
+
+	// Empty box leaves this one unchanged
+	void extend(const BBox& b)
+	{
+		const Vec3f& bMin = b.bounds[0];
+		const Vec3f& bMax = b.bounds[1];
+		bounds[0] = Vec3f(std::min(bounds[0].x, bMin.x), std::min(bounds[0].y, bMin.y), std::min(bounds[0].z, bMin.z));
+		bounds[1] = Vec3f(std::max(bounds[1].x, bMax.x), std::max(bounds[1].y, bMax.y), std::max(bounds[1].z, bMax.z));
+	}
+
+	bool empty() const
+	{
+		return bounds[0].x > bounds[1].x || bounds[0].y > bounds[1].y || bounds[0].z > bounds[1].z;
+	}
+
+	Vec3f centroid() const
+	{
+		return (bounds[0] + bounds[1]) * 0.5f;
+	}
+
+	Vec3f extent() const
+	{
+		return bounds[1] - bounds[0];
+	}
+
+	float surfaceArea() const
+	{
+		if (empty()) return 0.0f;
+		Vec3f d = extent();
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// Index of the longest axis
+	int maxExtent() const
+	{
+		Vec3f d = extent();
+		if (d.x > d.y && d.x > d.z) return 0;
+		else if (d.y > d.z) return 1;
+		return 2;
+	}
+
+	const Vec3f& operator [] (uint8_t i) const
+	{
+		return bounds[i];
+	}
+
+	Vec3f& operator [] (uint8_t i)
+	{
+		return bounds[i];
+	}
+
+	Vec3f bounds[2];
+};
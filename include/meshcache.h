@@ -0,0 +1,33 @@
+// On-disk cache of loaded meshes, unchanged assets skip OBJ parsing and tree build
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+class Mesh;
+class Options;
+
+/* Cache file is a fixed header followed by raw arrays: index triangles, their
+ * OBJ faces, vertices, normals, texture coordinates, tree nodes and triangle
+ * indices. Every array starts at 32 byte aligned offset, so the file may be
+ * mapped to memory as it is. File name is the key: hash of OBJ bytes and of every setting that
+ * changes loaded triangles or the tree */
+class MeshCache
+{
+public:
+	// Key of the mesh, objBytes is content of the OBJ file
+	static uint64_t computeKey(const std::string& objBytes, const Mesh& mesh, const Options& options);
+
+	// Load triangles and acceleration structure into empty mesh.
+	// Returns false if there is no valid file for the key
+	static bool load(Mesh& mesh, uint64_t key, const Options& options);
+
+	// Store loaded mesh, failure is reported but not fatal
+	static bool save(const Mesh& mesh, uint64_t key, const Options& options);
+
+	// Increased on every change of the file layout
+	static constexpr uint32_t version = 4;
+
+private:
+	static std::string getPath(uint64_t key, const Options& options);
+};
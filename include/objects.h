@@ -3,19 +3,31 @@
 
 #include <vector>
 #include <memory>
+#include <future>
 
 class Object;
 class Mesh;
 class AccelerationStructure;
-class Triangle;
+struct Triangle;
 class Sphere;
 class Plane;
-class Triangle;
+class Instance;
+class BVH;
+template<int Width> class WideBVH;
+class QuantizedBVH;
 
 using ObjectVector = std::vector<std::unique_ptr<Object>>;
 // Object type are stored in base class
-enum class ObjectType { Object, Sphere, Plane, Mesh };
+enum class ObjectType { Object, Sphere, Plane, Mesh, Instance };
 enum class MaterialType { Diffuse, Reflective, Transparent, Phong };
+// Split - space partitioning AccelerationStructure, BVH - object partitioning hierarchy,
+// BVH4 and BVH8 - the same hierarchy collapsed into 4 and 8 wide nodes,
+// QBVH - 4 wide hierarchy with quantized boxes, for scenes that don't fit in memory
+enum class AccelType { Split, BVH, BVH4, BVH8, QBVH };
+// MollerTrumbore - triangle edges, cross products for every ray,
+// Affine - transformation into space of unit triangle, faster and 12 bytes bigger,
+// Indexed - Moller-Trumbore on the shared vertices, no extra memory and slower
+enum class TriangleTest { MollerTrumbore, Affine, Indexed };
 
 #include "geometry.h"
 #include "options.h"
@@ -32,6 +44,8 @@ public:
 	// Gets normal and texture in hit point
 	virtual void getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr,
 		const Vec2f& uv, Vec3f& hitNormal, Vec2f& tex) const = 0;
+	// Gets box containing the object, returns false if object is unbounded
+	virtual bool getBounds(BBox& bounds) const;
 
 	ObjectType objectType = ObjectType::Object;
 
@@ -46,24 +60,75 @@ public:
 	float nSpecular = 5.0f;
 };
 
-class Triangle
+// Triangle of indexed mesh, its corners are indices into buffers of the mesh,
+// so faces around a vertex share its position, normal and texture coordinate
+struct Triangle
+{
+	uint32_t v[3];		// vertices
+	uint32_t n[3];		// normals, noIndex for faces without them
+	uint32_t t[3];		// texture coordinates, noIndex for faces without them
+
+	static constexpr uint32_t noIndex = UINT32_MAX;
+
+	// Moller-Trumbore test for triangle given by its first vertex and two edges from it
+	static bool rayTriangleIntersect(const Ray& ray, const Vec3f& v0, const Vec3f& v0v1,
+		const Vec3f& v0v2, float& t, Vec2f& uv);
+};
+
+// Part of mesh triangles read by intersection: first vertex and two edges, every
+// coordinate in its own array. Mesh stores triangles in leaf order of its tree,
+// so a leaf reads short contiguous ranges, and shading data of Triangle is
+// touched only for the closest hit
+class TriangleEdges
 {
 public:
-	Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c);
-	Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c, 
-		const Vec3f& a_n_a, const Vec3f& a_n_b, const Vec3f& a_n_c);
-	Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c, 
-		const Vec3f& a_n_a, const Vec3f& a_n_b, const Vec3f& a_n_c,
-		const Vec2f& a_t_a, const Vec2f& a_t_b, const Vec2f& a_t_c);
-	static bool rayTriangleIntersect(const Ray& ray, const Triangle* triPtr,
-		float& t, Vec2f& uv);
-
-	Vec3f a, b, c;			// vertex position
-	Vec3f n_a, n_b, n_c;	// normals in vertices
-	Vec2f t_a, t_b, t_c;	// texture coordinates
-
-	// tangent and bitangent are calculated just once
-	Vec3f tangent, bitangent;
+	// Fill from triangles, index in arrays is the index in tris
+	void assign(const std::vector<Triangle>& tris, const std::vector<Vec3f>& vertices);
+
+	// Update one triangle after its vertices were changed
+	void set(size_t index, const Vec3f& a, const Vec3f& b, const Vec3f& c);
+
+	bool intersect(const Ray& ray, size_t index, float& t, Vec2f& uv) const
+	{
+		return Triangle::rayTriangleIntersect(ray,
+			Vec3f(v0[0][index], v0[1][index], v0[2][index]),
+			Vec3f(edge1[0][index], edge1[1][index], edge1[2][index]),
+			Vec3f(edge2[0][index], edge2[1][index], edge2[2][index]), t, uv);
+	}
+
+	// Closest of triangles [begin, end) nearer than tMax, tMax is shrunk on hit.
+	// Triangles are tested in groups of 8 with AVX and of 4 with SSE, result
+	// is the same as of testing them one by one
+	bool intersect(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+		uint32_t& hitIndex, Vec2f& uv) const;
+
+	// Arrays are longer by that, so the group at the end may be loaded as a whole
+	static constexpr size_t padding = 8;
+
+	std::vector<float> v0[3];
+	std::vector<float> edge1[3];
+	std::vector<float> edge2[3];
+};
+
+/* Transformation of every triangle into space where it is the unit triangle
+ * (0,0,0), (1,0,0), (0,1,0), third axis goes along its normal. Ray crosses
+ * the plane of the triangle where its third coordinate is zero, and the
+ * other two are barycentric coordinates, so the test is a few dot products
+ * and one division. Stored as 3x4 matrix, an array per element */
+class TriangleTransforms
+{
+public:
+	// Same as for TriangleEdges
+	void assign(const std::vector<Triangle>& tris, const std::vector<Vec3f>& vertices);
+	void set(size_t index, const Vec3f& a, const Vec3f& b, const Vec3f& c);
+	bool intersect(const Ray& ray, size_t index, float& t, Vec2f& uv) const;
+	bool intersect(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+		uint32_t& hitIndex, Vec2f& uv) const;
+
+	static constexpr size_t padding = TriangleEdges::padding;
+
+	// rows[i][j] is element of row i and column j, last column is translation
+	std::vector<float> rows[3][4];
 };
 
 class Mesh : public Object
@@ -75,8 +140,22 @@ public:
 	bool intersectObject(const Ray& ray, float& t0, Vec2f& uv) const;
 	bool intersectMesh(const Ray& ray, float& t0, const Triangle*& triPtr,
 		Vec2f& uv) const;
+	// Intersect rays of the mask, hits closer than packet.tMax shrink it and are stored
+	// in triPtrs and uvs at the index of the ray. Returns mask of hit rays. Only BVH
+	// traces the packet together, other structures take its rays one by one
+	uint64_t intersectMeshPacket(RayPacket& packet, uint64_t mask, const Triangle* triPtrs[],
+		Vec2f uvs[]) const;
+	// Any hit closer than maxT, traversal stops at the first one. triPtr is the hit triangle
+	bool occludedMesh(const Ray& ray, float maxT, const Triangle*& triPtr) const;
+	// Single triangle of the mesh, by its index in triangles, closer than maxT, with the test
+	// traversal uses. Index out of range is never hit
+	bool occludedTriangle(const Ray& ray, uint32_t index, float maxT) const;
 	void getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr,
 		const Vec2f& uv, Vec3f& hitNormal, Vec2f& texCoord) const;
+	bool getBounds(BBox& bounds) const;
+
+	// Count acceleration structures intersected by ray
+	int countAC(const Ray& ray) const;
 
 	// Get value from map
 	Vec3f getDiffuseColor(const Vec2f& hitTexCoordinates) const;
@@ -87,6 +166,25 @@ public:
 	bool loadDiffuseMap(const std::string& filename);
 	bool loadNormalMap(const std::string& filename);
 	bool loadSpecularMap(const std::string& filename);
+	void buildBVH(const Options& options);
+
+	// Move triangles to new position and rotation, as if mesh was loaded there
+	void moveTo(const Vec3f& a_pos, const Vec3f& a_rot, const Options& options);
+
+	// Update acceleration structure after triangles were changed in place.
+	// BVH boxes are refitted, when the tree gets too slow a new one is built
+	// in background and taken by one of the next refits. Taking it sorts triangles
+	// again, so Triangle pointers and indices kept from before a refit are invalid
+	void refit(const Options& options);
+
+	// Fill triEdges or triTransforms from triangles
+	void assignTriangleData();
+
+	// Position of triangle corner
+	const Vec3f& getVertex(const Triangle& tri, int corner) const
+	{
+		return vertices[tri.v[corner]];
+	}
 
 	// Objects are normalized upon loading, such as they fit in size 
 	// Proportions are not modified
@@ -94,12 +192,36 @@ public:
 
 	// Also, object may be rotated
 	Vec3f rot;
+
+	// Box around all triangles, after transformation
+	BBox bounds;
 	
-	// Save all pointers in one place, to avoid double deletion
-	std::vector<const Triangle*> allTris;
+	// Geometry buffers, each vertex, normal and texture coordinate is stored once
+	std::vector<Vec3f> vertices;
+	std::vector<Vec3f> normals;
+	std::vector<Vec2f> texCoords;
+
+	// With BVH triangles are sorted in leaf order of the tree
+	std::vector<Triangle> triangles;
+	// OBJ face of every triangle, counted from zero. Polygons give several triangles of one face
+	std::vector<uint32_t> faces;
+
+	// Positions of triangles for intersection, BVH only. One of them is filled,
+	// none for Indexed test, which reads the vertices through triangles
+	TriangleTest triangleTest = TriangleTest::MollerTrumbore;
+	TriangleEdges triEdges;
+	TriangleTransforms triTransforms;
 
 	// Stores triangle, accelerates intersection
+	AccelType accelType = AccelType::BVH;
 	std::unique_ptr<AccelerationStructure> ac;
+	std::unique_ptr<BVH> bvh;
+	std::unique_ptr<WideBVH<4>> bvh4;
+	std::unique_ptr<WideBVH<8>> bvh8;
+	std::unique_ptr<QuantizedBVH> qbvh;
+	// Cost of the tree right after build, refitted tree is compared with it
+	float builtCost = 0.0f;
+	std::future<std::unique_ptr<BVH>> rebuiltBVH;
 	
 	// Diffuse map stores color
 	bool diffuseMapLoaded = false;
@@ -118,6 +240,70 @@ public:
 	int specularMapWidth = 0;
 	int specularMapHeight = 0;
 	float* specularMap = nullptr;
+
+private:
+	// Use binary tree, or collapse it into the wide one
+	void setBVH(std::unique_ptr<BVH> tree);
+
+	// Closest of triangles [begin, end) nearer than tMax, with the selected test
+	bool intersectTriangles(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+		uint32_t& index, Vec2f& uv) const;
+};
+
+// Mesh placed in the scene with its own transformation and material.
+// Triangles, acceleration structure and maps are shared between all instances of a mesh
+class Instance : public Object
+{
+public:
+	Instance();
+
+	bool intersectObject(const Ray& ray, float& t0, Vec2f& uv) const;
+	bool intersectInstance(const Ray& ray, float& t0, const Triangle*& triPtr,
+		Vec2f& uv) const;
+	// Same as Mesh::intersectMeshPacket, rays are moved into the mesh space
+	uint64_t intersectInstancePacket(RayPacket& packet, uint64_t mask, const Triangle* triPtrs[],
+		Vec2f uvs[]) const;
+	bool occludedInstance(const Ray& ray, float maxT, const Triangle*& triPtr) const;
+	bool occludedTriangle(const Ray& ray, uint32_t index, float maxT) const;
+	void getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr,
+		const Vec2f& uv, Vec3f& hitNormal, Vec2f& texCoord) const;
+	bool getBounds(BBox& bounds) const;
+
+	// Count acceleration structures intersected by ray
+	int countAC(const Ray& ray) const;
+
+	// Get value from map of the mesh, or own color if it has no map
+	Vec3f getDiffuseColor(const Vec2f& hitTexCoordinates) const;
+	float getSpecularValue(const Vec2f& hitTexCoordinates) const;
+
+	// Set shared mesh and compute transformation
+	void setMesh(std::shared_ptr<const Mesh> a_mesh);
+
+	// Compute transformation from rot, scale and pos, after any of them changed
+	void updateTransform();
+
+	// Mesh is loaded in the origin with given size, accelerator and maps,
+	// instances with equal loading info share it
+	std::string meshName;
+	Vec3f size;
+	AccelType accelType = AccelType::BVH;
+	TriangleTest triangleTest = TriangleTest::MollerTrumbore;
+	std::string diffuseMapName;
+	std::string normalMapName;
+	std::string specularMapName;
+
+	// Transformation: scale, then rotation, then translation to pos
+	Vec3f rot;
+	float scale = 1.0f;
+
+	std::shared_ptr<const Mesh> mesh;
+	Matrix44f objectToWorld;
+	Matrix44f worldToObject;
+	// Inverse transpose, transforms normals
+	Matrix44f normalToWorld;
+
+private:
+	Ray toObject(const Ray& ray) const;
 };
 
 // Acceleration Structure is used to speed up ray-mesh intersection
@@ -130,36 +316,43 @@ public:
 	// Set min and max coordinates
 	void setBounds(const Vec3f& a, const Vec3f& b);
 
-	// Create AC tree
-	void setup(std::vector<const Triangle*>& a_tris, int a_depth, const Options& options);
+	// Create AC tree. Triangles are indices into mesh triangles
+	void setup(const Mesh& mesh, std::vector<uint32_t>& a_tris, int a_depth, const Options& options);
 	
 	// Try intersection
 	bool intersectBox(const Ray& ray) const;
 	
 	// Try intersection with AC mesh
-	bool intersectAccelStruct(const Ray& ray, float& t0, const Triangle*& triPtr, Vec2f& uv) const;
+	bool intersectAccelStruct(const Mesh& mesh, const Ray& ray, float& t0, const Triangle*& triPtr, Vec2f& uv) const;
+
+	// Any triangle hit closer than maxT
+	bool occludedAccelStruct(const Mesh& mesh, const Ray& ray, float maxT, const Triangle*& triPtr) const;
 	
 	// Count intersections AC and sub-AC with ray
 	int recCountAC(const Ray& ray);
 
 	// Calculate SAH - Surface Area Heuristic
-	static float calculateSAH(const int orientation, const std::vector<const Triangle*>& tris,
+	static float calculateSAH(const Mesh& mesh, const int orientation, const std::vector<uint32_t>& tris,
 		const Vec3f bounds[2], const float boundary);
 
 	// Run binary search to determine optimal split
-	static float binarySearchSAH(const int orientation, const std::vector<const Triangle*>& tris,
+	static float binarySearchSAH(const Mesh& mesh, const int orientation, const std::vector<uint32_t>& tris,
 		const Vec3f bounds[2], const float left, const float right);
 	
 	// Get coordinate of optimal split
-	static float getOptimalSplit(const std::vector<const Triangle*>& tris, const int orientation,
-		const Vec3f bounds[2], std::vector<const Triangle*>& trisLeft, std::vector<const Triangle*>& trisRight);
+	static float getOptimalSplit(const Mesh& mesh, const std::vector<uint32_t>& tris, const int orientation,
+		const Vec3f bounds[2], std::vector<uint32_t>& trisLeft, std::vector<uint32_t>& trisRight);
+
+	// Smallest and biggest coordinate of triangle corners along axis
+	static float minCoord(const Mesh& mesh, uint32_t tri, int axis);
+	static float maxCoord(const Mesh& mesh, uint32_t tri, int axis);
 
 	// Left and Right ancestors
 	std::unique_ptr<AccelerationStructure> left;
 	std::unique_ptr<AccelerationStructure> right;
 	
 	// If AC has no ancestors, it has triangles
-	std::vector<const Triangle*> tris;
+	std::vector<uint32_t> tris;
 	Vec3f bounds[2];
 };
 
@@ -172,6 +365,7 @@ public:
 	bool intersectObject(const Ray& ray, float& t0, Vec2f& uv) const;
 	void getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr, const Vec2f& uv,
 		Vec3f& hitNormal, Vec2f& tex) const;
+	bool getBounds(BBox& bounds) const;
 
 	float r;
 	float r2;
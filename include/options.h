@@ -6,6 +6,16 @@
 
 #include "geometry.h"
 
+// BVH builder: binned SAH, linear BVH over Morton codes,
+// or linear BVH with top levels built by SAH
+enum class BVHQuality { SAH, LBVH, Hybrid };
+
+// Recursive castRay per pixel, or wavefront renderer tracing all paths bounce by bounce
+enum class Integrator { Recursive, Wavefront };
+
+// Tiles of fixed size in image order, or split and ordered by costs of a low resolution pass
+enum class TileScheduling { Fixed, Cost };
+
 class Options
 {
 public:
@@ -15,8 +25,18 @@ public:
 	int nWorkers = 32;
 	Vec3f backgroundColor { 0.0f, 0.0f, 0.0f };
 	int acPenalty = 1;						// determines amount of acceleration structures
+	BVHQuality bvhQuality = BVHQuality::SAH;	// fast builders are meant for previews of huge meshes
+	float rebuildCostRatio = 1.5f;			// refitted BVH is rebuilt when its SAH cost grows that much, 0 - never
 	char skyboxNames[6][64] = { { 0 } };	// skybox names
 	std::string imageName = "out";
+	std::string acCacheDir;					// directory of mesh cache, empty - cache is not used
+	int packetSize = 0;						// primary rays are traced in square packets of that side, 0 - one by one
+	Integrator integrator = Integrator::Recursive;
+	TileScheduling tileScheduling = TileScheduling::Fixed;
+	int aaSamples = 8;						// most samples added to a supersampled pixel
+	float aaThreshold = 0.01f;				// supersampling stops when error of pixel luminance is below it
+	bool progressive = false;				// image is refined in passes, see Scene::launchProgressive
+	int timeBudget = 0;						// progressive render stops after that many milliseconds, 0 - never
 };
 
 
@@ -0,0 +1,72 @@
+// Post-processing of the frame buffer, run on bands of rows of the thread pool with SIMD kernels
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "scene.h"
+#include "threadpool.h"
+
+// Luminance of linear RGB color
+inline float luminance(const Vec3f& color)
+{
+	return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// Luminance of count colors
+void luminanceRow(const Vec3f* colors, size_t count, float* lum);
+
+// Neighbours differing more in luminance, or with normals at a larger angle, are supersampled
+constexpr float edgeContrast = 0.1f;
+constexpr float edgeNormalCos = 0.9f;
+
+// Mark pixels that differ from one of their four neighbours in luminance,
+// or, if hits is not null, in hit object or normal
+void detectEdges(const Vec3f* frameBuffer, const SampleHit* hits, size_t width, size_t height, bool* edges,
+	ThreadPool& pool);
+
+// Same for pixels of region only, from luminance of the pixels of the image instead of their colors
+void detectEdges(const float* lum, const SampleHit* hits, size_t width, size_t height, const tileInfo& region,
+	bool* edges);
+
+/* BMP file written by regions of the frame, in any order and from any thread.
+ * A region is converted to bottom-up rows of BGR bytes by the thread adding it,
+ * and rows are written at their place in the file once all of their pixels are */
+class ImageStream
+{
+public:
+	// Open the file and write the header, good() tells if it succeeded
+	ImageStream(const std::string& path, size_t width, size_t height);
+
+	bool good() const
+	{
+		return file.good();
+	}
+
+	// Convert pixels of region, every pixel of the image is added once.
+	// Channels are clamped to [0, 1]
+	void addRegion(const Vec3f* frameBuffer, const tileInfo& region);
+
+	// Add all of the frame in bands on the pool
+	void addFrame(const Vec3f* frameBuffer, ThreadPool& pool);
+
+	// Returns false if a write failed
+	bool close();
+
+	const std::string path;
+
+private:
+	static constexpr size_t headerSize = 54;
+
+	std::ofstream file;
+	std::mutex fileMutex;
+	size_t width, height;
+	size_t rowSize;								// rows are padded to a multiple of 4 bytes
+	std::vector<char> data;						// rows in the order of the file
+	std::unique_ptr<std::atomic<size_t>[]> missingPixels;	// of every row, not added yet
+};
@@ -0,0 +1,51 @@
+// Batched ray queries against a loaded scene, for tools that need hits without rendering
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+
+#include "scene.h"
+#include "threadpool.h"
+
+// Closest hit of a query ray. Object id indexes Scene::objects, triangle id is the index
+// of the hit face in the OBJ file of the mesh, or of the mesh of the hit instance, counted
+// from zero. Triangles of one polygon share it. Ids are -1 if nothing is hit, triangle id
+// is also -1 for spheres and planes
+struct RayHit
+{
+	int32_t objectId = -1;
+	int32_t triangleId = -1;
+	float t = std::numeric_limits<float>::max();
+	Vec2f uv{ -1, -1 };
+};
+
+/* Arrays of rays are split into chunks, which run on the worker pool. Closest hits
+ * are traced as packets of neighbours, so coherent queries are faster when adjacent,
+ * occlusion rays are traced one by one and stop at their first hit. Rays are
+ * tested as they are given: shadow rays pass through transparent objects, like in
+ * rendering, other types hit them. Scene must not change while a query runs */
+class RayQuery
+{
+public:
+	// Queries run on nThreads threads, including the calling one, 0 - nWorkers of the scene
+	explicit RayQuery(const Scene& scene, int nThreads = 0);
+
+	// Closest hit of every ray, hits[i] of rays[i]. Hits are searched up to tMax[i] if it is given
+	void intersect(const Ray rays[], size_t count, RayHit hits[], const float tMax[] = nullptr);
+
+	// Whether anything blocks every ray before tMax[i], or at all if tMax is not given
+	void occluded(const Ray rays[], size_t count, bool results[], const float tMax[] = nullptr);
+
+	// Rays of one task
+	static constexpr size_t chunkSize = 1024;
+
+private:
+	// Trace rays in packets on the pool, store(index, intrInfo) gets result of every ray
+	template<typename F>
+	void trace(const Ray rays[], size_t count, const float tMax[], F&& store);
+
+	const Scene& scene;
+	ThreadPool pool;
+	std::unordered_map<const Object*, int32_t> objectIds;
+};
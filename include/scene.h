@@ -5,10 +5,15 @@ struct IntersectInfo;
 class Render;
 class Camera;
 class Scene;
+class ImageStream;
 
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
 
 #include "geometry.h"
+#include "bvh.h"
 #include "objects.h"
 #include "lights.h"
 #include "options.h"
@@ -27,6 +32,41 @@ typedef struct
 	size_t x0, x1, y0, y1;
 } tileInfo;
 
+// First hit of a camera ray, neighbours with different ones are supersampled
+struct SampleHit
+{
+	const Object* object = nullptr;		// nullptr for a miss
+	Vec3f normal{ 0 };
+};
+
+// Stops a progressive render, when cancelled from any thread or at its deadline
+class CancelToken
+{
+public:
+	void cancel()
+	{
+		cancelled = true;
+	}
+
+	// Earliest of the deadlines set is kept. Set them before the render starts
+	void setDeadline(std::chrono::steady_clock::time_point time)
+	{
+		if (!hasDeadline || time < deadline)
+			deadline = time;
+		hasDeadline = true;
+	}
+
+	bool stopped() const
+	{
+		return cancelled.load(std::memory_order_relaxed) || (hasDeadline && std::chrono::steady_clock::now() >= deadline);
+	}
+
+private:
+	std::atomic<bool> cancelled = false;
+	std::chrono::steady_clock::time_point deadline;
+	bool hasDeadline = false;
+};
+
 // Some static functions
 class Render
 {
@@ -41,10 +81,46 @@ public:
 	static float fresnel(const Vec3f& dir, const Vec3f& normal, const float& indexOfRefraction);
 
 	// Check if anything intersects with the ray
-	static bool trace(const Ray& ray, const ObjectVector& objects, IntersectInfo& intrInfo);
+	static bool trace(const Ray& ray, const Scene& scene, IntersectInfo& intrInfo);
+
+	// Check single object, intrInfo is updated if it is hit closer than intrInfo.tNear
+	static bool traceObject(const Ray& ray, const Object* object, IntersectInfo& intrInfo);
+
+	// Check if anything blocks the ray before maxT, stops at the first hit
+	static bool occluded(const Ray& ray, const Scene& scene, float maxT);
+
+	// Same, object is set to the index in scene.objects of what blocks the ray, triPtr to its triangle
+	static bool occluded(const Ray& ray, const Scene& scene, float maxT, uint32_t& object, const Triangle*& triPtr);
 
-	// Cast ray
-	static Vec3f castRay(const Ray& ray, const Scene& scene, const int depth);
+	// Same for a single object, triPtr is the hit triangle of meshes
+	static bool occludedObject(const Ray& ray, const Object* object, float maxT, const Triangle*& triPtr);
+
+	// Same as occluded for shadow rays towards light number light. The last occluder of
+	// such rays found by the calling thread is tested first. It is kept by indices of the
+	// object and triangle and forgotten when Scene::generation changes
+	static bool occludedCached(const Ray& ray, const Scene& scene, float maxT, uint32_t light);
+
+	// Trace all rays of the packet up to the distances they were added with, intrInfos is indexed by ray
+	static void tracePacket(RayPacket& packet, const Scene& scene, IntersectInfo intrInfos[]);
+
+	// Cast ray, firstHit is set to its first hit if given
+	static Vec3f castRay(const Ray& ray, const Scene& scene, const int depth, SampleHit* firstHit = nullptr);
+
+	// Cast rays of the packet together, colors and hits are indexed by ray
+	static void castPacket(RayPacket& packet, const Scene& scene, Vec3f colors[], SampleHit hits[] = nullptr);
+
+	// Color of the hit found by trace, firstHit is set to the hit if given
+	static Vec3f shade(const Ray& ray, const Scene& scene, const IntersectInfo& intrInfo, const int depth,
+		SampleHit* firstHit = nullptr);
+
+	// Light reflected by the hit point towards the ray origin, without secondary rays.
+	// visible(shadowRay, distance, light) tells if light number light is not blocked
+	static Vec3f directLight(const Ray& ray, const Scene& scene, const Object* object, const Vec3f& hitPoint,
+		const Vec3f& hitNormal, const Vec2f& hitTexCoordinates, const std::function<bool(const Ray&, float, uint32_t)>& visible);
+
+	// Reflected and refracted rays of the hit with weights of their colors, returns their number
+	static int secondaryRays(const Ray& ray, const Scene& scene, const Object* object, const Vec3f& hitPoint,
+		const Vec3f& hitNormal, Ray rays[2], float weights[2]);
 };
 
 // Stores all camera info
@@ -72,6 +148,11 @@ public:
 
 	ObjectVector objects;
 	LightsVector lights;
+
+	// Top level acceleration structure over bounded objects, indexed as objects vector.
+	// Unbounded objects, like planes, are tested with every ray, they are kept by index too
+	BVH objectBVH;
+	std::vector<uint32_t> unboundedObjects;
 	Options options;
 	Camera camera;
 
@@ -79,20 +160,55 @@ public:
 	int skyboxWidth, skyboxHeight;
 	Vec3f* skyboxes[6] = { nullptr };
 
+	// Changes whenever caches of objects and triangles kept between rays may be stale: when a scene
+	// is loaded, a render starts and the object tree is built or refitted. Unique across scenes
+	uint64_t generation = 0;
+	void nextGeneration();
+
 	// Info for statistics
 	std::atomic<int> finishedPixels = 0;
-	std::atomic<int> runningWorkers = 0;
+	std::mutex progressMutex;
+	std::chrono::high_resolution_clock::time_point lastProgressOutput;
+
+	// Token of the running progressive render, workers return early when it stops
+	const CancelToken* stopToken = nullptr;
+	std::atomic<bool> renderInterrupted = false;
+	// Side of the pixel blocks of the preview pass
+	static constexpr size_t previewStep = 4;
+	// First hits of pixels of the last full resolution pass, empty if it didn't record them
+	std::vector<SampleHit> pixelHits;
 
 	Scene(const std::string& sceneName);
 	bool loadScene(const std::string& sceneName);
+	void buildObjectBVH();
+	// Update top level boxes after objects moved
+	void refitObjectBVH();
 	void loadSkybox();
 	Vec3f getSkybox(const Vec3f& dir) const;
 
-	void render();
-	void launchWorkers(Vec3f* frameBuffer);
+	// Render and save the image. With a token, or with progressive or time_budget
+	// options, passes are refined until the token stops and the best image is saved
+	void render(CancelToken* token = nullptr);
+	// Preview of one ray per block, full resolution, then supersampling
+	void launchProgressive(Vec3f* frameBuffer, const CancelToken& token);
+	void previewWorker(Vec3f* frameBuffer, const tileInfo& tile);
+	// True if the render is stopped, marks the running pass unfinished
+	bool stopRequested();
+	// Render by tiles. With supersample, a tile is supersampled as soon as it and its
+	// neighbours are rendered, and finished tiles are added to image if it is given
+	void launchWorkers(Vec3f* frameBuffer, bool supersample = false, ImageStream* image = nullptr);
 	void renderWorker(Vec3f* frameBuffer, const tileInfo& tile);
+	// Print progress if a second passed since the last output, called by finished tiles
+	void reportProgress();
+	// Adaptive supersampling: pixels that differ from a neighbour in hit or luminance get samples
+	// until their luminance converges or options.aaSamples are added to the first one
 	void launchSSAA(Vec3f* frameBuffer);
-	void SSAAworker(Vec3f* frameBuffer, bool* sobelBuffer, const tileInfo& tile);
+	void SSAAworker(Vec3f* frameBuffer, bool* edgeBuffer, const tileInfo& tile);
+	// Same passes with the wavefront renderer, all pixels at once
+	void launchWavefront(Vec3f* frameBuffer);
+	void SSAAwavefront(Vec3f* frameBuffer, bool* edgeBuffer);
+	// Camera ray through point (x, y) of the image, in pixels
+	Ray getCameraRay(const float x, const float y);
 
 	std::vector<tileInfo> getTiles();
 
@@ -0,0 +1,13 @@
+// SIMD instruction set detection, scalar code is used when none is available
+#pragma once
+
+// AVX is enabled by the compiler flags (USE_AVX2 option in CMake)
+#if defined(__AVX2__)
+	#define RT_USE_AVX
+	#define RT_USE_SSE
+	#include <immintrin.h>
+// SSE2 is always available on x86-64
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define RT_USE_SSE
+	#include <emmintrin.h>
+#endif
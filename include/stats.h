@@ -14,6 +14,10 @@ namespace stats
 	inline std::atomic<size_t> meshCount = 0;
 	inline std::atomic<int> acCount = 0;
 	inline std::atomic<int> raysCasted = 0;
+	inline std::atomic<int> shadowCacheHits = 0;
+	inline std::atomic<int> shadowCacheMisses = 0;
+	inline std::atomic<int> supersampledPixels = 0;
+	inline std::atomic<int> supersamplingRays = 0;
 
 	inline void printStats()
 	{
@@ -33,5 +37,13 @@ namespace stats
 			<< acCount << '\n';
 		std::cout << "Rays casted:                        " << std::setw(10) 
 			<< raysCasted << '\n';
+		std::cout << "Shadow occluder cache hits:         " << std::setw(10) 
+			<< shadowCacheHits << '\n';
+		std::cout << "Shadow occluder cache misses:       " << std::setw(10) 
+			<< shadowCacheMisses << '\n';
+		std::cout << "Supersampled pixels:                " << std::setw(10) 
+			<< supersampledPixels << '\n';
+		std::cout << "Supersampling rays:                 " << std::setw(10) 
+			<< supersamplingRays << '\n';
 	}
 }
@@ -0,0 +1,105 @@
+// Pool of worker threads executing submitted tasks
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+// Counts unfinished tasks, so the submitter can wait for them
+class TaskGroup
+{
+public:
+	bool done() const
+	{
+		return pending.load() == 0;
+	}
+
+private:
+	friend class ThreadPool;
+	std::atomic<int> pending = 0;
+};
+
+/* Every worker has its own deque of tasks. Tasks submitted by a worker go to the
+ * back of its deque and it takes them from there, so nested tasks run depth first
+ * on warm caches. Idle threads steal from the front of other deques, where the
+ * oldest and usually largest tasks are. Tasks of other threads go to a shared deque.
+ * Threads without work sleep until a task is queued or their group is finished */
+class ThreadPool
+{
+public:
+	// Pool with given number of worker threads. Thread that waits for
+	// a group also runs tasks, so zero workers is a valid serial pool
+	explicit ThreadPool(int nThreads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+
+	// Pool of the process, created by the first call with nThreads workers.
+	// Later calls return the same pool whatever they ask for
+	static ThreadPool& shared(int nThreads);
+
+	// Add task to the queue
+	void submit(TaskGroup& group, std::function<void()> task);
+
+	// Return when all tasks of the group are finished, run queued tasks meanwhile.
+	// Tasks may submit and wait for tasks themselves
+	void wait(TaskGroup& group);
+
+	// Split [begin, end) into chunks and process them in parallel.
+	// func(chunkIndex, chunkBegin, chunkEnd) is called for every chunk
+	template<typename F>
+	void parallelFor(size_t begin, size_t end, size_t chunkSize, F&& func);
+
+	// Number of threads executing tasks, including the waiting one
+	int concurrency() const
+	{
+		return (int)workers.size() + 1;
+	}
+
+private:
+	struct Task
+	{
+		std::function<void()> func;
+		TaskGroup* group;
+	};
+
+	struct WorkQueue
+	{
+		std::deque<Task> tasks;
+		std::mutex mutex;
+	};
+
+	void workerLoop(int index);
+	// Take task of own deque, or of the shared one, or steal it
+	bool takeTask(Task& task);
+	void runTask(Task& task);
+	// Index of the deque of the calling thread, the shared one for other threads
+	int queueIndex() const;
+
+	std::vector<std::thread> workers;
+	// One per worker, the last one is shared by other threads
+	std::unique_ptr<WorkQueue[]> queues;
+	std::atomic<int> queuedTasks = 0;
+	std::mutex sleepMutex;
+	std::condition_variable wakeCondition;
+	bool stopping = false;
+};
+
+template<typename F>
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t chunkSize, F&& func)
+{
+	TaskGroup group;
+	size_t chunkIndex = 0;
+	for (size_t chunkBegin = begin; chunkBegin < end; chunkBegin += chunkSize, chunkIndex++) {
+		const size_t chunkEnd = std::min(end, chunkBegin + chunkSize);
+		submit(group, [&func, chunkIndex, chunkBegin, chunkEnd]() { func(chunkIndex, chunkBegin, chunkEnd); });
+	}
+	wait(group);
+}
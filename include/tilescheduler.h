@@ -0,0 +1,43 @@
+// Order of render tiles from costs measured by a sparse low resolution pass
+#pragma once
+
+#include <vector>
+
+#include "scene.h"
+#include "threadpool.h"
+
+/* Before the full pass, one ray through the centre of every cell of cellSize
+ * pixels is timed. Predicted time of a tile is the time of its cells times
+ * their pixels. Tiles much costlier than the share of one thread are split
+ * into quarters, then they are dispatched from the costliest, and tiles of
+ * similar cost go in Hilbert order, so neighbours run close in time */
+class TileScheduler
+{
+public:
+	explicit TileScheduler(Scene& scene);
+
+	// Run the cost pass on the pool and return tiles split and ordered by cost
+	std::vector<tileInfo> schedule(const std::vector<tileInfo>& tiles, ThreadPool& pool);
+
+	// Predicted render time of tile, in milliseconds
+	float predict(const tileInfo& tile) const;
+
+	// Print predicted against measured time of tiles, in milliseconds in the order of tiles
+	void report(const std::vector<tileInfo>& tiles, const std::vector<float>& times) const;
+
+	static constexpr size_t cellSize = 8;
+	// Tiles are not split below that side
+	static constexpr size_t minTileSize = 32;
+	// Tiles are split until one costs less than that part of the time of one thread
+	static constexpr int tilesPerThread = 4;
+
+private:
+	// Position of tile along the Hilbert curve over the grid of minTileSize blocks
+	uint64_t hilbertIndex(const tileInfo& tile) const;
+
+	Scene& scene;
+	size_t cellsX = 0, cellsY = 0;
+	std::vector<float> cellTimes;		// time of one pixel of the cell, in milliseconds
+	size_t splitCount = 0;
+	long long passTime = 0;				// of the cost pass, in milliseconds
+};
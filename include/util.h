@@ -4,6 +4,7 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <sstream>
 
@@ -38,6 +39,36 @@ inline float radToDeg(const float& f)
 	return f * (180.0f / (float)(M_PI));
 }
 
+// Rotation around x, then y, then z axis, angles in degrees
+inline Matrix44f rotationMatrix(const Vec3f& rot)
+{
+	const float& x = degToRad(rot.x);
+	Matrix44f mx(
+		1, 0, 0, 0,
+		0, cosf(x), -sinf(x), 0,
+		0, sinf(x), cosf(x), 0,
+		0, 0, 0, 1
+	);
+
+	const float& y = degToRad(rot.y);
+	Matrix44f my(
+		cosf(y), 0, sinf(y), 0,
+		0, 1, 0, 0,
+		-sinf(y), 0, cosf(y), 0,
+		0, 0, 0, 1
+	);
+
+	const float& z = degToRad(rot.z);
+	Matrix44f mz(
+		cosf(z), -sinf(z), 0, 0,
+		sinf(z), cosf(z), 0, 0,
+		0, 0, 1, 0,
+		0, 0, 0, 1
+	);
+
+	return mz * my * mx;
+}
+
 inline bool strToBool(const std::string_view& str)
 {
 	bool result = 0;
@@ -95,6 +126,15 @@ inline bool strEquals(const std::string_view& str1, const std::string_view& str2
 	return str1.compare(str2) == 0;
 };
 
+class ImageStream;
+
+// Open options.imageName.bmp to be written while the frame is rendered, nullptr if it fails
+std::unique_ptr<ImageStream> openImage(const Options& options);
+
+// Close image and open it in the default viewer
+int closeImage(ImageStream& image);
+
+// Write whole frame to options.imageName.bmp and open it
 int saveImage(Vec3f* frameBuffer, const Options& options);
 
 unsigned char* loadBMP(const char* filename, int& width, int& height);
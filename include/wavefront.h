@@ -0,0 +1,81 @@
+// Wavefront renderer, traces paths of all camera rays together bounce by bounce
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+
+#include "geometry.h"
+#include "scene.h"
+#include "threadpool.h"
+
+/* Alternative to recursive castRay. Every wave runs stages over queues of rays:
+ * extend traces path rays, shade computes surface data of the hits and queues
+ * their shadow and secondary rays, shadow traces shadow rays and resolve adds
+ * the light of every hit. Queues are sorted by direction and origin, path rays
+ * are traced as packets of neighbours and shadow rays stop at their first hit.
+ * Path ray keeps weight of its color in the camera ray color, so nothing is
+ * recursive and the stack depth does not grow with bounces */
+class WavefrontRenderer
+{
+public:
+	explicit WavefrontRenderer(const Scene& scene);
+
+	// Trace camera rays, colors and firstHits, if given, are indexed as cameraRays
+	void render(const std::vector<Ray>& cameraRays, std::vector<Vec3f>& colors, std::vector<SampleHit>* firstHits = nullptr);
+
+	// Rays of queue chunks processed by one task
+	static constexpr size_t chunkSize = 4096;
+
+private:
+	struct QueuedRay
+	{
+		Ray ray;
+		float tMax = std::numeric_limits<float>::max();
+	};
+
+	// Ray continuing path of camera ray number sample
+	struct PathRay : QueuedRay
+	{
+		uint32_t sample;
+		float weight;
+		int depth;
+	};
+
+	// Result of the shade stage for one path ray
+	struct ShadePoint
+	{
+		const Object* object;		// null if the color is already known
+		Vec3f hitPoint, hitNormal;
+		Vec2f hitTexCoordinates;
+		size_t firstShadowRay;		// in shadowRayPositions of the chunk
+		Vec3f color;				// weighted contribution to the camera ray color
+	};
+
+	// Rays queued by one chunk of the shade stage. Shadow rays are grouped by their
+	// number among rays of the hit, so a group goes towards one light sample
+	struct ShadeChunk
+	{
+		std::vector<std::vector<QueuedRay>> shadowRays;
+		std::vector<uint32_t> shadowRayPositions;	// in their groups, in the order of queueing
+		std::vector<std::vector<char>> visible;		// indexed as shadowRays
+		std::vector<PathRay> pathRays;
+	};
+
+	// Reorder rays so neighbours have similar directions and origins
+	static void sortQueue(std::vector<PathRay>& queue);
+
+	// Trace rays in packets of neighbours, hits are indexed as rays
+	template<typename T>
+	void tracePackets(const T* rays, size_t count, IntersectInfo hits[]);
+
+	void shadeStage(const std::vector<PathRay>& queue, const std::vector<IntersectInfo>& hits);
+	void shadowStage();
+	void resolveStage(const std::vector<PathRay>& queue);
+
+	const Scene& scene;
+	ThreadPool& pool;
+
+	std::vector<ShadePoint> points;
+	std::vector<ShadeChunk> chunks;
+};
@@ -0,0 +1,918 @@
+// Bounding volume hierarchy, built with binned SAH or from Morton codes of primitive centroids
+#include "bvh.h"
+
+#include <algorithm>
+
+#include "options.h"
+#include "stats.h"
+#include "threadpool.h"
+
+BVH::BVH() {}
+
+BVH::~BVH() {}
+
+// Shared state of one build
+struct BVH::BuildContext
+{
+	std::vector<BVHPrimitive>& prims;
+	ThreadPool* pool = nullptr;
+	std::atomic<size_t> nodeCount = 0;
+	// Linear builders only, codes are sorted along with prims
+	std::vector<uint64_t> mortonCodes{};
+	int mortonBits = 0;
+};
+
+// Primitives with equal top bits of Morton code, leaf of hybrid builder top levels
+struct BVH::MortonGroup
+{
+	size_t begin = 0, end = 0;
+	BBox bounds{};
+	Vec3f centroid{};
+};
+
+namespace
+{
+	// Insert two zero bits before each of the lower 21 bits
+	uint64_t expandBits(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffull;
+		v = (v | v << 16) & 0x1f0000ff0000ffull;
+		v = (v | v << 8) & 0x100f00f00f00f00full;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
+}
+
+// Bin of SAH sweep
+struct BVH::Bin
+{
+	BBox bounds;
+	uint32_t count = 0;
+};
+
+void BVH::build(std::vector<BVHPrimitive>& prims, ThreadPool* pool, BVHQuality quality)
+{
+	nodes.clear();
+	primIndices.clear();
+	if (prims.empty())
+		return;
+
+	BuildContext ctx{ prims, pool };
+	std::unique_ptr<BVHBuildNode> root;
+	if (quality == BVHQuality::SAH || !options::useAC)
+		root = buildRecursive(ctx, 0, prims.size(), 0);
+	else
+		root = buildLinear(ctx, quality == BVHQuality::Hybrid);
+
+	// Leaves store ranges in build order, remember which primitive is where
+	primIndices.reserve(prims.size());
+	for (const BVHPrimitive& prim : prims)
+		primIndices.push_back(prim.index);
+
+	nodes.reserve(ctx.nodeCount);
+	flatten(root.get());
+}
+
+uint32_t BVH::flatten(const BVHBuildNode* buildNode)
+{
+	const uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	nodes[index].boundsMin = buildNode->bounds[0];
+	nodes[index].boundsMax = buildNode->bounds[1];
+	if (!buildNode->children[0]) {
+		nodes[index].offset = buildNode->firstPrim;
+		nodes[index].primCount = buildNode->primCount;
+	}
+	else {
+		// First child goes right after the parent
+		flatten(buildNode->children[0].get());
+		nodes[index].offset = flatten(buildNode->children[1].get());
+		nodes[index].primCount = 0;
+	}
+	return index;
+}
+
+void BVH::computeBounds(BuildContext& ctx, size_t begin, size_t end, BBox& bounds, BBox& centroidBounds)
+{
+	auto computeRange = [&ctx](size_t rangeBegin, size_t rangeEnd, BBox& b, BBox& cb)
+	{
+		for (size_t i = rangeBegin; i < rangeEnd; i++) {
+			b.extend(ctx.prims[i].bounds);
+			cb.extend(ctx.prims[i].centroid);
+		}
+	};
+
+	if (!ctx.pool || end - begin < parallelThreshold) {
+		computeRange(begin, end, bounds, centroidBounds);
+		return;
+	}
+
+	// Min and max do not depend on order, so chunks may finish in any order
+	const size_t chunkSize = parallelThreshold / 4;
+	std::vector<BBox> chunkBounds((end - begin + chunkSize - 1) / chunkSize * 2);
+	ctx.pool->parallelFor(begin, end, chunkSize, [&](size_t chunk, size_t chunkBegin, size_t chunkEnd)
+		{
+			computeRange(chunkBegin, chunkEnd, chunkBounds[chunk * 2], chunkBounds[chunk * 2 + 1]);
+		});
+	for (size_t i = 0; i < chunkBounds.size(); i += 2) {
+		bounds.extend(chunkBounds[i]);
+		centroidBounds.extend(chunkBounds[i + 1]);
+	}
+}
+
+void BVH::computeBins(BuildContext& ctx, size_t begin, size_t end, int axis,
+	float cMin, float cExtent, Bin bins[binCount])
+{
+	auto binRange = [&](size_t rangeBegin, size_t rangeEnd, Bin* rangeBins)
+	{
+		for (size_t i = rangeBegin; i < rangeEnd; i++) {
+			Bin& bin = rangeBins[getBin(ctx.prims[i], axis, cMin, cExtent)];
+			bin.count++;
+			bin.bounds.extend(ctx.prims[i].bounds);
+		}
+	};
+
+	if (!ctx.pool || end - begin < parallelThreshold) {
+		binRange(begin, end, bins);
+		return;
+	}
+
+	// Every chunk fills its own bins, they are merged afterwards
+	const size_t chunkSize = parallelThreshold / 4;
+	const size_t chunkCount = (end - begin + chunkSize - 1) / chunkSize;
+	std::vector<Bin> chunkBins(chunkCount * binCount);
+	ctx.pool->parallelFor(begin, end, chunkSize, [&](size_t chunk, size_t chunkBegin, size_t chunkEnd)
+		{
+			binRange(chunkBegin, chunkEnd, &chunkBins[chunk * binCount]);
+		});
+	for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+		for (int b = 0; b < binCount; b++) {
+			bins[b].count += chunkBins[chunk * binCount + b].count;
+			bins[b].bounds.extend(chunkBins[chunk * binCount + b].bounds);
+		}
+	}
+}
+
+int BVH::getBin(const BVHPrimitive& prim, int axis, float cMin, float cExtent)
+{
+	int b = (int)(binCount * ((prim.centroid[axis] - cMin) / cExtent));
+	return std::min(b, binCount - 1);
+}
+
+std::unique_ptr<BVHBuildNode> BVH::buildRecursive(BuildContext& ctx, size_t begin, size_t end, int depth)
+{
+	std::vector<BVHPrimitive>& prims = ctx.prims;
+	auto node = std::make_unique<BVHBuildNode>();
+	ctx.nodeCount++;
+
+	BBox centroidBounds;
+	computeBounds(ctx, begin, end, node->bounds, centroidBounds);
+
+	const size_t count = end - begin;
+	auto makeLeaf = [&]()
+	{
+		node->firstPrim = (uint32_t)begin;
+		node->primCount = (uint32_t)count;
+		return std::move(node);
+	};
+
+	if (count == 1 || !options::useAC || depth + 1 >= maxDepth)
+		return makeLeaf();
+
+	const int axis = centroidBounds.maxExtent();
+	const float cMin = centroidBounds[0][axis];
+	const float cExtent = centroidBounds[1][axis] - cMin;
+	size_t mid = begin + count / 2;
+
+	if (cExtent <= 0.0f) {
+		// All centroids in one point, SAH can't separate them
+		if (count <= maxLeafSize)
+			return makeLeaf();
+	}
+	else {
+		// Put centroids in bins along the longest axis
+		Bin bins[binCount];
+		computeBins(ctx, begin, end, axis, cMin, cExtent, bins);
+
+		// Sweep from the right to get area and count right of every plane
+		float rightCost[binCount - 1];
+		BBox rightBounds;
+		uint32_t rightCount = 0;
+		for (int i = binCount - 1; i > 0; i--) {
+			rightBounds.extend(bins[i].bounds);
+			rightCount += bins[i].count;
+			rightCost[i - 1] = rightCount * rightBounds.surfaceArea();
+		}
+
+		// Sweep from the left and find the cheapest plane
+		BBox leftBounds;
+		uint32_t leftCount = 0;
+		int bestSplit = -1;
+		float bestCost = std::numeric_limits<float>::max();
+		for (int i = 0; i < binCount - 1; i++) {
+			leftBounds.extend(bins[i].bounds);
+			leftCount += bins[i].count;
+			float cost = leftCount * leftBounds.surfaceArea() + rightCost[i];
+			if (leftCount > 0 && leftCount < count && cost < bestCost) {
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		// Leaf cost is count, intersection cost is set to one
+		const float parentArea = node->bounds.surfaceArea();
+		const float splitCost = parentArea > 0.0f ? traversalCost + bestCost / parentArea : traversalCost;
+		if (count <= maxLeafSize && (bestSplit < 0 || splitCost >= (float)count))
+			return makeLeaf();
+
+		if (bestSplit >= 0) {
+			auto it = std::partition(prims.begin() + begin, prims.begin() + end,
+				[&](const BVHPrimitive& prim) { return getBin(prim, axis, cMin, cExtent) <= bestSplit; });
+			mid = it - prims.begin();
+		}
+	}
+
+	if (mid == begin || mid == end) {
+		// Failed to split by SAH, split by median
+		mid = begin + count / 2;
+		std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+			[axis](const BVHPrimitive& a, const BVHPrimitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	// Children work on disjoint ranges, so big subtrees are built by other threads.
+	// Shape of the tree doesn't depend on which thread builds what
+	if (ctx.pool && count >= taskThreshold) {
+		TaskGroup group;
+		ctx.pool->submit(group, [&]() { node->children[1] = buildRecursive(ctx, mid, end, depth + 1); });
+		node->children[0] = buildRecursive(ctx, begin, mid, depth + 1);
+		ctx.pool->wait(group);
+	}
+	else {
+		node->children[0] = buildRecursive(ctx, begin, mid, depth + 1);
+		node->children[1] = buildRecursive(ctx, mid, end, depth + 1);
+	}
+	return node;
+}
+
+std::unique_ptr<BVHBuildNode> BVH::buildLinear(BuildContext& ctx, bool sahTopLevels)
+{
+	BBox bounds, centroidBounds;
+	computeBounds(ctx, 0, ctx.prims.size(), bounds, centroidBounds);
+	sortByMortonCode(ctx, centroidBounds);
+	if (!sahTopLevels)
+		return emitLinear(ctx, 0, ctx.prims.size(), ctx.mortonBits - 1, 0);
+
+	// Equal top bits mean the same cell of coarse grid, cells are joined by SAH
+	const std::vector<uint64_t>& codes = ctx.mortonCodes;
+	const int groupShift = ctx.mortonBits - hybridTopBits;
+	std::vector<MortonGroup> groups;
+	for (size_t begin = 0; begin < codes.size();) {
+		size_t end = begin + 1;
+		while (end < codes.size() && codes[end] >> groupShift == codes[begin] >> groupShift)
+			end++;
+		MortonGroup group{ begin, end };
+		for (size_t i = begin; i < end; i++)
+			group.bounds.extend(ctx.prims[i].bounds);
+		group.centroid = group.bounds.centroid();
+		groups.push_back(group);
+		begin = end;
+	}
+	return buildGroups(ctx, groups, 0, groups.size(), 0);
+}
+
+void BVH::sortByMortonCode(BuildContext& ctx, const BBox& centroidBounds)
+{
+	std::vector<BVHPrimitive>& prims = ctx.prims;
+	const size_t count = prims.size();
+
+	// 30 bit codes tell apart a million of primitives, bigger meshes get 63 bits
+	const int axisBits = count > (1 << 20) ? 21 : 10;
+	ctx.mortonBits = 3 * axisBits;
+
+	// Chunks have fixed size, so histograms don't depend on number of threads
+	const size_t chunkSize = parallelThreshold / 4;
+	const size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+	auto forChunks = [&](auto&& func)
+	{
+		if (ctx.pool && count >= parallelThreshold) {
+			ctx.pool->parallelFor(0, count, chunkSize, func);
+			return;
+		}
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+			func(chunk, chunk * chunkSize, std::min(count, (chunk + 1) * chunkSize));
+	};
+
+	struct Entry
+	{
+		uint64_t code;
+		uint32_t prim;
+	};
+	std::vector<Entry> entries(count), sorted(count);
+
+	const float gridSize = (float)((1 << axisBits) - 1);
+	const Vec3f cMin = centroidBounds[0];
+	const Vec3f cExtent = centroidBounds.extent();
+	forChunks([&](size_t, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				uint64_t code = 0;
+				for (int a = 0; a < 3; a++) {
+					const float t = cExtent[a] > 0.0f ? (prims[i].centroid[a] - cMin[a]) / cExtent[a] : 0.0f;
+					const uint64_t cell = (uint64_t)std::min(gridSize, std::max(0.0f, t * gridSize));
+					code |= expandBits(cell) << (2 - a);
+				}
+				entries[i] = { code, (uint32_t)i };
+			}
+		});
+
+	// Least significant digit radix sort, 8 bits per pass. Every chunk counts its
+	// digits, then writes them after the same digits of previous chunks, so sort is stable
+	std::vector<size_t> histograms(chunkCount * 256);
+	for (int shift = 0; shift < ctx.mortonBits; shift += 8) {
+		std::fill(histograms.begin(), histograms.end(), 0);
+		forChunks([&](size_t chunk, size_t begin, size_t end)
+			{
+				size_t* histogram = &histograms[chunk * 256];
+				for (size_t i = begin; i < end; i++)
+					histogram[entries[i].code >> shift & 255]++;
+			});
+
+		size_t offset = 0;
+		for (int digit = 0; digit < 256; digit++) {
+			for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+				const size_t digitCount = histograms[chunk * 256 + digit];
+				histograms[chunk * 256 + digit] = offset;
+				offset += digitCount;
+			}
+		}
+
+		forChunks([&](size_t chunk, size_t begin, size_t end)
+			{
+				size_t* position = &histograms[chunk * 256];
+				for (size_t i = begin; i < end; i++)
+					sorted[position[entries[i].code >> shift & 255]++] = entries[i];
+			});
+		entries.swap(sorted);
+	}
+
+	std::vector<BVHPrimitive> sortedPrims(count);
+	ctx.mortonCodes.resize(count);
+	forChunks([&](size_t, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				sortedPrims[i] = prims[entries[i].prim];
+				ctx.mortonCodes[i] = entries[i].code;
+			}
+		});
+	prims.swap(sortedPrims);
+}
+
+std::unique_ptr<BVHBuildNode> BVH::emitLinear(BuildContext& ctx, size_t begin, size_t end, int bit, int depth)
+{
+	const std::vector<uint64_t>& codes = ctx.mortonCodes;
+	const size_t count = end - begin;
+	auto node = std::make_unique<BVHBuildNode>();
+	ctx.nodeCount++;
+
+	// Codes are sorted, so bit equal in the first and the last code is equal in the whole range
+	while (bit >= 0 && (codes[begin] >> bit & 1) == (codes[end - 1] >> bit & 1))
+		bit--;
+
+	if (count <= linearLeafSize || depth + 1 >= maxDepth || (bit < 0 && count <= maxLeafSize)) {
+		for (size_t i = begin; i < end; i++)
+			node->bounds.extend(ctx.prims[i].bounds);
+		node->firstPrim = (uint32_t)begin;
+		node->primCount = (uint32_t)count;
+		return node;
+	}
+
+	// Primitives with zero bit go left, equal codes are split in the middle
+	size_t mid = begin + count / 2;
+	if (bit >= 0) {
+		mid = std::partition_point(codes.begin() + begin, codes.begin() + end,
+			[bit](uint64_t code) { return (code >> bit & 1) == 0; }) - codes.begin();
+	}
+
+	if (ctx.pool && count >= taskThreshold) {
+		TaskGroup group;
+		ctx.pool->submit(group, [&]() { node->children[1] = emitLinear(ctx, mid, end, bit - 1, depth + 1); });
+		node->children[0] = emitLinear(ctx, begin, mid, bit - 1, depth + 1);
+		ctx.pool->wait(group);
+	}
+	else {
+		node->children[0] = emitLinear(ctx, begin, mid, bit - 1, depth + 1);
+		node->children[1] = emitLinear(ctx, mid, end, bit - 1, depth + 1);
+	}
+	node->bounds.extend(node->children[0]->bounds);
+	node->bounds.extend(node->children[1]->bounds);
+	return node;
+}
+
+std::unique_ptr<BVHBuildNode> BVH::buildGroups(BuildContext& ctx, std::vector<MortonGroup>& groups,
+	size_t begin, size_t end, int depth)
+{
+	if (end - begin == 1)
+		return emitLinear(ctx, groups[begin].begin, groups[begin].end, ctx.mortonBits - hybridTopBits - 1, depth);
+
+	auto node = std::make_unique<BVHBuildNode>();
+	ctx.nodeCount++;
+	BBox centroidBounds;
+	size_t primCount = 0;
+	for (size_t i = begin; i < end; i++) {
+		node->bounds.extend(groups[i].bounds);
+		centroidBounds.extend(groups[i].centroid);
+		primCount += groups[i].end - groups[i].begin;
+	}
+
+	const int axis = centroidBounds.maxExtent();
+	const float cMin = centroidBounds[0][axis];
+	const float cExtent = centroidBounds[1][axis] - cMin;
+	auto getGroupBin = [&](const MortonGroup& group)
+	{
+		int b = (int)(binCount * ((group.centroid[axis] - cMin) / cExtent));
+		return std::min(b, binCount - 1);
+	};
+
+	// Deep top levels would leave no depth for groups, they are split by median then
+	size_t mid = begin;
+	if (cExtent > 0.0f && depth < maxDepth / 4) {
+		Bin bins[binCount];
+		size_t groupCount[binCount] = { 0 };
+		for (size_t i = begin; i < end; i++) {
+			const int b = getGroupBin(groups[i]);
+			bins[b].count += (uint32_t)(groups[i].end - groups[i].begin);
+			bins[b].bounds.extend(groups[i].bounds);
+			groupCount[b]++;
+		}
+
+		float rightCost[binCount - 1];
+		BBox rightBounds;
+		uint32_t rightCount = 0;
+		for (int i = binCount - 1; i > 0; i--) {
+			rightBounds.extend(bins[i].bounds);
+			rightCount += bins[i].count;
+			rightCost[i - 1] = rightCount * rightBounds.surfaceArea();
+		}
+
+		BBox leftBounds;
+		uint32_t leftCount = 0;
+		size_t leftGroups = 0;
+		int bestSplit = -1;
+		float bestCost = std::numeric_limits<float>::max();
+		for (int i = 0; i < binCount - 1; i++) {
+			leftBounds.extend(bins[i].bounds);
+			leftCount += bins[i].count;
+			leftGroups += groupCount[i];
+			const float cost = leftCount * leftBounds.surfaceArea() + rightCost[i];
+			if (leftGroups > 0 && leftGroups < end - begin && cost < bestCost) {
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		if (bestSplit >= 0) {
+			mid = std::partition(groups.begin() + begin, groups.begin() + end,
+				[&](const MortonGroup& group) { return getGroupBin(group) <= bestSplit; }) - groups.begin();
+		}
+	}
+	if (mid == begin || mid == end) {
+		mid = begin + (end - begin) / 2;
+		std::nth_element(groups.begin() + begin, groups.begin() + mid, groups.begin() + end,
+			[axis](const MortonGroup& a, const MortonGroup& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	if (ctx.pool && primCount >= taskThreshold) {
+		TaskGroup group;
+		ctx.pool->submit(group, [&]() { node->children[1] = buildGroups(ctx, groups, mid, end, depth + 1); });
+		node->children[0] = buildGroups(ctx, groups, begin, mid, depth + 1);
+		ctx.pool->wait(group);
+	}
+	else {
+		node->children[0] = buildGroups(ctx, groups, begin, mid, depth + 1);
+		node->children[1] = buildGroups(ctx, groups, mid, end, depth + 1);
+	}
+	return node;
+}
+
+int BVH::countBoxes(const Ray& ray) const
+{
+	if (nodes.empty()) return 0;
+	const Vec3f invDir = 1 / ray.dir;
+
+	// Visit every box the ray passes through, not only the ones before the closest hit
+	int result = 0;
+	uint32_t stack[2 * maxDepth];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const uint32_t nodeIndex = stack[--stackSize];
+		const BVHNode& node = nodes[nodeIndex];
+		float tNear;
+		if (!intersectBox(node, ray.orig, invDir, std::numeric_limits<float>::max(), tNear))
+			continue;
+		result++;
+		if (node.primCount == 0) {
+			stack[stackSize++] = node.offset;
+			stack[stackSize++] = nodeIndex + 1;
+		}
+	}
+	return result;
+}
+
+void BVH::refit(const std::vector<BBox>& primBounds)
+{
+	// Children are stored after their parent, so backward pass visits them first
+	for (size_t i = nodes.size(); i-- > 0;) {
+		BVHNode& node = nodes[i];
+		BBox bounds;
+		if (node.primCount > 0) {
+			for (uint32_t p = node.offset; p < node.offset + node.primCount; p++)
+				bounds.extend(primBounds[primIndices[p]]);
+		}
+		else {
+			bounds.extend(BBox(nodes[i + 1].boundsMin, nodes[i + 1].boundsMax));
+			bounds.extend(BBox(nodes[node.offset].boundsMin, nodes[node.offset].boundsMax));
+		}
+		node.boundsMin = bounds[0];
+		node.boundsMax = bounds[1];
+	}
+}
+
+float BVH::sahCost() const
+{
+	if (nodes.empty())
+		return 0.0f;
+	const float rootArea = BBox(nodes[0].boundsMin, nodes[0].boundsMax).surfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	// Probability to visit a node is its area relative to the root
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes) {
+		const float area = BBox(node.boundsMin, node.boundsMax).surfaceArea();
+		cost += area * (node.primCount > 0 ? (float)node.primCount : traversalCost);
+	}
+	return cost / rootArea;
+}
+
+template<int Width>
+void WideBVH<Width>::collapse(const BVH& bvh)
+{
+	nodes.clear();
+	primIndices = bvh.primIndices;
+	if (bvh.nodes.empty())
+		return;
+	collapseNode(bvh, 0);
+}
+
+template<int Width>
+uint32_t WideBVH<Width>::collapseNode(const BVH& bvh, uint32_t binaryIndex)
+{
+	auto area = [&](uint32_t i)
+	{
+		return BBox(bvh.nodes[i].boundsMin, bvh.nodes[i].boundsMax).surfaceArea();
+	};
+
+	// Start with children of binary node, then keep opening the biggest interior child
+	uint32_t children[Width];
+	int childCount = 0;
+	const BVHNode& binaryNode = bvh.nodes[binaryIndex];
+	if (binaryNode.primCount > 0) {
+		// Root of the tree is a leaf
+		children[childCount++] = binaryIndex;
+	}
+	else {
+		children[childCount++] = binaryIndex + 1;
+		children[childCount++] = binaryNode.offset;
+	}
+	while (childCount < Width) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < childCount; i++) {
+			if (bvh.nodes[children[i]].primCount == 0 && area(children[i]) > bestArea) {
+				best = i;
+				bestArea = area(children[i]);
+			}
+		}
+		if (best < 0)
+			break;
+		const uint32_t opened = children[best];
+		children[best] = opened + 1;
+		children[childCount++] = bvh.nodes[opened].offset;
+	}
+
+	const uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	for (int i = 0; i < Width; i++) {
+		for (int a = 0; a < 3; a++) {
+			nodes[index].boundsMin[a][i] = std::numeric_limits<float>::infinity();
+			nodes[index].boundsMax[a][i] = -std::numeric_limits<float>::infinity();
+		}
+		nodes[index].offset[i] = 0;
+		nodes[index].primCount[i] = 0;
+	}
+
+	for (int i = 0; i < childCount; i++) {
+		const BVHNode& child = bvh.nodes[children[i]];
+		for (int a = 0; a < 3; a++) {
+			nodes[index].boundsMin[a][i] = child.boundsMin[a];
+			nodes[index].boundsMax[a][i] = child.boundsMax[a];
+		}
+		if (child.primCount > 0) {
+			nodes[index].offset[i] = child.offset;
+			nodes[index].primCount[i] = child.primCount;
+		}
+		else {
+			// Vector may grow, don't keep reference to the node
+			const uint32_t childIndex = collapseNode(bvh, children[i]);
+			nodes[index].offset[i] = childIndex;
+		}
+	}
+	return index;
+}
+
+template<int Width>
+int WideBVH<Width>::countBoxes(const Ray& ray) const
+{
+	if (nodes.empty()) return 0;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	int result = 0;
+	uint32_t stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = 0;
+	while (stackTop > 0) {
+		const WideBVHNode<Width>& node = nodes[stack[--stackTop]];
+		float tNear[Width];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, std::numeric_limits<float>::max(), tNear);
+		for (int i = 0; i < Width; i++) {
+			if (mask & (1 << i)) {
+				result++;
+				if (node.primCount[i] == 0)
+					stack[stackTop++] = node.offset[i];
+			}
+		}
+	}
+	return result;
+}
+
+template<int Width>
+void WideBVH<Width>::refit(const std::vector<BBox>& primBounds)
+{
+	// Children are stored after their parent, so backward pass visits them first
+	for (size_t n = nodes.size(); n-- > 0;) {
+		WideBVHNode<Width>& node = nodes[n];
+		for (int i = 0; i < Width; i++) {
+			BBox bounds;
+			if (node.primCount[i] > 0) {
+				for (uint32_t p = node.offset[i]; p < node.offset[i] + node.primCount[i]; p++)
+					bounds.extend(primBounds[primIndices[p]]);
+			}
+			else if (node.offset[i] > 0) {
+				// Empty slots of the child have inverted bounds, they don't extend the box
+				const WideBVHNode<Width>& child = nodes[node.offset[i]];
+				for (int j = 0; j < Width; j++) {
+					bounds.extend(BBox(Vec3f(child.boundsMin[0][j], child.boundsMin[1][j], child.boundsMin[2][j]),
+						Vec3f(child.boundsMax[0][j], child.boundsMax[1][j], child.boundsMax[2][j])));
+				}
+			}
+			else {
+				continue;
+			}
+			for (int a = 0; a < 3; a++) {
+				node.boundsMin[a][i] = bounds[0][a];
+				node.boundsMax[a][i] = bounds[1][a];
+			}
+		}
+	}
+}
+
+template<int Width>
+float WideBVH<Width>::sahCost() const
+{
+	if (nodes.empty())
+		return 0.0f;
+	auto slotBounds = [](const WideBVHNode<Width>& node, int i)
+	{
+		return BBox(Vec3f(node.boundsMin[0][i], node.boundsMin[1][i], node.boundsMin[2][i]),
+			Vec3f(node.boundsMax[0][i], node.boundsMax[1][i], node.boundsMax[2][i]));
+	};
+
+	BBox root;
+	for (int i = 0; i < Width; i++)
+		root.extend(slotBounds(nodes[0], i));
+	const float rootArea = root.surfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	// Every node is entered once, its children are tested together
+	float cost = rootArea * BVH::traversalCost;
+	for (const WideBVHNode<Width>& node : nodes) {
+		for (int i = 0; i < Width; i++) {
+			const float area = slotBounds(node, i).surfaceArea();
+			cost += area * (node.primCount[i] > 0 ? (float)node.primCount[i] : BVH::traversalCost);
+		}
+	}
+	return cost / rootArea;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+void QuantizedBVH::compress(const BVH& bvh)
+{
+	nodes.clear();
+	primIndices = bvh.primIndices;
+	if (bvh.nodes.empty())
+		return;
+
+	// Shape of the tree is the one of BVH4, only boxes are stored differently
+	WideBVH<4> wide;
+	wide.collapse(bvh);
+	nodes.resize(wide.nodes.size());
+	for (size_t n = 0; n < wide.nodes.size(); n++) {
+		const WideBVHNode<4>& wideNode = wide.nodes[n];
+		BBox slots[4];
+		for (int i = 0; i < 4; i++) {
+			if (wideNode.primCount[i] == 0 && wideNode.offset[i] == 0)
+				continue;
+			slots[i] = BBox(Vec3f(wideNode.boundsMin[0][i], wideNode.boundsMin[1][i], wideNode.boundsMin[2][i]),
+				Vec3f(wideNode.boundsMax[0][i], wideNode.boundsMax[1][i], wideNode.boundsMax[2][i]));
+			if (wideNode.primCount[i] > maxLeafSize) {
+				// Vector may grow, don't keep reference to the node
+				const uint32_t leafNode = addLeafNode(wideNode.offset[i], wideNode.primCount[i], slots[i]);
+				nodes[n].offset[i] = leafNode;
+			}
+			else {
+				nodes[n].offset[i] = wideNode.offset[i];
+				nodes[n].primCount[i] = (uint8_t)wideNode.primCount[i];
+			}
+		}
+		quantize(nodes[n], slots);
+	}
+}
+
+uint32_t QuantizedBVH::addLeafNode(uint32_t firstPrim, uint32_t primCount, const BBox& bounds)
+{
+	// Primitives of the leaf are not sorted, every part gets the box of the whole leaf
+	const uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	const uint32_t partSize = (primCount + 3) / 4;
+	BBox slots[4];
+	for (uint32_t i = 0; i < 4 && i * partSize < primCount; i++) {
+		const uint32_t first = firstPrim + i * partSize;
+		const uint32_t count = std::min(partSize, primCount - i * partSize);
+		slots[i] = bounds;
+		if (count > maxLeafSize) {
+			const uint32_t leafNode = addLeafNode(first, count, bounds);
+			nodes[index].offset[i] = leafNode;
+		}
+		else {
+			nodes[index].offset[i] = first;
+			nodes[index].primCount[i] = (uint8_t)count;
+		}
+	}
+	quantize(nodes[index], slots);
+	return index;
+}
+
+void QuantizedBVH::quantize(QuantizedBVHNode& node, const BBox slots[4])
+{
+	BBox bounds;
+	node.childMask = 0;
+	for (int i = 0; i < 4; i++) {
+		if (!slots[i].empty()) {
+			bounds.extend(slots[i]);
+			node.childMask |= 1 << i;
+		}
+	}
+
+	for (int a = 0; a < 3; a++) {
+		const float lo = node.childMask ? bounds[0][a] : 0.0f;
+		const float extent = node.childMask ? bounds[1][a] - lo : 0.0f;
+		node.origin[a] = lo;
+
+		// Smallest cell such as 255 of them cover the box
+		int exponent;
+		std::frexp(extent / 255.0f, &exponent);
+		exponent = std::clamp(exponent, -126, 127);
+
+		// Decoded planes are rounded, last one may fall short of the box, then grid is doubled
+		while (true) {
+			node.exponent[a] = (int8_t)exponent;
+			const float cell = cellSize(node, a);
+			bool fits = true;
+			for (int i = 0; i < 4; i++) {
+				if (!(node.childMask & (1 << i))) {
+					// Inverted box is never hit
+					node.qMin[a][i] = 255;
+					node.qMax[a][i] = 0;
+					continue;
+				}
+				const float cMin = slots[i][0][a], cMax = slots[i][1][a];
+				int qMin = std::clamp((int)std::floor((cMin - lo) / cell), 0, 255);
+				int qMax = std::clamp((int)std::ceil((cMax - lo) / cell), 0, 255);
+				while (qMin > 0 && lo + qMin * cell > cMin)
+					qMin--;
+				while (qMax < 255 && lo + qMax * cell < cMax)
+					qMax++;
+				if (lo + qMax * cell < cMax)
+					fits = false;
+				node.qMin[a][i] = (uint8_t)qMin;
+				node.qMax[a][i] = (uint8_t)qMax;
+			}
+			if (fits || exponent == 127)
+				break;
+			exponent++;
+		}
+	}
+}
+
+BBox QuantizedBVH::childBounds(const QuantizedBVHNode& node, int i)
+{
+	Vec3f bMin, bMax;
+	for (uint8_t a = 0; a < 3; a++) {
+		const float cell = cellSize(node, a);
+		bMin[a] = node.origin[a] + node.qMin[a][i] * cell;
+		bMax[a] = node.origin[a] + node.qMax[a][i] * cell;
+	}
+	return BBox(bMin, bMax);
+}
+
+int QuantizedBVH::countBoxes(const Ray& ray) const
+{
+	if (nodes.empty()) return 0;
+	const Vec3f invDir = 1 / ray.dir;
+	const int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+
+	int result = 0;
+	uint32_t stack[stackSize];
+	int stackTop = 0;
+	stack[stackTop++] = 0;
+	while (stackTop > 0) {
+		const QuantizedBVHNode& node = nodes[stack[--stackTop]];
+		float tNear[4];
+		int mask = intersectBoxes(node, ray.orig, invDir, dirIsNeg, std::numeric_limits<float>::max(), tNear);
+		for (int i = 0; i < 4; i++) {
+			if (mask & (1 << i)) {
+				result++;
+				if (node.primCount[i] == 0)
+					stack[stackTop++] = node.offset[i];
+			}
+		}
+	}
+	return result;
+}
+
+void QuantizedBVH::refit(const std::vector<BBox>& primBounds)
+{
+	// Children are stored after their parent, so backward pass visits them first.
+	// Decoded boxes are bigger than the real ones, so the real ones are kept aside
+	std::vector<BBox> nodeBounds(nodes.size());
+	for (size_t n = nodes.size(); n-- > 0;) {
+		QuantizedBVHNode& node = nodes[n];
+		BBox slots[4];
+		for (int i = 0; i < 4; i++) {
+			if (!(node.childMask & (1 << i)))
+				continue;
+			if (node.primCount[i] > 0) {
+				for (uint32_t p = node.offset[i]; p < node.offset[i] + node.primCount[i]; p++)
+					slots[i].extend(primBounds[primIndices[p]]);
+			}
+			else {
+				slots[i] = nodeBounds[node.offset[i]];
+			}
+			nodeBounds[n].extend(slots[i]);
+		}
+		quantize(node, slots);
+	}
+}
+
+float QuantizedBVH::sahCost() const
+{
+	if (nodes.empty())
+		return 0.0f;
+	BBox root;
+	for (int i = 0; i < 4; i++) {
+		if (nodes[0].childMask & (1 << i))
+			root.extend(childBounds(nodes[0], i));
+	}
+	const float rootArea = root.surfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	// Every node is entered once, its children are tested together
+	float cost = rootArea * BVH::traversalCost;
+	for (const QuantizedBVHNode& node : nodes) {
+		for (int i = 0; i < 4; i++) {
+			if (!(node.childMask & (1 << i)))
+				continue;
+			const float area = childBounds(node, i).surfaceArea();
+			cost += area * (node.primCount[i] > 0 ? (float)node.primCount[i] : BVH::traversalCost);
+		}
+	}
+	return cost / rootArea;
+}
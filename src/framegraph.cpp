@@ -0,0 +1,95 @@
+// Tasks of a frame rendered by tiles, started by their dependencies instead of barriers between passes
+#include "framegraph.h"
+
+#include <chrono>
+#include <map>
+
+FrameGraph::FrameGraph(Scene& a_scene, Vec3f* a_frameBuffer, const std::vector<tileInfo>& a_tiles, bool a_supersample,
+	ImageStream* a_image)
+	: scene(a_scene), frameBuffer{ a_frameBuffer }, tiles(a_tiles), supersample{ a_supersample }, image{ a_image }
+{
+	if (!supersample)
+		return;
+
+	// Tiles share a side if one starts where the other ends and their ranges across it overlap
+	neighbours.resize(tiles.size());
+	std::map<size_t, std::vector<size_t>> byX0, byY0;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		byX0[tiles[i].x0].push_back(i);
+		byY0[tiles[i].y0].push_back(i);
+	}
+	auto link = [&](size_t i, size_t j)
+	{
+		neighbours[i].push_back(j);
+		neighbours[j].push_back(i);
+	};
+	for (size_t i = 0; i < tiles.size(); i++) {
+		const tileInfo& a = tiles[i];
+		const auto right = byX0.find(a.x1);
+		if (right != byX0.end())
+			for (size_t j : right->second)
+				if (tiles[j].y0 < a.y1 && a.y0 < tiles[j].y1)
+					link(i, j);
+		const auto below = byY0.find(a.y1);
+		if (below != byY0.end())
+			for (size_t j : below->second)
+				if (tiles[j].x0 < a.x1 && a.x0 < tiles[j].x1)
+					link(i, j);
+	}
+
+	waiting.reset(new std::atomic<int>[tiles.size()]);
+	for (size_t i = 0; i < tiles.size(); i++)
+		waiting[i] = (int)neighbours[i].size() + 1;
+	const size_t pixels = scene.options.width * scene.options.height;
+	lum.resize(pixels);
+	edges.reset(new bool[pixels]);
+}
+
+void FrameGraph::run(ThreadPool& a_pool, std::vector<float>& a_times)
+{
+	pool = &a_pool;
+	times = &a_times;
+	// Tasks of finished tiles are submitted by workers to their own deques,
+	// so they run before the next tiles are taken, on warm caches
+	for (size_t i = 0; i < tiles.size(); i++)
+		pool->submit(group, [this, i]() { renderTile(i); });
+	pool->wait(group);
+}
+
+void FrameGraph::renderTile(size_t i)
+{
+	const tileInfo& tile = tiles[i];
+	const auto start = std::chrono::high_resolution_clock::now();
+	scene.renderWorker(frameBuffer, tile);
+	(*times)[i] = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	scene.reportProgress();
+
+	if (!supersample) {
+		if (image)
+			image->addRegion(frameBuffer, tile);
+		return;
+	}
+
+	const size_t width = scene.options.width;
+	for (size_t y = tile.y0; y < tile.y1; y++)
+		luminanceRow(frameBuffer + y * width + tile.x0, tile.x1 - tile.x0, &lum[y * width + tile.x0]);
+	auto rendered = [this](size_t j)
+	{
+		if (--waiting[j] == 0)
+			pool->submit(group, [this, j]() { finishTile(j); });
+	};
+	rendered(i);
+	for (size_t j : neighbours[i])
+		rendered(j);
+}
+
+void FrameGraph::finishTile(size_t i)
+{
+	const tileInfo& tile = tiles[i];
+	const size_t width = scene.options.width, height = scene.options.height;
+	const SampleHit* hits = scene.pixelHits.size() == width * height ? scene.pixelHits.data() : nullptr;
+	detectEdges(lum.data(), hits, width, height, tile, edges.get());
+	scene.SSAAworker(frameBuffer, edges.get(), tile);
+	if (image)
+		image->addRegion(frameBuffer, tile);
+}
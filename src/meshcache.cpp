@@ -0,0 +1,539 @@
+// On-disk cache of loaded meshes, unchanged assets skip OBJ parsing and tree build
+#include "meshcache.h"
+
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
+
+#include "objects.h"
+#include "bvh.h"
+#include "timer.h"
+#include "options.h"
+#include "stats.h"
+
+static_assert(std::is_trivially_copyable<Triangle>::value, "Triangles are stored as raw bytes");
+
+namespace
+{
+	struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t accelType;
+		uint32_t triangleSize;		// differs between builds with different layout
+		uint32_t nodeSize;
+		uint32_t padding;
+		uint64_t triangleCount;
+		uint64_t vertexCount;
+		uint64_t normalCount;
+		uint64_t texCoordCount;
+		uint64_t nodeCount;
+		uint64_t indexCount;
+	};
+
+	// Node of split structure in preorder, left child follows its parent
+	struct SplitNode
+	{
+		Vec3f boundsMin;
+		Vec3f boundsMax;
+		uint32_t right;			// zero for leaves
+		uint32_t firstTri;		// triangles are stored for every node, as in the structure
+		uint32_t triCount;
+	};
+
+	constexpr char cacheMagic[4] = { 'R', 'T', 'A', 'C' };
+	constexpr size_t cacheAlignment = 32;
+
+	// FNV-1a
+	uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	template<typename T>
+	uint64_t hashValue(const T& value, uint64_t hash)
+	{
+		return hashBytes(&value, sizeof(T), hash);
+	}
+
+	template<typename T>
+	void writeArray(std::ofstream& ofs, const T* data, size_t count)
+	{
+		ofs.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+		const size_t padding = (cacheAlignment - count * sizeof(T) % cacheAlignment) % cacheAlignment;
+		const char zeros[cacheAlignment] = { 0 };
+		ofs.write(zeros, padding);
+	}
+
+	template<typename T>
+	bool readArray(std::ifstream& ifs, T* data, size_t count)
+	{
+		ifs.read(reinterpret_cast<char*>(data), count * sizeof(T));
+		const size_t padding = (cacheAlignment - count * sizeof(T) % cacheAlignment) % cacheAlignment;
+		ifs.ignore(padding);
+		return ifs.good();
+	}
+
+	// Take count elements with padding from the bytes remaining in the file, false if they don't fit
+	bool takeArray(uint64_t& remaining, uint64_t count, size_t size)
+	{
+		if (count > remaining / size)
+			return false;
+		const uint64_t bytes = count * size;
+		const uint64_t padded = bytes + (cacheAlignment - bytes % cacheAlignment) % cacheAlignment;
+		if (padded > remaining)
+			return false;
+		remaining -= padded;
+		return true;
+	}
+
+	uint32_t getNodeSize(AccelType accelType)
+	{
+		switch (accelType) {
+		case AccelType::Split: return sizeof(SplitNode);
+		case AccelType::BVH4: return sizeof(WideBVHNode<4>);
+		case AccelType::BVH8: return sizeof(WideBVHNode<8>);
+		case AccelType::QBVH: return sizeof(QuantizedBVHNode);
+		default: return sizeof(BVHNode);
+		}
+	}
+
+	void flattenSplit(const AccelerationStructure* ac, std::vector<SplitNode>& nodes, std::vector<uint32_t>& indices)
+	{
+		const size_t index = nodes.size();
+		nodes.emplace_back();
+		nodes[index].boundsMin = ac->bounds[0];
+		nodes[index].boundsMax = ac->bounds[1];
+		nodes[index].firstTri = (uint32_t)indices.size();
+		nodes[index].triCount = (uint32_t)ac->tris.size();
+		nodes[index].right = 0;
+		indices.insert(indices.end(), ac->tris.begin(), ac->tris.end());
+		if (ac->left) {
+			flattenSplit(ac->left.get(), nodes, indices);
+			nodes[index].right = (uint32_t)nodes.size();
+			flattenSplit(ac->right.get(), nodes, indices);
+		}
+	}
+
+	// Trees read from the file are checked in storage order. Children follow their parent,
+	// so depth of a node is known when it is reached, and a child of two nodes is refused
+	bool addChild(std::vector<int>& depths, uint32_t parent, uint64_t child)
+	{
+		if (child <= parent || child >= depths.size() || depths[child] >= 0)
+			return false;
+		depths[child] = depths[parent] + 1;
+		return true;
+	}
+
+	bool validLeaf(uint64_t first, uint64_t count, size_t indexCount)
+	{
+		return first + count <= indexCount;
+	}
+
+	bool validTree(const std::vector<BVHNode>& nodes, size_t indexCount)
+	{
+		std::vector<int> depths(nodes.size(), -1);
+		if (!nodes.empty())
+			depths[0] = 0;
+		for (uint32_t n = 0; n < nodes.size(); n++) {
+			const BVHNode& node = nodes[n];
+			if (depths[n] < 0)
+				return false;
+			if (node.primCount > 0) {
+				if (!validLeaf(node.offset, node.primCount, indexCount))
+					return false;
+			}
+			// Far child is left on stack of traversal by every interior node on the way
+			else if (depths[n] >= BVH::maxDepth || node.offset <= n + 1 || !addChild(depths, n, n + 1)
+				|| !addChild(depths, n, node.offset)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	template<int Width>
+	bool validTree(const std::vector<WideBVHNode<Width>>& nodes, size_t indexCount)
+	{
+		std::vector<int> depths(nodes.size(), -1);
+		if (!nodes.empty())
+			depths[0] = 0;
+		for (uint32_t n = 0; n < nodes.size(); n++) {
+			const WideBVHNode<Width>& node = nodes[n];
+			if (depths[n] < 0 || depths[n] >= BVH::maxDepth)
+				return false;
+			for (int i = 0; i < Width; i++) {
+				if (node.primCount[i] > 0) {
+					if (!validLeaf(node.offset[i], node.primCount[i], indexCount))
+						return false;
+				}
+				else if (node.offset[i] > 0) {
+					if (!addChild(depths, n, node.offset[i]))
+						return false;
+				}
+				else {
+					// Empty slot is never hit only with inverted box
+					for (int a = 0; a < 3; a++)
+						if (!(node.boundsMin[a][i] > node.boundsMax[a][i]))
+							return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool validTree(const std::vector<QuantizedBVHNode>& nodes, size_t indexCount)
+	{
+		std::vector<int> depths(nodes.size(), -1);
+		if (!nodes.empty())
+			depths[0] = 0;
+		for (uint32_t n = 0; n < nodes.size(); n++) {
+			const QuantizedBVHNode& node = nodes[n];
+			if (depths[n] < 0 || depths[n] >= BVH::maxDepth + QuantizedBVH::maxLeafDepth)
+				return false;
+			for (int i = 0; i < 4; i++) {
+				if (!(node.childMask & (1 << i)))
+					continue;
+				if (node.primCount[i] > 0) {
+					if (!validLeaf(node.offset[i], node.primCount[i], indexCount))
+						return false;
+				}
+				else if (!addChild(depths, n, node.offset[i])) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Far deeper than the builder goes, restore and traversal recurse that deep at most
+	constexpr size_t maxSplitDepth = 1024;
+
+	bool validSplit(const std::vector<SplitNode>& nodes, size_t indexCount)
+	{
+		// Walk in preorder has to meet nodes in the order they are stored, so every node has one parent
+		std::vector<std::pair<uint64_t, size_t>> stack = { { 0, 0 } };		// node and its depth
+		uint64_t next = 0;
+		while (!stack.empty()) {
+			const auto [index, depth] = stack.back();
+			stack.pop_back();
+			if (index != next || index >= nodes.size() || depth > maxSplitDepth)
+				return false;
+			next++;
+			const SplitNode& node = nodes[index];
+			if (!validLeaf(node.firstTri, node.triCount, indexCount))
+				return false;
+			if (node.right != 0) {
+				stack.push_back({ node.right, depth + 1 });
+				stack.push_back({ index + 1, depth + 1 });
+			}
+		}
+		return next == nodes.size();
+	}
+
+	std::unique_ptr<AccelerationStructure> restoreSplit(const std::vector<SplitNode>& nodes, uint32_t index,
+		const std::vector<uint32_t>& indices)
+	{
+		const SplitNode& node = nodes[index];
+		auto ac = std::make_unique<AccelerationStructure>();
+		ac->setBounds(node.boundsMin, node.boundsMax);
+		ac->tris.assign(indices.begin() + node.firstTri, indices.begin() + node.firstTri + node.triCount);
+		if (node.right != 0) {
+			ac->left = restoreSplit(nodes, index + 1, indices);
+			ac->right = restoreSplit(nodes, node.right, indices);
+		}
+		else if (options::collectStatistics) {
+			stats::triCopiesCount += ac->tris.size();
+		}
+		return ac;
+	}
+}
+
+uint64_t MeshCache::computeKey(const std::string& objBytes, const Mesh& mesh, const Options& options)
+{
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashValue(version, hash);
+	hash = hashBytes(objBytes.data(), objBytes.size(), hash);
+	hash = hashValue(mesh.size, hash);
+	hash = hashValue(mesh.rot, hash);
+	hash = hashValue(mesh.pos, hash);
+	hash = hashValue(mesh.accelType, hash);
+	hash = hashValue(options.acPenalty, hash);
+	hash = hashValue(options.bvhQuality, hash);
+	hash = hashValue(options.bias, hash);
+	hash = hashValue(options::useAC, hash);
+	return hash;
+}
+
+std::string MeshCache::getPath(uint64_t key, const Options& options)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.rtac", (unsigned long long)key);
+	return (std::filesystem::path(options.acCacheDir) / name).string();
+}
+
+bool MeshCache::load(Mesh& mesh, uint64_t key, const Options& options)
+{
+	const std::string path = getPath(key, options);
+	std::ifstream ifs(path, std::ios::in | std::ios::binary);
+	if (!ifs.good())
+		return false;
+	Timer t("Mesh cache load");
+
+	CacheHeader header;
+	if (!readArray(ifs, &header, 1))
+		return false;
+	if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != version || header.key != key
+		|| header.accelType != (uint32_t)mesh.accelType || header.triangleSize != sizeof(Triangle)
+		|| header.nodeSize != getNodeSize(mesh.accelType)) {
+		if (options::enableOutput) {
+			std::cout << "Mesh cache file is stale, it will be replaced\n";
+		}
+		return false;
+	}
+
+	// Counts come from the file, so they are checked against its size before anything is allocated
+	std::error_code error;
+	uint64_t remaining = std::filesystem::file_size(path, error);
+	const bool fits = !error && takeArray(remaining, 1, sizeof(CacheHeader))
+		&& takeArray(remaining, header.triangleCount, sizeof(Triangle))
+		&& takeArray(remaining, header.triangleCount, sizeof(uint32_t))
+		&& takeArray(remaining, header.vertexCount, sizeof(Vec3f))
+		&& takeArray(remaining, header.normalCount, sizeof(Vec3f))
+		&& takeArray(remaining, header.texCoordCount, sizeof(Vec2f))
+		&& takeArray(remaining, header.nodeCount, header.nodeSize)
+		&& takeArray(remaining, header.indexCount, sizeof(uint32_t));
+	if (!fits) {
+		if (options::enableOutput) {
+			std::cout << "Mesh cache file is truncated, it will be replaced\n";
+		}
+		return false;
+	}
+	// Triangles and nodes refer to each other by 32-bit indices
+	if (remaining != 0 || header.triangleCount > Triangle::noIndex || header.nodeCount > Triangle::noIndex) {
+		if (options::enableOutput) {
+			std::cout << "Mesh cache file is broken, it will be replaced\n";
+		}
+		return false;
+	}
+
+	// Read everything before touching the mesh, so broken file leaves it empty
+	std::vector<Triangle> triangles(header.triangleCount);
+	std::vector<uint32_t> faces(header.triangleCount);
+	std::vector<Vec3f> vertices(header.vertexCount);
+	std::vector<Vec3f> normals(header.normalCount);
+	std::vector<Vec2f> texCoords(header.texCoordCount);
+	std::vector<uint32_t> indices(header.indexCount);
+	std::vector<SplitNode> splitNodes;
+	std::unique_ptr<BVH> bvh;
+	std::unique_ptr<WideBVH<4>> bvh4;
+	std::unique_ptr<WideBVH<8>> bvh8;
+	std::unique_ptr<QuantizedBVH> qbvh;
+	bool ok = readArray(ifs, triangles.data(), triangles.size());
+	ok = ok && readArray(ifs, faces.data(), faces.size());
+	ok = ok && readArray(ifs, vertices.data(), vertices.size());
+	ok = ok && readArray(ifs, normals.data(), normals.size());
+	ok = ok && readArray(ifs, texCoords.data(), texCoords.size());
+	if (mesh.accelType == AccelType::Split) {
+		splitNodes.resize(header.nodeCount);
+		ok = ok && readArray(ifs, splitNodes.data(), splitNodes.size());
+	}
+	else if (mesh.accelType == AccelType::BVH4) {
+		bvh4 = std::make_unique<WideBVH<4>>();
+		bvh4->nodes.resize(header.nodeCount);
+		ok = ok && readArray(ifs, bvh4->nodes.data(), bvh4->nodes.size());
+	}
+	else if (mesh.accelType == AccelType::BVH8) {
+		bvh8 = std::make_unique<WideBVH<8>>();
+		bvh8->nodes.resize(header.nodeCount);
+		ok = ok && readArray(ifs, bvh8->nodes.data(), bvh8->nodes.size());
+	}
+	else if (mesh.accelType == AccelType::QBVH) {
+		qbvh = std::make_unique<QuantizedBVH>();
+		qbvh->nodes.resize(header.nodeCount);
+		ok = ok && readArray(ifs, qbvh->nodes.data(), qbvh->nodes.size());
+	}
+	else {
+		bvh = std::make_unique<BVH>();
+		bvh->nodes.resize(header.nodeCount);
+		ok = ok && readArray(ifs, bvh->nodes.data(), bvh->nodes.size());
+	}
+	ok = ok && readArray(ifs, indices.data(), indices.size());
+	if (!ok) {
+		if (options::enableOutput) {
+			std::cout << "Mesh cache file is truncated, it will be replaced\n";
+		}
+		return false;
+	}
+
+	// Indices are trusted only after they are checked against the buffers
+	bool valid = true;
+	for (const Triangle& tri : triangles) {
+		for (int k = 0; k < 3; k++) {
+			if (tri.v[k] >= vertices.size() || (tri.n[k] != Triangle::noIndex && tri.n[k] >= normals.size())
+				|| (tri.t[k] != Triangle::noIndex && tri.t[k] >= texCoords.size()))
+				valid = false;
+		}
+	}
+	for (uint32_t index : indices)
+		valid = valid && index < triangles.size();
+	if (mesh.accelType == AccelType::Split)
+		valid = valid && validSplit(splitNodes, indices.size());
+	else if (bvh4)
+		valid = valid && validTree(bvh4->nodes, indices.size());
+	else if (bvh8)
+		valid = valid && validTree(bvh8->nodes, indices.size());
+	else if (qbvh)
+		valid = valid && validTree(qbvh->nodes, indices.size());
+	else
+		valid = valid && validTree(bvh->nodes, indices.size());
+	if (!valid) {
+		if (options::enableOutput) {
+			std::cout << "Mesh cache file is broken, it will be replaced\n";
+		}
+		return false;
+	}
+
+	mesh.triangles = std::move(triangles);
+	mesh.faces = std::move(faces);
+	mesh.vertices = std::move(vertices);
+	mesh.normals = std::move(normals);
+	mesh.texCoords = std::move(texCoords);
+	for (const Triangle& tri : mesh.triangles)
+		for (int k = 0; k < 3; k++)
+			mesh.bounds.extend(mesh.getVertex(tri, k));
+
+	if (mesh.accelType == AccelType::Split) {
+		mesh.ac = restoreSplit(splitNodes, 0, indices);
+		return true;
+	}
+	mesh.assignTriangleData();
+	if (bvh4) {
+		bvh4->primIndices = std::move(indices);
+		mesh.builtCost = bvh4->sahCost();
+		mesh.bvh4 = std::move(bvh4);
+	}
+	else if (bvh8) {
+		bvh8->primIndices = std::move(indices);
+		mesh.builtCost = bvh8->sahCost();
+		mesh.bvh8 = std::move(bvh8);
+	}
+	else if (qbvh) {
+		qbvh->primIndices = std::move(indices);
+		mesh.builtCost = qbvh->sahCost();
+		mesh.qbvh = std::move(qbvh);
+	}
+	else {
+		bvh->primIndices = std::move(indices);
+		mesh.builtCost = bvh->sahCost();
+		mesh.bvh = std::move(bvh);
+	}
+	if (options::collectStatistics) {
+		stats::acCount += (int)header.nodeCount;
+		stats::triCopiesCount += mesh.triangles.size();
+	}
+	return true;
+}
+
+bool MeshCache::save(const Mesh& mesh, uint64_t key, const Options& options)
+{
+	std::error_code error;
+	std::filesystem::create_directories(options.acCacheDir, error);
+
+	CacheHeader header;
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = version;
+	header.key = key;
+	header.accelType = (uint32_t)mesh.accelType;
+	header.triangleSize = sizeof(Triangle);
+	header.nodeSize = getNodeSize(mesh.accelType);
+	header.padding = 0;
+	header.triangleCount = mesh.triangles.size();
+	header.vertexCount = mesh.vertices.size();
+	header.normalCount = mesh.normals.size();
+	header.texCoordCount = mesh.texCoords.size();
+
+	std::vector<SplitNode> splitNodes;
+	std::vector<uint32_t> splitIndices;
+	if (mesh.accelType == AccelType::Split) {
+		flattenSplit(mesh.ac.get(), splitNodes, splitIndices);
+		header.nodeCount = splitNodes.size();
+		header.indexCount = splitIndices.size();
+	}
+	else if (mesh.accelType == AccelType::BVH4) {
+		header.nodeCount = mesh.bvh4->nodes.size();
+		header.indexCount = mesh.bvh4->primIndices.size();
+	}
+	else if (mesh.accelType == AccelType::BVH8) {
+		header.nodeCount = mesh.bvh8->nodes.size();
+		header.indexCount = mesh.bvh8->primIndices.size();
+	}
+	else if (mesh.accelType == AccelType::QBVH) {
+		header.nodeCount = mesh.qbvh->nodes.size();
+		header.indexCount = mesh.qbvh->primIndices.size();
+	}
+	else {
+		header.nodeCount = mesh.bvh->nodes.size();
+		header.indexCount = mesh.bvh->primIndices.size();
+	}
+
+	// Other processes may read the cache, so file appears only when it is complete
+	const std::string path = getPath(key, options);
+	const std::string tmpPath = path + '.' +
+		std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	std::ofstream ofs(tmpPath, std::ios::out | std::ios::binary);
+	if (!ofs.good()) {
+		std::cout << "Error, failed to write mesh cache: " << tmpPath << '\n';
+		return false;
+	}
+
+	writeArray(ofs, &header, 1);
+	writeArray(ofs, mesh.triangles.data(), mesh.triangles.size());
+	writeArray(ofs, mesh.faces.data(), mesh.faces.size());
+	writeArray(ofs, mesh.vertices.data(), mesh.vertices.size());
+	writeArray(ofs, mesh.normals.data(), mesh.normals.size());
+	writeArray(ofs, mesh.texCoords.data(), mesh.texCoords.size());
+	if (mesh.accelType == AccelType::Split) {
+		writeArray(ofs, splitNodes.data(), splitNodes.size());
+		writeArray(ofs, splitIndices.data(), splitIndices.size());
+	}
+	else if (mesh.accelType == AccelType::BVH4) {
+		writeArray(ofs, mesh.bvh4->nodes.data(), mesh.bvh4->nodes.size());
+		writeArray(ofs, mesh.bvh4->primIndices.data(), mesh.bvh4->primIndices.size());
+	}
+	else if (mesh.accelType == AccelType::BVH8) {
+		writeArray(ofs, mesh.bvh8->nodes.data(), mesh.bvh8->nodes.size());
+		writeArray(ofs, mesh.bvh8->primIndices.data(), mesh.bvh8->primIndices.size());
+	}
+	else if (mesh.accelType == AccelType::QBVH) {
+		writeArray(ofs, mesh.qbvh->nodes.data(), mesh.qbvh->nodes.size());
+		writeArray(ofs, mesh.qbvh->primIndices.data(), mesh.qbvh->primIndices.size());
+	}
+	else {
+		writeArray(ofs, mesh.bvh->nodes.data(), mesh.bvh->nodes.size());
+		writeArray(ofs, mesh.bvh->primIndices.data(), mesh.bvh->primIndices.size());
+	}
+	ofs.close();
+	if (!ofs.good()) {
+		std::cout << "Error, failed to write mesh cache: " << tmpPath << '\n';
+		std::filesystem::remove(tmpPath, error);
+		return false;
+	}
+
+	std::filesystem::rename(tmpPath, path, error);
+	if (error) {
+		std::cout << "Error, failed to write mesh cache: " << path << '\n';
+		std::filesystem::remove(tmpPath, error);
+		return false;
+	}
+	return true;
+}
@@ -4,9 +4,13 @@
 #include <fstream>
 #include <cstring>
 
+#include "bvh.h"
+#include "meshcache.h"
+#include "threadpool.h"
 #include "timer.h"
 #include "util.h"
 #include "options.h"
+#include "simd.h"
 #include "stats.h"
 
 Object::Object(const Vec3f& a_center, const Vec3f& a_color, const MaterialType& a_materialType)
@@ -14,61 +18,19 @@ Object::Object(const Vec3f& a_center, const Vec3f& a_color, const MaterialType&
 
 Object::~Object() {}
 
-Triangle::Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c)
-	: a(a_a), b(a_b), c(a_c)
+bool Object::getBounds(BBox&) const
 {
-	n_a = n_b = n_c = (a_b - a_a).crossProduct(a_c - a_a);
+	return false;
 }
 
-Triangle::Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c, 
-	const Vec3f& a_n_a, const Vec3f& a_n_b, const Vec3f& a_n_c)
-	: Triangle(a_a, a_b, a_c)
-{
-	n_a = a_n_a;
-	n_b = a_n_b;
-	n_c = a_n_c;
-}
-
-Triangle::Triangle(const Vec3f& a_a, const Vec3f& a_b, const Vec3f& a_c,
-	const Vec3f& a_n_a, const Vec3f& a_n_b, const Vec3f& a_n_c,
-	const Vec2f& a_t_a, const Vec2f& a_t_b, const Vec2f& a_t_c)
-	: Triangle(a_a, a_b, a_c, a_n_a, a_n_b, a_n_c)
-{
-	t_a = a_t_a;
-	t_b = a_t_b;
-	t_c = a_t_c;
-
-	// Triangle has texture coordinates - calculate its tangent and bitangent
-	tangent, bitangent;
-	Vec3f edge1 = b - a;
-	Vec3f edge2 = c - a;
-	Vec2f deltaUV1 = t_b - t_a;
-	Vec2f deltaUV2 = t_c - t_a;
-
-	float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-	tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-	tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-	tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-
-	bitangent.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
-	bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
-	bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
-}
-
-
-bool Triangle::rayTriangleIntersect(const Ray& ray, const Triangle* triPtr,
-	float& t, Vec2f& uv)
+bool Triangle::rayTriangleIntersect(const Ray& ray, const Vec3f& v0, const Vec3f& v0v1,
+	const Vec3f& v0v2, float& t, Vec2f& uv)
 {
 	if (options::collectStatistics) {
 		stats::rayTriTests++;
 	}
-	const Vec3f& v0 = triPtr->a;
-	const Vec3f& v1 = triPtr->b;
-	const Vec3f& v2 = triPtr->c;
 
 	float u, v;
-	Vec3f v0v1 = v1 - v0;
-	Vec3f v0v2 = v2 - v0;
 	Vec3f pvec = ray.dir.crossProduct(v0v2);
 	float det = v0v1.dotProduct(pvec);
 
@@ -94,6 +56,325 @@ bool Triangle::rayTriangleIntersect(const Ray& ray, const Triangle* triPtr,
 	return true;
 }
 
+void TriangleEdges::assign(const std::vector<Triangle>& tris, const std::vector<Vec3f>& vertices)
+{
+	for (int a = 0; a < 3; a++) {
+		v0[a].assign(tris.size() + padding, 0.0f);
+		edge1[a].assign(tris.size() + padding, 0.0f);
+		edge2[a].assign(tris.size() + padding, 0.0f);
+	}
+	for (size_t i = 0; i < tris.size(); i++)
+		set(i, vertices[tris[i].v[0]], vertices[tris[i].v[1]], vertices[tris[i].v[2]]);
+}
+
+void TriangleEdges::set(size_t index, const Vec3f& a, const Vec3f& b, const Vec3f& c)
+{
+	const Vec3f e1 = b - a;
+	const Vec3f e2 = c - a;
+	for (uint8_t i = 0; i < 3; i++) {
+		v0[i][index] = a[i];
+		edge1[i][index] = e1[i];
+		edge2[i][index] = e2[i];
+	}
+}
+
+namespace
+{
+#if defined(RT_USE_SSE)
+	// Operations on groups of triangles, one triangle per lane
+	struct Lanes4
+	{
+		using V = __m128;
+		static constexpr int width = 4;
+		static V set1(float x) { return _mm_set1_ps(x); }
+		static V load(const float* p) { return _mm_loadu_ps(p); }
+		static V add(V a, V b) { return _mm_add_ps(a, b); }
+		static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+		static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+		static V div(V a, V b) { return _mm_div_ps(a, b); }
+		static V lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+		static V le(V a, V b) { return _mm_cmple_ps(a, b); }
+		static V eq(V a, V b) { return _mm_cmpeq_ps(a, b); }
+		static V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		static V orMask(V a, V b) { return _mm_or_ps(a, b); }
+		static int bits(V a) { return _mm_movemask_ps(a); }
+		static void store(float* p, V a) { _mm_storeu_ps(p, a); }
+	};
+#endif
+#if defined(RT_USE_AVX)
+	struct Lanes8
+	{
+		using V = __m256;
+		static constexpr int width = 8;
+		static V set1(float x) { return _mm256_set1_ps(x); }
+		static V load(const float* p) { return _mm256_loadu_ps(p); }
+		static V add(V a, V b) { return _mm256_add_ps(a, b); }
+		static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+		static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+		static V div(V a, V b) { return _mm256_div_ps(a, b); }
+		static V lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static V le(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+		static V eq(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+		static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+		static V orMask(V a, V b) { return _mm256_or_ps(a, b); }
+		static int bits(V a) { return _mm256_movemask_ps(a); }
+		static void store(float* p, V a) { _mm256_storeu_ps(p, a); }
+	};
+#endif
+
+#if defined(RT_USE_SSE)
+	// Moller-Trumbore test of L::width triangles starting from first. Operations are
+	// the ones of the scalar test in the same order, so results are equal.
+	// Returns bitmask of hit lanes, their t and uv are stored in the arrays
+	template<typename L>
+	int intersectGroup(const TriangleEdges& edges, size_t first, const Ray& ray,
+		float t[], float u[], float v[])
+	{
+		using V = typename L::V;
+		V dir[3], orig[3], v0[3], e1[3], e2[3];
+		for (int a = 0; a < 3; a++) {
+			dir[a] = L::set1(ray.dir[a]);
+			orig[a] = L::set1(ray.orig[a]);
+			v0[a] = L::load(edges.v0[a].data() + first);
+			e1[a] = L::load(edges.edge1[a].data() + first);
+			e2[a] = L::load(edges.edge2[a].data() + first);
+		}
+		auto dot = [](const V a[3], const V b[3])
+		{
+			return L::add(L::add(L::mul(a[0], b[0]), L::mul(a[1], b[1])), L::mul(a[2], b[2]));
+		};
+		auto cross = [](const V a[3], const V b[3], V result[3])
+		{
+			result[0] = L::sub(L::mul(a[1], b[2]), L::mul(a[2], b[1]));
+			result[1] = L::sub(L::mul(a[2], b[0]), L::mul(a[0], b[2]));
+			result[2] = L::sub(L::mul(a[0], b[1]), L::mul(a[1], b[0]));
+		};
+
+		V pvec[3];
+		cross(dir, e2, pvec);
+		const V det = dot(e1, pvec);
+		// Float nearest to 1e-8 is below it, so det <= eps is det < 1e-8 of the scalar test
+		const V eps = L::set1(1e-8f);
+		V reject = L::le(L::abs(det), eps);
+		if (options::useBackfaceCulling)
+			reject = L::orMask(reject, L::le(det, eps));
+		if (L::bits(reject) == (1 << L::width) - 1)
+			return 0;
+
+		const V zero = L::set1(0.0f), one = L::set1(1.0f);
+		const V invDet = L::div(one, det);
+		V tvec[3];
+		for (int a = 0; a < 3; a++)
+			tvec[a] = L::sub(orig[a], v0[a]);
+		const V uLanes = L::mul(dot(tvec, pvec), invDet);
+		reject = L::orMask(reject, L::orMask(L::lt(uLanes, zero), L::lt(one, uLanes)));
+
+		V qvec[3];
+		cross(tvec, e1, qvec);
+		const V vLanes = L::mul(dot(dir, qvec), invDet);
+		reject = L::orMask(reject, L::orMask(L::lt(vLanes, zero), L::lt(one, L::add(uLanes, vLanes))));
+
+		const V tLanes = L::mul(dot(e2, qvec), invDet);
+		reject = L::orMask(reject, L::lt(tLanes, zero));
+
+		const int mask = ~L::bits(reject) & ((1 << L::width) - 1);
+		if (mask) {
+			L::store(t, tLanes);
+			L::store(u, uLanes);
+			L::store(v, vLanes);
+		}
+		return mask;
+	}
+
+	// Affine test of L::width triangles, same as the scalar one
+	template<typename L>
+	int intersectAffineGroup(const TriangleTransforms& transforms, size_t first, const Ray& ray,
+		float tMax, float t[], float u[], float v[])
+	{
+		using V = typename L::V;
+		// Row of transformation applied to point (w is 1) or direction (w is 0)
+		auto transform = [&](int row, const Vec3f& p, bool point)
+		{
+			V result = L::add(L::add(L::mul(L::load(transforms.rows[row][0].data() + first), L::set1(p.x)),
+				L::mul(L::load(transforms.rows[row][1].data() + first), L::set1(p.y))),
+				L::mul(L::load(transforms.rows[row][2].data() + first), L::set1(p.z)));
+			return point ? L::add(result, L::load(transforms.rows[row][3].data() + first)) : result;
+		};
+
+		const V zero = L::set1(0.0f), one = L::set1(1.0f);
+		const V dz = transform(2, ray.dir, false);
+		V reject = options::useBackfaceCulling ? L::le(zero, dz) : L::eq(dz, zero);
+		if (L::bits(reject) == (1 << L::width) - 1)
+			return 0;
+
+		// Distance is known first, so triangles behind the closest hit skip the rest
+		const V tLanes = L::div(L::sub(zero, transform(2, ray.orig, true)), dz);
+		reject = L::orMask(reject, L::orMask(L::lt(tLanes, zero), L::le(L::set1(tMax), tLanes)));
+		if (L::bits(reject) == (1 << L::width) - 1)
+			return 0;
+		const V uLanes = L::add(transform(0, ray.orig, true), L::mul(tLanes, transform(0, ray.dir, false)));
+		reject = L::orMask(reject, L::orMask(L::lt(uLanes, zero), L::lt(one, uLanes)));
+		const V vLanes = L::add(transform(1, ray.orig, true), L::mul(tLanes, transform(1, ray.dir, false)));
+		reject = L::orMask(reject, L::orMask(L::lt(vLanes, zero), L::lt(one, L::add(uLanes, vLanes))));
+
+		const int mask = ~L::bits(reject) & ((1 << L::width) - 1);
+		if (mask) {
+			L::store(t, tLanes);
+			L::store(u, uLanes);
+			L::store(v, vLanes);
+		}
+		return mask;
+	}
+
+	// Closest hit in groups, intersectGroup(first, t, u, v) tests one of them
+	template<typename L, typename G>
+	bool intersectGroups(uint32_t begin, uint32_t end, G&& intersectGroup,
+		float& tMax, uint32_t& hitIndex, Vec2f& uv)
+	{
+		bool hit = false;
+		float t[L::width], u[L::width], v[L::width];
+		for (uint32_t first = begin; first < end; first += L::width) {
+			int mask = intersectGroup(first, t, u, v);
+			// Lanes past the end belong to the next leaf
+			if (end - first < (uint32_t)L::width)
+				mask &= (1 << (end - first)) - 1;
+			// Lanes in triangle order, so equal t keeps the first one as scalar loop does
+			for (int i = 0; mask; i++, mask >>= 1) {
+				if ((mask & 1) && t[i] < tMax) {
+					tMax = t[i];
+					hitIndex = first + i;
+					uv.x = u[i]; uv.y = v[i];
+					hit = true;
+				}
+			}
+		}
+		return hit;
+	}
+#endif
+}
+
+bool TriangleEdges::intersect(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+	uint32_t& hitIndex, Vec2f& uv) const
+{
+#if defined(RT_USE_SSE)
+	if (options::collectStatistics) {
+		stats::rayTriTests += end - begin;
+	}
+	#if defined(RT_USE_AVX)
+		using L = Lanes8;
+	#else
+		using L = Lanes4;
+	#endif
+	return intersectGroups<L>(begin, end, [&](size_t first, float t[], float u[], float v[])
+		{
+			return intersectGroup<L>(*this, first, ray, t, u, v);
+		}, tMax, hitIndex, uv);
+#else
+	bool hit = false;
+	for (uint32_t i = begin; i < end; i++) {
+		float t;
+		Vec2f triUV;
+		if (intersect(ray, i, t, triUV) && t < tMax) {
+			tMax = t;
+			hitIndex = i;
+			uv = triUV;
+			hit = true;
+		}
+	}
+	return hit;
+#endif
+}
+
+
+void TriangleTransforms::assign(const std::vector<Triangle>& tris, const std::vector<Vec3f>& vertices)
+{
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 4; c++)
+			rows[r][c].assign(tris.size() + padding, 0.0f);
+	}
+	for (size_t i = 0; i < tris.size(); i++)
+		set(i, vertices[tris[i].v[0]], vertices[tris[i].v[1]], vertices[tris[i].v[2]]);
+}
+
+void TriangleTransforms::set(size_t index, const Vec3f& a, const Vec3f& b, const Vec3f& c)
+{
+	// Edges and normal are columns of the matrix taking unit triangle to the triangle,
+	// rows of its inverse are cross products of the columns. Thin triangles need doubles
+	const Vec3<double> v0(a.x, a.y, a.z);
+	const Vec3<double> e1 = Vec3<double>(b.x, b.y, b.z) - v0;
+	const Vec3<double> e2 = Vec3<double>(c.x, c.y, c.z) - v0;
+	const Vec3<double> n = e1.crossProduct(e2);
+	const double det = n.dotProduct(n);
+	Vec3<double> inverse[3] = { e2.crossProduct(n), n.crossProduct(e1), n };
+
+	for (int r = 0; r < 3; r++) {
+		// Zero rows of degenerate triangle give zero denominator, it is never hit
+		const Vec3<double> row = det > 0.0 ? inverse[r] * (1.0 / det) : Vec3<double>(0.0);
+		rows[r][0][index] = (float)row.x;
+		rows[r][1][index] = (float)row.y;
+		rows[r][2][index] = (float)row.z;
+		rows[r][3][index] = (float)-row.dotProduct(v0);
+	}
+}
+
+bool TriangleTransforms::intersect(const Ray& ray, size_t index, float& t, Vec2f& uv) const
+{
+	if (options::collectStatistics) {
+		stats::rayTriTests++;
+	}
+	auto transform = [&](int row, const Vec3f& p, bool point)
+	{
+		const float result = rows[row][0][index] * p.x + rows[row][1][index] * p.y + rows[row][2][index] * p.z;
+		return point ? result + rows[row][3][index] : result;
+	};
+
+	// Ray has to come from the front side with culling
+	const float dz = transform(2, ray.dir, false);
+	if (options::useBackfaceCulling ? dz >= 0.0f : dz == 0.0f) return false;
+
+	t = -transform(2, ray.orig, true) / dz;
+	if (t < 0) return false;
+	const float u = transform(0, ray.orig, true) + t * transform(0, ray.dir, false);
+	if (u < 0 || u > 1) return false;
+	const float v = transform(1, ray.orig, true) + t * transform(1, ray.dir, false);
+	if (v < 0 || u + v > 1) return false;
+
+	uv.x = u; uv.y = v;
+	return true;
+}
+
+bool TriangleTransforms::intersect(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+	uint32_t& hitIndex, Vec2f& uv) const
+{
+#if defined(RT_USE_SSE)
+	if (options::collectStatistics) {
+		stats::rayTriTests += end - begin;
+	}
+	#if defined(RT_USE_AVX)
+		using L = Lanes8;
+	#else
+		using L = Lanes4;
+	#endif
+	return intersectGroups<L>(begin, end, [&](size_t first, float t[], float u[], float v[])
+		{
+			return intersectAffineGroup<L>(*this, first, ray, tMax, t, u, v);
+		}, tMax, hitIndex, uv);
+#else
+	bool hit = false;
+	for (uint32_t i = begin; i < end; i++) {
+		float t;
+		Vec2f triUV;
+		if (intersect(ray, i, t, triUV) && t < tMax) {
+			tMax = t;
+			hitIndex = i;
+			uv = triUV;
+			hit = true;
+		}
+	}
+	return hit;
+#endif
+}
+
 
 Mesh::Mesh()
 {
@@ -102,8 +383,6 @@ Mesh::Mesh()
 
 Mesh::~Mesh()
 {
-	for (const Triangle* tri : allTris)
-		delete tri;
 }
 
 bool Mesh::intersectObject(const Ray& ray, float& t0, Vec2f& uv) const
@@ -115,22 +394,193 @@ bool Mesh::intersectObject(const Ray& ray, float& t0, Vec2f& uv) const
 bool Mesh::intersectMesh(const Ray& ray, float& t0, const Triangle*& triPtr,
 	Vec2f& uv) const
 {
-	return ac->intersectAccelStruct(ray, t0, triPtr, uv);
+	if (accelType == AccelType::Split)
+		return ac->intersectAccelStruct(*this, ray, t0, triPtr, uv);
+
+	// Triangles are sorted in leaf order, so leaf range is the range of triangles
+	auto intersectTriangle = [&](uint32_t begin, uint32_t end, float& tMax)
+	{
+		uint32_t index;
+		if (intersectTriangles(ray, begin, end, tMax, index, uv)) {
+			triPtr = &triangles[index];
+			return true;
+		}
+		return false;
+	};
+
+	t0 = std::numeric_limits<float>::max();
+	if (accelType == AccelType::BVH4)
+		return bvh4->intersect(ray, t0, intersectTriangle);
+	if (accelType == AccelType::BVH8)
+		return bvh8->intersect(ray, t0, intersectTriangle);
+	if (accelType == AccelType::QBVH)
+		return qbvh->intersect(ray, t0, intersectTriangle);
+	return bvh->intersect(ray, t0, intersectTriangle);
+}
+
+bool Mesh::occludedMesh(const Ray& ray, float maxT, const Triangle*& triPtr) const
+{
+	if (accelType == AccelType::Split)
+		return ac->occludedAccelStruct(*this, ray, maxT, triPtr);
+
+	// Closest hit inside a leaf is found with the same grouped test, then traversal stops
+	auto occludedTriangles = [&](uint32_t begin, uint32_t end, float tMax)
+	{
+		uint32_t index;
+		Vec2f uv;
+		if (intersectTriangles(ray, begin, end, tMax, index, uv)) {
+			triPtr = &triangles[index];
+			return true;
+		}
+		return false;
+	};
+
+	if (accelType == AccelType::BVH4)
+		return bvh4->occluded(ray, maxT, occludedTriangles);
+	if (accelType == AccelType::BVH8)
+		return bvh8->occluded(ray, maxT, occludedTriangles);
+	if (accelType == AccelType::QBVH)
+		return qbvh->occluded(ray, maxT, occludedTriangles);
+	return bvh->occluded(ray, maxT, occludedTriangles);
+}
+
+bool Mesh::occludedTriangle(const Ray& ray, uint32_t index, float maxT) const
+{
+	if (index >= triangles.size())
+		return false;
+	// Single triangle tests give the same result as the grouped ones of leaves
+	float t;
+	Vec2f uv;
+	const Triangle* triPtr = &triangles[index];
+	bool hit;
+	if (accelType != AccelType::Split && triangleTest == TriangleTest::Affine)
+		hit = triTransforms.intersect(ray, index, t, uv);
+	else if (accelType != AccelType::Split && triangleTest == TriangleTest::MollerTrumbore)
+		hit = triEdges.intersect(ray, index, t, uv);
+	else {
+		const Vec3f& a = getVertex(*triPtr, 0);
+		hit = Triangle::rayTriangleIntersect(ray, a, getVertex(*triPtr, 1) - a, getVertex(*triPtr, 2) - a, t, uv);
+	}
+	return hit && t < maxT;
+}
+
+uint64_t Mesh::intersectMeshPacket(RayPacket& packet, uint64_t mask, const Triangle* triPtrs[],
+	Vec2f uvs[]) const
+{
+	uint64_t hitMask = 0;
+	if (accelType != AccelType::BVH) {
+		for (int r = 0; r < packet.size; r++) {
+			float t;
+			const Triangle* triPtr;
+			Vec2f uv;
+			if ((mask >> r & 1) && intersectMesh(packet.rays[r], t, triPtr, uv) && t < packet.tMax[r]) {
+				packet.tMax[r] = t;
+				triPtrs[r] = triPtr;
+				uvs[r] = uv;
+				hitMask |= 1ull << r;
+			}
+		}
+		return hitMask;
+	}
+
+	// Rays reaching a leaf are tested against its triangles one by one
+	bvh->intersectPacket(packet, mask, [&](uint32_t begin, uint32_t end, uint64_t rayMask)
+		{
+			for (int r = 0; r < packet.size; r++) {
+				uint32_t index;
+				if ((rayMask >> r & 1) && intersectTriangles(packet.rays[r], begin, end, packet.tMax[r], index, uvs[r])) {
+					triPtrs[r] = &triangles[index];
+					hitMask |= 1ull << r;
+				}
+			}
+		});
+	return hitMask;
+}
+
+bool Mesh::intersectTriangles(const Ray& ray, uint32_t begin, uint32_t end, float& tMax,
+	uint32_t& index, Vec2f& uv) const
+{
+	if (triangleTest == TriangleTest::Affine)
+		return triTransforms.intersect(ray, begin, end, tMax, index, uv);
+	if (triangleTest == TriangleTest::MollerTrumbore)
+		return triEdges.intersect(ray, begin, end, tMax, index, uv);
+
+	// Vertices are read through indices, one triangle at a time
+	bool hit = false;
+	for (uint32_t i = begin; i < end; i++) {
+		const Triangle& tri = triangles[i];
+		const Vec3f& a = getVertex(tri, 0);
+		float t;
+		Vec2f triUV;
+		if (Triangle::rayTriangleIntersect(ray, a, getVertex(tri, 1) - a, getVertex(tri, 2) - a, t, triUV)
+			&& t < tMax) {
+			tMax = t;
+			uv = triUV;
+			index = i;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+bool Mesh::getBounds(BBox& a_bounds) const
+{
+	if (bounds.empty())
+		return false;
+	a_bounds = bounds;
+	return true;
+}
+
+int Mesh::countAC(const Ray& ray) const
+{
+	if (accelType == AccelType::Split)
+		return ac->recCountAC(ray);
+	if (accelType == AccelType::BVH4)
+		return bvh4->countBoxes(ray);
+	if (accelType == AccelType::BVH8)
+		return bvh8->countBoxes(ray);
+	if (accelType == AccelType::QBVH)
+		return qbvh->countBoxes(ray);
+	return bvh->countBoxes(ray);
 }
 
 void Mesh::getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr, const Vec2f& uv,
 	Vec3f& hitNormal, Vec2f& texCoord) const
 {
-	// Get texture coordinate and normal from barycentric coordinates
-	texCoord = triPtr->t_b * uv.x + triPtr->t_c * uv.y + (1 - uv.x - uv.y) * triPtr->t_a;
-	//hitNormal = (triPtr->b - triPtr->a).crossProduct(triPtr->c - triPtr->a).normalize(); // flat triangle normal
-	hitNormal = ((triPtr->n_b * uv.x + triPtr->n_c * uv.y + triPtr->n_a * (1 - uv.x - uv.y)) / 3).normalize();
+	const Triangle& tri = *triPtr;
+	const float w = 1 - uv.x - uv.y;
+	const Vec3f& a = getVertex(tri, 0);
+	const Vec3f edge1 = getVertex(tri, 1) - a;
+	const Vec3f edge2 = getVertex(tri, 2) - a;
+	const bool hasTexture = tri.t[0] != Triangle::noIndex;
+
+	// Get texture coordinate and normal from barycentric coordinates,
+	// faces without normals are flat
+	texCoord = hasTexture ?
+		texCoords[tri.t[1]] * uv.x + texCoords[tri.t[2]] * uv.y + w * texCoords[tri.t[0]] : Vec2f(0);
+	if (tri.n[0] != Triangle::noIndex)
+		hitNormal = ((normals[tri.n[1]] * uv.x + normals[tri.n[2]] * uv.y + normals[tri.n[0]] * w) / 3).normalize();
+	else
+		hitNormal = edge1.crossProduct(edge2).normalize();
 
 	if (normalMapLoaded) {
 		// If we have normal map we have to use tangent and 
-		// face normal to calculate modified normal
-		const Vec3f& tangent = triPtr->tangent;
-		const Vec3f& bitangent = triPtr->bitangent;
+		// face normal to calculate modified normal.
+		// They are computed for the hit triangle only, not stored
+		Vec3f tangent(0), bitangent(0);
+		if (hasTexture) {
+			const Vec2f deltaUV1 = texCoords[tri.t[1]] - texCoords[tri.t[0]];
+			const Vec2f deltaUV2 = texCoords[tri.t[2]] - texCoords[tri.t[0]];
+
+			float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
+			tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
+			tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
+			tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
+
+			bitangent.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
+			bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
+			bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
+		}
 
 		const Matrix44f normalTransformer =
 		{
@@ -177,31 +627,7 @@ float Mesh::getSpecularValue(const Vec2f& hitTexCoordinates) const
 bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 {
 	// Transformation matrix for rotation
-	const float& x = degToRad(rot.x);
-	Matrix44f mx(
-		1, 0, 0, 0,
-		0, cosf(x), -sinf(x), 0,
-		0, sinf(x), cosf(x), 0,
-		0, 0, 0, 1
-	);
-
-	const float& y = degToRad(rot.y);
-	Matrix44f my(
-		cosf(y), 0, sinf(y), 0,
-		0, 1, 0, 0,
-		-sinf(y), 0, cosf(y), 0,
-		0, 0, 0, 1
-	);
-
-	const float& z = degToRad(rot.z);
-	Matrix44f mz(
-		cosf(z), -sinf(z), 0, 0,
-		sinf(z), cosf(z), 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1
-	);
-
-	const Matrix44f rMatrix = mz * my * mx;
+	const Matrix44f rMatrix = rotationMatrix(rot);
 
 	// Fast unsigned int read
 	auto getUInt = [](const char*& ptr)
@@ -220,13 +646,29 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 		std::cout << "Error, failed to load obj, filename: " << filename << '\n';
 		return false;
 	}
-	ac = std::make_unique<AccelerationStructure>();
+
+	// Key depends on file content, so the file is read once more on cache miss
+	uint64_t cacheKey = 0;
+	if (!options.acCacheDir.empty()) {
+		std::ifstream objFile(filename, std::ios::in | std::ios::binary);
+		std::string objBytes((std::istreambuf_iterator<char>(objFile)), std::istreambuf_iterator<char>());
+		cacheKey = MeshCache::computeKey(objBytes, *this, options);
+		if (MeshCache::load(*this, cacheKey, options)) {
+			if (options::collectStatistics) {
+				stats::meshCount += triangles.size();
+			}
+			return true;
+		}
+	}
+
+	if (accelType == AccelType::Split)
+		ac = std::make_unique<AccelerationStructure>();
 	std::string line;
 	bool normalized = false;
-	std::vector<Vec3f> vertexData;
-	std::vector<Vec3f> normalData;
-	std::vector<Vec2f> textureData;
-	std::vector<const Triangle*> tris;
+	// Buffers are kept by the mesh, faces refer to them by index
+	std::vector<Vec3f>& vertexData = vertices;
+	std::vector<Vec3f>& normalData = normals;
+	std::vector<Vec2f>& textureData = texCoords;
 	Vec3f min = { std::numeric_limits<float>::max() };
 	Vec3f max = { std::numeric_limits<float>::min() };
 
@@ -234,6 +676,40 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 		std::cout << "Mesh: " << filename << '\n';
 	}
 
+	// Triangulate face as a fan, OBJ indices start from one. Empty ni or ti means
+	// the face has no normals or texture coordinates
+	uint32_t faceCount = 0;
+	auto addFace = [&](const std::vector<size_t>& vi, const std::vector<size_t>& ni, const std::vector<size_t>& ti)
+	{
+		// Skipped faces are counted as well, so numbers match the file
+		const uint32_t face = faceCount++;
+		auto valid = [](const std::vector<size_t>& indices, size_t count, size_t required)
+		{
+			if (indices.size() < required)
+				return indices.empty();
+			for (size_t index : indices)
+				if (index == 0 || index > count)
+					return false;
+			return true;
+		};
+		if (vi.size() < 3 || !valid(vi, vertexData.size(), vi.size()) ||
+			!valid(ni, normalData.size(), vi.size()) || !valid(ti, textureData.size(), vi.size())) {
+			LOG_ERROR();
+			return;
+		}
+		for (size_t i = 1; i < vi.size() - 1; i++) {
+			const size_t corners[3] = { 0, i, i + 1 };
+			Triangle tri;
+			for (int k = 0; k < 3; k++) {
+				tri.v[k] = (uint32_t)(vi[corners[k]] - 1);
+				tri.n[k] = ni.empty() ? Triangle::noIndex : (uint32_t)(ni[corners[k]] - 1);
+				tri.t[k] = ti.empty() ? Triangle::noIndex : (uint32_t)(ti[corners[k]] - 1);
+			}
+			triangles.push_back(tri);
+			faces.push_back(face);
+		}
+	};
+
 	do {
 		// Read line and drop commented part
 		std::getline(ifs, line);
@@ -327,7 +803,8 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 				// Set size for AC
 				normSize = rMatrix.multVecMatrix(normSize);
 				normSize = Vec3f{ fabs(normSize.x), fabs(normSize.y), fabs(normSize.z) };
-				ac->setBounds(pos - normSize / 2, pos + normSize / 2);
+				if (ac)
+					ac->setBounds(pos - normSize / 2, pos + normSize / 2);
 			}
 
 			// Add face 
@@ -341,8 +818,7 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 				size_t v = 1;
 				while ((v = getUInt(ptr)) > 0)
 					vi.push_back(v);
-				for (size_t i = 1; i < vi.size() - 1; i++)
-					tris.push_back(new Triangle(vertexData.at(vi.at(0) - 1), vertexData.at(vi.at(i) - 1), vertexData.at(vi.at(i + 1) - 1)));
+				addFace(vi, {}, {});
 			}
 			else if (slashCount % 2 == 0) {
 				std::vector<size_t> vi, ti, ni;
@@ -354,24 +830,13 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 					if (t > 0) ti.push_back(t);
 					if (n > 0) ni.push_back(n);
 				}
-				if (ni.size() == 0) {
-					for (size_t i = 1; i < vi.size() - 1; i++)
-						tris.push_back(new Triangle(
-							vertexData.at(vi.at(0) - 1), vertexData.at(vi.at(i) - 1), vertexData.at(vi.at(i + 1) - 1)));
-				}
-				else if (ti.size() == 0) {
-					for (size_t i = 1; i < vi.size() - 1; i++)
-						tris.push_back(new Triangle(
-							vertexData.at(vi.at(0) - 1), vertexData.at(vi.at(i) - 1), vertexData.at(vi.at(i + 1) - 1),
-							normalData.at(ni.at(0) - 1), normalData.at(ni.at(i) - 1), normalData.at(ni.at(i + 1) - 1)));
-				}
-				else {
-					for (size_t i = 1; i < vi.size() - 1; i++)
-						tris.push_back(new Triangle(
-							vertexData.at(vi.at(0) - 1), vertexData.at(vi.at(i) - 1), vertexData.at(vi.at(i + 1) - 1),
-							normalData.at(ni.at(0) - 1), normalData.at(ni.at(i) - 1), normalData.at(ni.at(i + 1) - 1),
-							textureData.at(ti.at(0) - 1), textureData.at(ti.at(i) - 1), textureData.at(ti.at(i + 1) - 1)));
-				}
+				// Texture coordinates are used only together with normals
+				if (ni.size() == 0)
+					addFace(vi, {}, {});
+				else if (ti.size() == 0)
+					addFace(vi, ni, {});
+				else
+					addFace(vi, ni, ti);
 			}
 			else {
 				std::cout << "Unhandled slash count: " << slashCount << '\n';
@@ -380,19 +845,218 @@ bool Mesh::loadOBJ(const std::string& filename, const Options& options)
 	} while (ifs.good());
 	ifs.close();
 
-	// Move tris pointers to mesh
-	allTris.reserve(tris.size());
-	for (const Triangle* tri : tris)
-		allTris.push_back(tri);
+	for (const Triangle& tri : triangles)
+		for (int k = 0; k < 3; k++)
+			bounds.extend(getVertex(tri, k));
 
 	// Setup AC
-	ac->setup(tris, 1, options);
+	if (accelType == AccelType::Split) {
+		std::vector<uint32_t> tris(triangles.size());
+		for (size_t i = 0; i < tris.size(); i++)
+			tris[i] = (uint32_t)i;
+		ac->setup(*this, tris, 1, options);
+	}
+	else
+		buildBVH(options);
+	if (!options.acCacheDir.empty())
+		MeshCache::save(*this, cacheKey, options);
 	if (options::collectStatistics) {
-		stats::meshCount += allTris.size();
+		stats::meshCount += triangles.size();
 	}
 	return true;
 }
 
+void Mesh::buildBVH(const Options& options)
+{
+	Timer t("BVH build");
+	// Calling thread works too, so it is one less worker
+	ThreadPool& pool = ThreadPool::shared(std::max(0, options.nWorkers - 1));
+
+	std::vector<BVHPrimitive> prims(triangles.size());
+	pool.parallelFor(0, triangles.size(), BVH::parallelThreshold, [&](size_t, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				BVHPrimitive& prim = prims[i];
+				for (int k = 0; k < 3; k++)
+					prim.bounds.extend(getVertex(triangles[i], k));
+				prim.centroid = prim.bounds.centroid();
+				prim.index = (uint32_t)i;
+			}
+		});
+	auto tree = std::make_unique<BVH>();
+	tree->build(prims, &pool, options.bvhQuality);
+	setBVH(std::move(tree));
+
+	if (options::collectStatistics) {
+		if (bvh4)
+			stats::acCount += (int)bvh4->nodes.size();
+		else if (bvh8)
+			stats::acCount += (int)bvh8->nodes.size();
+		else if (qbvh)
+			stats::acCount += (int)qbvh->nodes.size();
+		else
+			stats::acCount += (int)bvh->nodes.size();
+		stats::triCopiesCount += triangles.size();
+	}
+}
+
+void Mesh::setBVH(std::unique_ptr<BVH> tree)
+{
+	// Sort triangles in leaf order, then tree refers to them by their position.
+	// Their faces go along, so they still tell where triangles came from
+	std::vector<Triangle> sortedTris(triangles.size());
+	std::vector<uint32_t> sortedFaces(faces.size());
+	for (size_t i = 0; i < tree->primIndices.size(); i++) {
+		sortedTris[i] = triangles[tree->primIndices[i]];
+		sortedFaces[i] = faces[tree->primIndices[i]];
+		tree->primIndices[i] = (uint32_t)i;
+	}
+	triangles = std::move(sortedTris);
+	faces = std::move(sortedFaces);
+	assignTriangleData();
+
+	// Wide and compressed trees are collapsed from the binary one, which is not needed afterwards
+	if (accelType == AccelType::BVH4) {
+		bvh4 = std::make_unique<WideBVH<4>>();
+		bvh4->collapse(*tree);
+		builtCost = bvh4->sahCost();
+	}
+	else if (accelType == AccelType::BVH8) {
+		bvh8 = std::make_unique<WideBVH<8>>();
+		bvh8->collapse(*tree);
+		builtCost = bvh8->sahCost();
+	}
+	else if (accelType == AccelType::QBVH) {
+		qbvh = std::make_unique<QuantizedBVH>();
+		qbvh->compress(*tree);
+		builtCost = qbvh->sahCost();
+	}
+	else {
+		bvh = std::move(tree);
+		builtCost = bvh->sahCost();
+	}
+}
+
+void Mesh::moveTo(const Vec3f& a_pos, const Vec3f& a_rot, const Options& options)
+{
+	// Undo old placement, then apply the new one
+	const Matrix44f oldInverse(
+		1, 0, 0, 0,
+		0, 1, 0, 0,
+		0, 0, 1, 0,
+		-pos.x, -pos.y, -pos.z, 1
+	);
+	const Matrix44f newTranslation(
+		1, 0, 0, 0,
+		0, 1, 0, 0,
+		0, 0, 1, 0,
+		a_pos.x, a_pos.y, a_pos.z, 1
+	);
+	// Inverse of rotation is its transpose
+	const Matrix44f rMatrix = rotationMatrix(rot).transposed() * rotationMatrix(a_rot);
+	const Matrix44f pMatrix = oldInverse * rMatrix * newTranslation;
+
+	// Shared vertices and normals are moved once, triangles only refer to them
+	for (Vec3f& v : vertices)
+		v = pMatrix.multVecMatrix(v);
+	for (Vec3f& n : normals)
+		n = rMatrix.multDirMatrix(n);
+	pos = a_pos;
+	rot = a_rot;
+	refit(options);
+}
+
+void Mesh::refit(const Options& options)
+{
+	Timer t("BVH refit");
+	bounds = BBox();
+	for (const Triangle& tri : triangles)
+		for (int k = 0; k < 3; k++)
+			bounds.extend(getVertex(tri, k));
+
+	// Split structure copies triangles by position, it can only be built again
+	if (accelType == AccelType::Split) {
+		ac = std::make_unique<AccelerationStructure>();
+		ac->setBounds(bounds[0], bounds[1]);
+		std::vector<uint32_t> tris(triangles.size());
+		for (size_t i = 0; i < tris.size(); i++)
+			tris[i] = (uint32_t)i;
+		ac->setup(*this, tris, 1, options);
+		return;
+	}
+
+	// Rebuilt tree has positions from the time rebuild started, so it is refitted too.
+	// It sorts triangles in its own order, so it is taken before anything is indexed
+	bool rebuilt = false;
+	if (rebuiltBVH.valid() && rebuiltBVH.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		setBVH(rebuiltBVH.get());
+		rebuilt = true;
+	}
+
+	ThreadPool& pool = ThreadPool::shared(std::max(0, options.nWorkers - 1));
+	std::vector<BBox> triBounds(triangles.size());
+	pool.parallelFor(0, triangles.size(), BVH::parallelThreshold, [&](size_t, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				const Vec3f& a = getVertex(triangles[i], 0);
+				const Vec3f& b = getVertex(triangles[i], 1);
+				const Vec3f& c = getVertex(triangles[i], 2);
+				triBounds[i] = BBox();
+				triBounds[i].extend(a);
+				triBounds[i].extend(b);
+				triBounds[i].extend(c);
+				if (triangleTest == TriangleTest::Affine)
+					triTransforms.set(i, a, b, c);
+				else if (triangleTest == TriangleTest::MollerTrumbore)
+					triEdges.set(i, a, b, c);
+			}
+		});
+
+	float cost;
+	if (accelType == AccelType::BVH4) {
+		bvh4->refit(triBounds);
+		cost = bvh4->sahCost();
+	}
+	else if (accelType == AccelType::BVH8) {
+		bvh8->refit(triBounds);
+		cost = bvh8->sahCost();
+	}
+	else if (accelType == AccelType::QBVH) {
+		qbvh->refit(triBounds);
+		cost = qbvh->sahCost();
+	}
+	else {
+		bvh->refit(triBounds);
+		cost = bvh->sahCost();
+	}
+	if (rebuilt)
+		builtCost = cost;
+
+	// Build from scratch without blocking the caller, current tree is used meanwhile
+	if (options.rebuildCostRatio > 0.0f && cost > builtCost * options.rebuildCostRatio && !rebuiltBVH.valid()) {
+		rebuiltBVH = std::async(std::launch::async, [triBounds = std::move(triBounds), quality = options.bvhQuality]()
+			{
+				std::vector<BVHPrimitive> prims(triBounds.size());
+				for (size_t i = 0; i < prims.size(); i++) {
+					prims[i].bounds = triBounds[i];
+					prims[i].centroid = triBounds[i].centroid();
+					prims[i].index = (uint32_t)i;
+				}
+				auto tree = std::make_unique<BVH>();
+				tree->build(prims, nullptr, quality);
+				return tree;
+			});
+	}
+}
+
+void Mesh::assignTriangleData()
+{
+	if (triangleTest == TriangleTest::Affine)
+		triTransforms.assign(triangles, vertices);
+	else if (triangleTest == TriangleTest::MollerTrumbore)
+		triEdges.assign(triangles, vertices);
+}
+
 bool Mesh::loadDiffuseMap(const std::string& filename)
 {
 	if (!options::useTextures)
@@ -458,6 +1122,121 @@ bool Mesh::loadSpecularMap(const std::string& filename)
 }
 
 
+Instance::Instance()
+{
+	objectType = ObjectType::Instance;
+}
+
+bool Instance::intersectObject(const Ray& ray, float& t0, Vec2f& uv) const
+{
+	std::cout << "Object intersect called with instance\n";
+	std::exit(-1);
+}
+
+Ray Instance::toObject(const Ray& ray) const
+{
+	// Direction is not normalized, so distance along the ray is the same in both spaces
+	return Ray(worldToObject.multVecMatrix(ray.orig), worldToObject.multDirMatrix(ray.dir), ray.rayType);
+}
+
+bool Instance::intersectInstance(const Ray& ray, float& t0, const Triangle*& triPtr,
+	Vec2f& uv) const
+{
+	return mesh->intersectMesh(toObject(ray), t0, triPtr, uv);
+}
+
+bool Instance::occludedInstance(const Ray& ray, float maxT, const Triangle*& triPtr) const
+{
+	// Direction is not normalized in the mesh space, so distances stay the same
+	return mesh->occludedMesh(toObject(ray), maxT, triPtr);
+}
+
+bool Instance::occludedTriangle(const Ray& ray, uint32_t index, float maxT) const
+{
+	return mesh->occludedTriangle(toObject(ray), index, maxT);
+}
+
+uint64_t Instance::intersectInstancePacket(RayPacket& packet, uint64_t mask, const Triangle* triPtrs[],
+	Vec2f uvs[]) const
+{
+	// Affine transformation keeps the packet coherent if it was
+	RayPacket objectPacket;
+	for (int r = 0; r < packet.size; r++)
+		objectPacket.add(toObject(packet.rays[r]), packet.tMax[r]);
+	objectPacket.finish();
+	const uint64_t hitMask = mesh->intersectMeshPacket(objectPacket, mask, triPtrs, uvs);
+	for (int r = 0; r < packet.size; r++)
+		if (hitMask >> r & 1)
+			packet.tMax[r] = objectPacket.tMax[r];
+	return hitMask;
+}
+
+void Instance::getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr, const Vec2f& uv,
+	Vec3f& hitNormal, Vec2f& texCoord) const
+{
+	mesh->getSurfaceData(worldToObject.multVecMatrix(hitPoint), triPtr, uv, hitNormal, texCoord);
+	hitNormal = normalToWorld.multDirMatrix(hitNormal).normalize();
+}
+
+bool Instance::getBounds(BBox& bounds) const
+{
+	BBox meshBounds;
+	if (!mesh->getBounds(meshBounds))
+		return false;
+	// Box around transformed corners of mesh box
+	bounds = BBox();
+	for (int i = 0; i < 8; i++) {
+		Vec3f corner(meshBounds[i & 1].x, meshBounds[(i >> 1) & 1].y, meshBounds[(i >> 2) & 1].z);
+		bounds.extend(objectToWorld.multVecMatrix(corner));
+	}
+	return true;
+}
+
+int Instance::countAC(const Ray& ray) const
+{
+	return mesh->countAC(toObject(ray));
+}
+
+Vec3f Instance::getDiffuseColor(const Vec2f& hitTexCoordinates) const
+{
+	if (mesh->diffuseMapLoaded)
+		return mesh->getDiffuseColor(hitTexCoordinates);
+	return color;
+}
+
+float Instance::getSpecularValue(const Vec2f& hitTexCoordinates) const
+{
+	if (mesh->specularMapLoaded)
+		return mesh->getSpecularValue(hitTexCoordinates);
+	return specular;
+}
+
+void Instance::setMesh(std::shared_ptr<const Mesh> a_mesh)
+{
+	mesh = std::move(a_mesh);
+	updateTransform();
+}
+
+void Instance::updateTransform()
+{
+	const Matrix44f sMatrix(
+		scale, 0, 0, 0,
+		0, scale, 0, 0,
+		0, 0, scale, 0,
+		0, 0, 0, 1
+	);
+	const Matrix44f tMatrix(
+		1, 0, 0, 0,
+		0, 1, 0, 0,
+		0, 0, 1, 0,
+		pos.x, pos.y, pos.z, 1
+	);
+	objectToWorld = sMatrix * rotationMatrix(rot) * tMatrix;
+	worldToObject = objectToWorld.inverse();
+	normalToWorld = worldToObject.transposed();
+}
+
+
 AccelerationStructure::AccelerationStructure()
 {
 	if (options::collectStatistics) {
@@ -467,7 +1246,7 @@ AccelerationStructure::AccelerationStructure()
 
 AccelerationStructure::~AccelerationStructure() {}
 
-void AccelerationStructure::setup(std::vector<const Triangle*>& a_tris, int a_depth, const Options& options)
+void AccelerationStructure::setup(const Mesh& mesh, std::vector<uint32_t>& a_tris, int a_depth, const Options& options)
 {
 	if (!options::useAC) {
 		tris = a_tris;
@@ -488,11 +1267,11 @@ void AccelerationStructure::setup(std::vector<const Triangle*>& a_tris, int a_de
 	if (dim.x > dim.y && dim.x > dim.z) orientation = 0;
 	else if (dim.y > dim.z) orientation = 1;
 	else orientation = 2;
-	std::vector<const Triangle*> trisLeft;
-	std::vector<const Triangle*> trisRight;
+	std::vector<uint32_t> trisLeft;
+	std::vector<uint32_t> trisRight;
 
 	// Get optimal split distance
-	float splitDist = getOptimalSplit(a_tris, orientation, bounds, trisLeft, trisRight);
+	float splitDist = getOptimalSplit(mesh, a_tris, orientation, bounds, trisLeft, trisRight);
 
 	// Stop split if too many triangles will be duplicated
 	if ((trisLeft.size() == 0 || trisRight.size() == 0) || (trisLeft.size() + trisRight.size() >= a_tris.size() * 1.5)) {
@@ -521,8 +1300,8 @@ void AccelerationStructure::setup(std::vector<const Triangle*>& a_tris, int a_de
 	}
 
 	// Setup ancestors
-	right->setup(trisRight, a_depth + 1, options);
-	left->setup(trisLeft, a_depth + 1, options);
+	right->setup(mesh, trisRight, a_depth + 1, options);
+	left->setup(mesh, trisLeft, a_depth + 1, options);
 }
 
 void AccelerationStructure::setBounds(const Vec3f& a, const Vec3f& b)
@@ -584,7 +1363,7 @@ int AccelerationStructure::recCountAC(const Ray& ray)
 	}
 }
 
-bool AccelerationStructure::intersectAccelStruct(const Ray& ray, float& t0,
+bool AccelerationStructure::intersectAccelStruct(const Mesh& mesh, const Ray& ray, float& t0,
 	const Triangle*& triPtr, Vec2f& uv) const
 {
 	if (!intersectBox(ray))
@@ -601,13 +1380,13 @@ bool AccelerationStructure::intersectAccelStruct(const Ray& ray, float& t0,
 	if (left) {
 		if (!right) 
 			LOG_ERROR();
-		if (left->intersectAccelStruct(ray, tempT, tempTriPtr, tempUV) && tempT < t0) {
+		if (left->intersectAccelStruct(mesh, ray, tempT, tempTriPtr, tempUV) && tempT < t0) {
 			inter = true;
 			t0 = tempT;
 			uv = tempUV;
 			triPtr = tempTriPtr;
 		}
-		if (right->intersectAccelStruct(ray, tempT, tempTriPtr, tempUV) && tempT < t0) {
+		if (right->intersectAccelStruct(mesh, ray, tempT, tempTriPtr, tempUV) && tempT < t0) {
 			inter = true;
 			t0 = tempT;
 			uv = tempUV;
@@ -619,150 +1398,121 @@ bool AccelerationStructure::intersectAccelStruct(const Ray& ray, float& t0,
 	}
 
 	// If don't have ancestors, check all triangles
-	for (const Triangle* tri : tris) {
-		if (Triangle::rayTriangleIntersect(ray, tri, tempT, tempUV) && tempT < t0) {
+	for (uint32_t index : tris) {
+		const Triangle& tri = mesh.triangles[index];
+		const Vec3f& a = mesh.getVertex(tri, 0);
+		if (Triangle::rayTriangleIntersect(ray, a, mesh.getVertex(tri, 1) - a, mesh.getVertex(tri, 2) - a, tempT, tempUV)
+			&& tempT < t0) {
 			inter = true;
 			t0 = tempT;
 			uv = tempUV;
-			triPtr = tri;
+			triPtr = &tri;
 		}
 	}
 	return inter;
 }
 
-float AccelerationStructure::calculateSAH(const int orientation, const std::vector<const Triangle*>& tris,
-	const Vec3f bounds[2], const float boundary)
+bool AccelerationStructure::occludedAccelStruct(const Mesh& mesh, const Ray& ray, float maxT,
+	const Triangle*& triPtr) const
 {
-	// Calculate Surface Area Heuristic
-	float sah = 0.0f;
-	int triLeft = 0;
-	int triRight = 0;
-	if (orientation == 0) {
-		if (bounds[0].x > boundary && bounds[1].x < boundary) 
+	if (!intersectBox(ray))
+		return false;
+
+	// Right subtree is not visited if the left one is occluded
+	if (left) {
+		if (!right)
 			LOG_ERROR();
-		for (const Triangle* tri : tris) {
-			if (tri->a.x <= boundary || tri->b.x <= boundary || tri->c.x <= boundary)
-				triLeft++;
-			if (tri->a.x >= boundary || tri->b.x >= boundary || tri->c.x >= boundary)
-				triRight++;
-		}
-		sah = triLeft * (boundary - bounds[0].x) + triRight * (bounds[1].x - boundary);
+		return left->occludedAccelStruct(mesh, ray, maxT, triPtr) || right->occludedAccelStruct(mesh, ray, maxT, triPtr);
 	}
-	else if (orientation == 1) {
-		if (bounds[0].y > boundary && bounds[1].y < boundary) 
-			LOG_ERROR();
-		for (const Triangle* tri : tris) {
-			if (tri->a.y <= boundary || tri->b.y <= boundary || tri->c.y <= boundary)
-				triLeft++;
-			if (tri->a.y >= boundary || tri->b.y >= boundary || tri->c.y >= boundary)
-				triRight++;
+
+	float t;
+	Vec2f uv;
+	for (uint32_t index : tris) {
+		const Triangle& tri = mesh.triangles[index];
+		const Vec3f& a = mesh.getVertex(tri, 0);
+		if (Triangle::rayTriangleIntersect(ray, a, mesh.getVertex(tri, 1) - a, mesh.getVertex(tri, 2) - a, t, uv)
+			&& t < maxT) {
+			triPtr = &tri;
+			return true;
 		}
-		sah = triLeft * (boundary - bounds[0].y) + triRight * (bounds[1].y - boundary);
 	}
-	else if (orientation == 2) {
-		if (bounds[0].z > boundary && bounds[1].z < boundary) 
-			LOG_ERROR();
-		for (const Triangle* tri : tris) {
-			if (tri->a.z <= boundary || tri->b.z <= boundary || tri->c.z <= boundary)
-				triLeft++;
-			if (tri->a.z >= boundary || tri->b.z >= boundary || tri->c.z >= boundary)
-				triRight++;
-		}
-		sah = triLeft * (boundary - bounds[0].z) + triRight * (bounds[1].z - boundary);
+	return false;
+}
+
+float AccelerationStructure::minCoord(const Mesh& mesh, uint32_t tri, int axis)
+{
+	const Triangle& t = mesh.triangles[tri];
+	return std::min(mesh.getVertex(t, 0)[axis], std::min(mesh.getVertex(t, 1)[axis], mesh.getVertex(t, 2)[axis]));
+}
+
+float AccelerationStructure::maxCoord(const Mesh& mesh, uint32_t tri, int axis)
+{
+	const Triangle& t = mesh.triangles[tri];
+	return std::max(mesh.getVertex(t, 0)[axis], std::max(mesh.getVertex(t, 1)[axis], mesh.getVertex(t, 2)[axis]));
+}
+
+float AccelerationStructure::calculateSAH(const Mesh& mesh, const int orientation, const std::vector<uint32_t>& tris,
+	const Vec3f bounds[2], const float boundary)
+{
+	// Calculate Surface Area Heuristic. Triangle is on the side
+	// if any of its corners is there
+	if (bounds[0][orientation] > boundary && bounds[1][orientation] < boundary) 
+		LOG_ERROR();
+	int triLeft = 0;
+	int triRight = 0;
+	for (uint32_t tri : tris) {
+		if (minCoord(mesh, tri, orientation) <= boundary)
+			triLeft++;
+		if (maxCoord(mesh, tri, orientation) >= boundary)
+			triRight++;
 	}
-	return sah;
+	return triLeft * (boundary - bounds[0][orientation]) + triRight * (bounds[1][orientation] - boundary);
 }
 
-float AccelerationStructure::binarySearchSAH(const int orientation, const std::vector<const Triangle*>& tris,
+float AccelerationStructure::binarySearchSAH(const Mesh& mesh, const int orientation, const std::vector<uint32_t>& tris,
 	const Vec3f bounds[2], const float left, const float right)
 {
 	// If interval is lover then 0.1 - stop 
 	float mid = right - (right - left) / 2;
 	if (right - left < 0.1f) return mid;
-	if (calculateSAH(orientation, tris, bounds, mid - 0.05f)
-		< calculateSAH(orientation, tris, bounds, mid + 0.05f)) {
-		return binarySearchSAH(orientation, tris, bounds, left, mid);
+	if (calculateSAH(mesh, orientation, tris, bounds, mid - 0.05f)
+		< calculateSAH(mesh, orientation, tris, bounds, mid + 0.05f)) {
+		return binarySearchSAH(mesh, orientation, tris, bounds, left, mid);
 	}
 	else {
-		return binarySearchSAH(orientation, tris, bounds, mid, right);
+		return binarySearchSAH(mesh, orientation, tris, bounds, mid, right);
 	}
 }
 
-float AccelerationStructure::getOptimalSplit(const std::vector<const Triangle*>& tris, const int orientation,
-	const Vec3f bounds[2], std::vector<const Triangle*>& trisLeft, std::vector<const Triangle*>& trisRight)
+float AccelerationStructure::getOptimalSplit(const Mesh& mesh, const std::vector<uint32_t>& tris, const int orientation,
+	const Vec3f bounds[2], std::vector<uint32_t>& trisLeft, std::vector<uint32_t>& trisRight)
 {
 	float splitDist = 0.0f;
 #if 0
 	// Divide by equal parts
-	if (orientation == 0) {
-		splitDist = (bounds[0] + (bounds[1] - bounds[0]) / 2).x;
-	}
-	else if (orientation == 1) {
-		splitDist = (bounds[0] + (bounds[1] - bounds[0]) / 2).y;
-	}
-	else if (orientation == 2) {
-		splitDist = (bounds[0] + (bounds[1] - bounds[0]) / 2).z;
-	}
+	splitDist = (bounds[0] + (bounds[1] - bounds[0]) / 2)[orientation];
 #elif 1
 	// SAH
-	if (orientation == 0) {
-		splitDist = binarySearchSAH(orientation, tris, bounds, bounds[0].x, bounds[1].x);
-	}
-	else if (orientation == 1) {
-		splitDist = binarySearchSAH(orientation, tris, bounds, bounds[0].y, bounds[1].y);
-	}
-	else if (orientation == 2) {
-		splitDist = binarySearchSAH(orientation, tris, bounds, bounds[0].z, bounds[1].z);
-	}
+	splitDist = binarySearchSAH(mesh, orientation, tris, bounds, bounds[0][orientation], bounds[1][orientation]);
 #else
 	// Divide by average
-	if (orientation == 0) {
-		for (const Triangle* const tri : tris)
-			splitDist += tri->a.x + tri->b.x + tri->c.x;
-		splitDist /= 3.0f * tris.size();
-	}
-	else if (orientation == 1) {
-		for (const Triangle* tri : tris)
-			splitDist += tri->a.y + tri->b.y + tri->c.y;
-		splitDist /= 3.0f * tris.size();
-	}
-	else if (orientation == 2) {
-		for (const Triangle* tri : tris)
-			splitDist += tri->a.z + tri->b.z + tri->c.z;
-		splitDist /= 3.0f * tris.size();
-	}
+	for (uint32_t tri : tris)
+		for (int k = 0; k < 3; k++)
+			splitDist += mesh.getVertex(mesh.triangles[tri], k)[orientation];
+	splitDist /= 3.0f * tris.size();
 #endif
 
 	// Split between left and right (some tris will be duplicated)
-	if (orientation == 0) {
-		for (const Triangle* const tri : tris) {
-			if (tri->a.x <= splitDist || tri->b.x <= splitDist || tri->c.x <= splitDist)
-				trisLeft.push_back(tri);
-			if (tri->a.x >= splitDist || tri->b.x >= splitDist || tri->c.x >= splitDist)
-				trisRight.push_back(tri);
-		}
-	}
-	else if (orientation == 1) {
-		for (const Triangle* tri : tris) {
-			if (tri->a.y <= splitDist || tri->b.y <= splitDist || tri->c.y <= splitDist)
-				trisLeft.push_back(tri);
-			if (tri->a.y >= splitDist || tri->b.y >= splitDist || tri->c.y >= splitDist)
-				trisRight.push_back(tri);
-		}
-	}
-	else if (orientation == 2) {
-		for (const Triangle* tri : tris) {
-			if (tri->a.z <= splitDist || tri->b.z <= splitDist || tri->c.z <= splitDist)
-				trisLeft.push_back(tri);
-			if (tri->a.z >= splitDist || tri->b.z >= splitDist || tri->c.z >= splitDist)
-				trisRight.push_back(tri);
-		}
+	for (uint32_t tri : tris) {
+		if (minCoord(mesh, tri, orientation) <= splitDist)
+			trisLeft.push_back(tri);
+		if (maxCoord(mesh, tri, orientation) >= splitDist)
+			trisRight.push_back(tri);
 	}
 
 	return splitDist;
 }
 
-
 Sphere::Sphere(const Vec3f& a_center, const float a_r, const Vec3f& a_color,
 	const MaterialType& a_materialType)
 	: Object(a_center, a_color, a_materialType), r(a_r)
@@ -785,6 +1535,12 @@ bool Sphere::intersectObject(const Ray& ray, float& t0, Vec2f& uv) const
 	return true;
 }
 
+bool Sphere::getBounds(BBox& bounds) const
+{
+	bounds = BBox(pos - Vec3f(r), pos + Vec3f(r));
+	return true;
+}
+
 void Sphere::getSurfaceData(const Vec3f& hitPoint, const Triangle* const triPtr, const Vec2f& uv, 
 	Vec3f& hitNormal, Vec2f& tex) const
 {
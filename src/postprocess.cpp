@@ -0,0 +1,263 @@
+// Post-processing of the frame buffer, run on bands of rows of the thread pool with SIMD kernels
+#include "postprocess.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "simd.h"
+#include "util.h"
+
+// Kernels read colors as arrays of floats
+static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f should be three packed floats");
+
+namespace
+{
+	// Rows of one task
+	constexpr size_t bandHeight = 16;
+
+#if defined(RT_USE_SSE)
+	// Four colors from 12 floats a, b, c to vectors of their channels
+	inline void deinterleave(__m128 a, __m128 b, __m128 c, __m128& x, __m128& y, __m128& z)
+	{
+		x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+		y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)),
+			_MM_SHUFFLE(2, 0, 2, 0));
+		z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)),
+			_MM_SHUFFLE(2, 0, 2, 0));
+	}
+
+	// Four RGB colors in 12 floats a, b, c to BGR in the same layout
+	inline void swapRedBlue(__m128& a, __m128& b, __m128& c)
+	{
+		const __m128 a0b1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 0, 0));
+		const __m128 b0a3 = _mm_shuffle_ps(b, a, _MM_SHUFFLE(3, 3, 0, 0));
+		const __m128 c0b3 = _mm_shuffle_ps(c, b, _MM_SHUFFLE(3, 3, 0, 0));
+		const __m128 b2c3 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(3, 3, 2, 2));
+		a = _mm_shuffle_ps(a, a0b1, _MM_SHUFFLE(2, 0, 1, 2));
+		b = _mm_shuffle_ps(b0a3, c0b3, _MM_SHUFFLE(2, 0, 2, 0));
+		c = _mm_shuffle_ps(b2c3, c, _MM_SHUFFLE(1, 2, 2, 0));
+	}
+#endif
+
+	bool hitsDiffer(const SampleHit& a, const SampleHit& b)
+	{
+		return a.object != b.object || (a.object && a.normal.dotProduct(b.normal) < edgeNormalCos);
+	}
+
+	// Mark pixels of region, loadRow(y, x0, x1, lum) writes luminance of pixels [x0, x1) of row y to lum
+	template<typename LoadRow>
+	void markEdges(LoadRow&& loadRow, const SampleHit* hits, size_t w, size_t h, const tileInfo& region, bool* edges)
+	{
+		const size_t n = region.x1 - region.x0;
+
+		// Luminance of rows y - 1, y and y + 1 of the region and one pixel around it.
+		// Pixels outside of the image are copies of the border ones, so they never differ
+		const size_t stride = n + 2;
+		std::vector<float> lum(3 * stride);
+		float* rows[3] = { &lum[0], &lum[stride], &lum[2 * stride] };
+		auto loadPadded = [&](size_t y, float* row)
+		{
+			const size_t begin = region.x0 > 0 ? region.x0 - 1 : 0;
+			loadRow(y, begin, std::min(w, region.x1 + 1), row + 1 - (region.x0 - begin));
+			if (region.x0 == 0)
+				row[0] = row[1];
+			if (region.x1 == w)
+				row[n + 1] = row[n];
+		};
+		loadPadded(region.y0 > 0 ? region.y0 - 1 : 0, rows[0]);
+		loadPadded(region.y0, rows[1]);
+
+		// Every pair of neighbouring hits is compared once, pairs of the row above the region again.
+		// Contrast of the row is kept in marks when hits are combined with it, so the row is stored once
+		std::vector<char> pairFlags(3 * n, 0);
+		char* above = &pairFlags[0];
+		char* below = &pairFlags[n];
+		char* marks = &pairFlags[2 * n];
+		if (hits && region.y0 > 0) {
+			const SampleHit* row = hits + (region.y0 - 1) * w + region.x0;
+			for (size_t x = 0; x < n; x++)
+				above[x] = hitsDiffer(row[x], row[x + w]);
+		}
+		// Pairs with the next pixel are compared up to there, the pair over the right side of the image doesn't exist
+		const size_t pairEnd = region.x1 < w ? n : n - 1;
+
+		for (size_t y = region.y0; y < region.y1; y++) {
+			loadPadded(std::min(h - 1, y + 1), rows[2]);
+			const float* up = rows[0] + 1;
+			const float* mid = rows[1] + 1;
+			const float* down = rows[2] + 1;
+			bool* out = edges + y * w + region.x0;
+			char* contrastMarks = hits ? marks : reinterpret_cast<char*>(out);
+			size_t x = 0;
+#if defined(RT_USE_SSE)
+			const __m128 contrast = _mm_set1_ps(edgeContrast), signMask = _mm_set1_ps(-0.0f);
+			for (; x + 4 <= n; x += 4) {
+				const __m128 center = _mm_loadu_ps(mid + x);
+				auto differ = [&](const float* p)
+				{
+					return _mm_cmpgt_ps(_mm_andnot_ps(signMask, _mm_sub_ps(center, _mm_loadu_ps(p))), contrast);
+				};
+				const int mask = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(differ(mid + x - 1), differ(mid + x + 1)),
+					_mm_or_ps(differ(up + x), differ(down + x))));
+				for (int i = 0; i < 4; i++)
+					contrastMarks[x + i] = mask >> i & 1;
+			}
+#endif
+			for (; x < n; x++) {
+				const float center = mid[x];
+				contrastMarks[x] = std::fabs(center - mid[x - 1]) > edgeContrast || std::fabs(center - mid[x + 1]) > edgeContrast
+					|| std::fabs(center - up[x]) > edgeContrast || std::fabs(center - down[x]) > edgeContrast;
+			}
+			std::rotate(rows, rows + 1, rows + 3);
+
+			if (!hits)
+				continue;
+			const SampleHit* row = hits + y * w + region.x0;
+			const bool hasNext = y + 1 < h;
+			const SampleHit* next = hasNext ? row + w : row;
+			bool left = region.x0 > 0 && hitsDiffer(row[-1], row[0]);
+			for (x = 0; x < n; x++) {
+				const bool right = x < pairEnd && hitsDiffer(row[x], row[x + 1]);
+				below[x] = hasNext & hitsDiffer(row[x], next[x]);
+				out[x] = marks[x] | left | right | above[x] | below[x];
+				left = right;
+			}
+			std::swap(above, below);
+		}
+	}
+
+	// Clamp count colors and convert them to BGR bytes
+	void convertRow(const Vec3f* colors, size_t count, char* out)
+	{
+		size_t x = 0;
+#if defined(RT_USE_SSE)
+		// Same clamp and truncation as the scalar loop, NaN turns to 255 in both.
+		// Channel of 1 is 255, not an overflow of signed char
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f);
+		auto toInt = [&](__m128 v) { return _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(v, one), zero), scale)); };
+		alignas(16) char bytes[16];
+		for (; x + 4 <= count; x += 4) {
+			const float* p = &colors[x].x;
+			__m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+			swapRedBlue(a, b, c);
+			const __m128i words = _mm_packs_epi32(toInt(a), toInt(b));
+			_mm_store_si128((__m128i*)bytes, _mm_packus_epi16(words, _mm_packs_epi32(toInt(c), _mm_setzero_si128())));
+			memcpy(out + x * 3, bytes, 12);
+		}
+#endif
+		for (; x < count; x++)
+			for (int k = 2; k >= 0; k--)
+				out[x * 3 + 2 - k] = static_cast<char>(static_cast<int>(clamp(0.0f, 1.0f, colors[x][k]) * 255));
+	}
+}
+
+void luminanceRow(const Vec3f* colors, size_t count, float* lum)
+{
+	size_t i = 0;
+#if defined(RT_USE_SSE)
+	const __m128 red = _mm_set1_ps(0.2126f), green = _mm_set1_ps(0.7152f), blue = _mm_set1_ps(0.0722f);
+	for (; i + 4 <= count; i += 4) {
+		const float* p = &colors[i].x;
+		__m128 x, y, z;
+		deinterleave(_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _mm_loadu_ps(p + 8), x, y, z);
+		_mm_storeu_ps(lum + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, red), _mm_mul_ps(y, green)), _mm_mul_ps(z, blue)));
+	}
+#endif
+	for (; i < count; i++)
+		lum[i] = luminance(colors[i]);
+}
+
+void detectEdges(const Vec3f* frameBuffer, const SampleHit* hits, size_t width, size_t height, bool* edges,
+	ThreadPool& pool)
+{
+	pool.parallelFor(0, height, bandHeight, [&](size_t, size_t y0, size_t y1)
+		{
+			auto loadRow = [frameBuffer, width](size_t y, size_t x0, size_t x1, float* lum)
+			{
+				luminanceRow(frameBuffer + y * width + x0, x1 - x0, lum);
+			};
+			markEdges(loadRow, hits, width, height, tileInfo{ 0, width, y0, y1 }, edges);
+		});
+}
+
+void detectEdges(const float* lum, const SampleHit* hits, size_t width, size_t height, const tileInfo& region,
+	bool* edges)
+{
+	auto loadRow = [lum, width](size_t y, size_t x0, size_t x1, float* row)
+	{
+		std::copy(lum + y * width + x0, lum + y * width + x1, row);
+	};
+	markEdges(loadRow, hits, width, height, region, edges);
+}
+
+ImageStream::ImageStream(const std::string& a_path, size_t a_width, size_t a_height)
+	: path{ a_path }, file(a_path, std::ios::out | std::ios::binary), width{ a_width }, height{ a_height }
+{
+	rowSize = (width * 3 + 3) / 4 * 4;
+	const size_t arraySize = height * rowSize;
+	const size_t totalSize = headerSize + arraySize;
+	// Padding of rows stays zero
+	data.assign(arraySize, 0);
+	missingPixels.reset(new std::atomic<size_t>[height]);
+	for (size_t y = 0; y < height; y++)
+		missingPixels[y] = width;
+
+	char header[headerSize] = { 0 };
+	memcpy(header, "BM", 2);
+	*(size_t*)(header + 0x2) = totalSize;
+	*(size_t*)(header + 0xA) = headerSize;
+	*(size_t*)(header + 0xE) = headerSize - 14;
+	*(size_t*)(header + 0x12) = width;
+	*(size_t*)(header + 0x16) = height;
+	*(header + 0x1A) = 1;
+	*(header + 0x1C) = 24;
+	*(size_t*)(header + 0x22) = arraySize;
+	*(size_t*)(header + 0x26) = 2835;
+	*(size_t*)(header + 0x2A) = 2835;
+	file.write(header, headerSize);
+}
+
+void ImageStream::addRegion(const Vec3f* frameBuffer, const tileInfo& region)
+{
+	const size_t n = region.x1 - region.x0;
+	for (size_t y = region.y0; y < region.y1; y++)
+		convertRow(frameBuffer + y * width + region.x0, n, &data[(height - 1 - y) * rowSize + region.x0 * 3]);
+
+	// Rows finished by this region are written, neighbouring ones at once
+	size_t first = 0, count = 0;
+	auto writeRows = [&]()
+	{
+		if (count == 0)
+			return;
+		std::lock_guard<std::mutex> lock(fileMutex);
+		file.seekp(headerSize + first * rowSize);
+		file.write(&data[first * rowSize], count * rowSize);
+		count = 0;
+	};
+	for (size_t y = region.y1; y-- > region.y0;) {
+		if (missingPixels[y].fetch_sub(n) != n) {
+			writeRows();
+			continue;
+		}
+		if (count == 0)
+			first = height - 1 - y;
+		count++;
+	}
+	writeRows();
+}
+
+void ImageStream::addFrame(const Vec3f* frameBuffer, ThreadPool& pool)
+{
+	pool.parallelFor(0, height, bandHeight, [&](size_t, size_t y0, size_t y1)
+		{
+			addRegion(frameBuffer, tileInfo{ 0, width, y0, y1 });
+		});
+}
+
+bool ImageStream::close()
+{
+	file.close();
+	return !file.fail();
+}
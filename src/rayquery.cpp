@@ -0,0 +1,62 @@
+// Batched ray queries against a loaded scene, for tools that need hits without rendering
+#include "rayquery.h"
+
+#include <algorithm>
+
+RayQuery::RayQuery(const Scene& a_scene, int nThreads)
+	: scene(a_scene), pool(std::max(0, (nThreads > 0 ? nThreads : a_scene.options.nWorkers) - 1))
+{
+	for (size_t i = 0; i < scene.objects.size(); i++)
+		objectIds[scene.objects[i].get()] = (int32_t)i;
+}
+
+template<typename F>
+void RayQuery::trace(const Ray rays[], size_t count, const float tMax[], F&& store)
+{
+	pool.parallelFor(0, count, chunkSize, [&](size_t, size_t begin, size_t end)
+		{
+			RayPacket packet;
+			IntersectInfo intrInfos[RayPacket::maxSize];
+			for (size_t first = begin; first < end; first += RayPacket::maxSize) {
+				packet.clear();
+				for (size_t i = first; i < std::min(end, first + RayPacket::maxSize); i++)
+					packet.add(rays[i], tMax ? tMax[i] : std::numeric_limits<float>::max());
+				Render::tracePacket(packet, scene, intrInfos);
+				for (int r = 0; r < packet.size; r++)
+					store(first + r, intrInfos[r]);
+			}
+		});
+}
+
+void RayQuery::intersect(const Ray rays[], size_t count, RayHit hits[], const float tMax[])
+{
+	trace(rays, count, tMax, [&](size_t i, const IntersectInfo& intrInfo)
+		{
+			RayHit& hit = hits[i];
+			hit = RayHit();
+			if (!intrInfo.hitObject)
+				return;
+			hit.objectId = objectIds.at(intrInfo.hitObject);
+			hit.t = intrInfo.tNear;
+			hit.uv = intrInfo.uv;
+			// Triangle pointer points into the triangles of the mesh, which are sorted by its tree,
+			// so the face is looked up by position
+			const Mesh* mesh = nullptr;
+			if (intrInfo.hitObject->objectType == ObjectType::Mesh)
+				mesh = static_cast<const Mesh*>(intrInfo.hitObject);
+			else if (intrInfo.hitObject->objectType == ObjectType::Instance)
+				mesh = static_cast<const Instance*>(intrInfo.hitObject)->mesh.get();
+			if (mesh && intrInfo.triPtr)
+				hit.triangleId = (int32_t)mesh->faces[intrInfo.triPtr - mesh->triangles.data()];
+		});
+}
+
+void RayQuery::occluded(const Ray rays[], size_t count, bool results[], const float tMax[])
+{
+	// Rays stop at their first hit, so they are traced one by one
+	pool.parallelFor(0, count, chunkSize, [&](size_t, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+				results[i] = Render::occluded(rays[i], scene, tMax ? tMax[i] : std::numeric_limits<float>::max());
+		});
+}
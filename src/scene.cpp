@@ -11,7 +11,78 @@
 #include "timer.h"
 #include "util.h"
 #include "options.h"
+#include "framegraph.h"
+#include "postprocess.h"
 #include "stats.h"
+#include "threadpool.h"
+#include "tilescheduler.h"
+#include "wavefront.h"
+
+namespace
+{
+	// Supersamples of a pixel are added in rounds of that many, convergence is checked after each
+	constexpr int samplesPerRound = 2;
+
+	float radicalInverse(int i, int base)
+	{
+		float result = 0, digit = 1.0f / base;
+		for (; i > 0; i /= base, digit /= base)
+			result += (i % base) * digit;
+		return result;
+	}
+
+	// Position of supersample i in the pixel. First four make a 2x2 grid with the opposite
+	// corners first, so one round already spans the pixel. Later ones follow the Halton sequence
+	Vec2f sampleOffset(int i)
+	{
+		static const float grid[4][2] = { { 0.25f, 0.25f }, { 0.75f, 0.75f }, { 0.25f, 0.75f }, { 0.75f, 0.25f } };
+		if (i < 4)
+			return Vec2f(grid[i][0], grid[i][1]);
+		return Vec2f(radicalInverse(i, 2), radicalInverse(i, 3));
+	}
+
+	// Running sums of the samples of a pixel, the first one is the color of the full resolution pass
+	struct PixelSamples
+	{
+		Vec3f colorSum{ 0 };
+		float lumSum = 0, lumSquares = 0;
+		int count = 0;
+		bool active = false;
+
+		void add(const Vec3f& color)
+		{
+			const float lum = luminance(color);
+			colorSum += color;
+			lumSum += lum;
+			lumSquares += lum * lum;
+			count++;
+		}
+
+		// Supersamples of the next round, none when the pixel has maxSamples of them
+		int nextRound(int maxSamples) const
+		{
+			return std::max(0, std::min(samplesPerRound, maxSamples - (count - 1)));
+		}
+
+		// Standard error of the mean luminance is below threshold
+		bool converged(float threshold) const
+		{
+			if (count < 2)
+				return false;
+			const float mean = lumSum / count;
+			const float variance = std::max(0.0f, lumSquares / count - mean * mean) * count / (count - 1);
+			return variance / count < threshold * threshold;
+		}
+	};
+
+	void countSupersamples(const PixelSamples& samples)
+	{
+		if (options::collectStatistics) {
+			stats::supersampledPixels++;
+			stats::supersamplingRays += samples.count - 1;
+		}
+	}
+}
 
 Camera::Camera(const Vec3f& a_pos, const Vec3f& a_rot)
 	: pos(a_pos), rot(a_rot) {}
@@ -21,31 +92,7 @@ Ray Camera::getRay(const float xPix, const  float yPix)
 	// Build rotation matrix
 	if (!cameraRotated) {
 		cameraRotated = true;
-		const float& x = degToRad(rot.x);
-		Matrix44f mx(
-			1, 0, 0, 0,
-			0, cosf(x), -sinf(x), 0,
-			0, sinf(x), cosf(x), 0,
-			0, 0, 0, 1
-		);
-
-		const float& y = degToRad(rot.y);
-		Matrix44f my(
-			cosf(y), 0, sinf(y), 0,
-			0, 1, 0, 0,
-			-sinf(y), 0, cosf(y), 0,
-			0, 0, 0, 1
-		);
-
-		const float& z = degToRad(rot.z);
-		Matrix44f mz(
-			cosf(z), -sinf(z), 0, 0,
-			sinf(z), cosf(z), 0, 0,
-			0, 0, 1, 0,
-			0, 0, 0, 1
-		);
-
-		rMatrix = mz * my * mx;
+		rMatrix = rotationMatrix(rot);
 	}
 
 	// Rotate camera direction
@@ -56,9 +103,17 @@ Ray Camera::getRay(const float xPix, const  float yPix)
 
 Scene::Scene(const std::string& sceneName)
 {
+	nextGeneration();
 	sceneLoadSuccess = loadScene(sceneName);
 }
 
+void Scene::nextGeneration()
+{
+	// Counter is shared by all scenes, so a scene made at the address of a destroyed one differs from it
+	static std::atomic<uint64_t> counter = 0;
+	generation = ++counter;
+}
+
 bool Scene::loadScene(const std::string& scenePath)
 {
 	if (options::enableOutput) {
@@ -87,6 +142,35 @@ bool Scene::loadScene(const std::string& scenePath)
     Light* light = nullptr;
     Object* object = nullptr;
 
+	// Meshes shared by instances, key is everything that affects loading
+	std::map<std::string, std::shared_ptr<Mesh>> meshLibrary;
+	auto setupInstance = [&](Instance* instance)
+	{
+		if (instance->meshName.empty())
+			LOG_ERROR();
+		std::ostringstream key;
+		key << instance->meshName << '|' << instance->size.x << ',' << instance->size.y << ','
+			<< instance->size.z << '|' << (int)instance->accelType << '|' << (int)instance->triangleTest << '|' << instance->diffuseMapName
+			<< '|' << instance->normalMapName << '|' << instance->specularMapName;
+		std::shared_ptr<Mesh>& mesh = meshLibrary[key.str()];
+		if (!mesh) {
+			mesh = std::make_shared<Mesh>();
+			mesh->pos = 0;
+			mesh->size = instance->size;
+			mesh->accelType = instance->accelType;
+			mesh->triangleTest = instance->triangleTest;
+			if (!mesh->loadOBJ(instance->meshName, options))
+				LOG_ERROR();
+			if (!instance->diffuseMapName.empty())
+				mesh->diffuseMapLoaded = mesh->loadDiffuseMap(instance->diffuseMapName);
+			if (!instance->normalMapName.empty())
+				mesh->normalMapLoaded = mesh->loadNormalMap(instance->normalMapName);
+			if (!instance->specularMapName.empty())
+				mesh->specularMapLoaded = mesh->loadSpecularMap(instance->specularMapName);
+		}
+		instance->setMesh(mesh);
+	};
+
     while (ifs.good()) {
         std::getline(ifs, str);
         if (str.length() == 0)
@@ -102,6 +186,8 @@ bool Scene::loadScene(const std::string& scenePath)
             else if (blockType == BlockType::Object) {
 				if (object == nullptr)
 					LOG_ERROR();
+				if (object->objectType == ObjectType::Instance)
+					setupInstance(static_cast<Instance*>(object));
                 objects.push_back(std::unique_ptr<Object>(object));
             }
         }
@@ -177,6 +263,62 @@ bool Scene::loadScene(const std::string& scenePath)
                 options.maxRayDepth = strToInt(value);
             else if (strEquals(key, "ac_penalty"))
                 options.acPenalty = strToInt(value);
+            else if (strEquals(key, "rebuild_cost_ratio"))
+                options.rebuildCostRatio = strToFloat(value);
+            else if (strEquals(key, "ac_cache"))
+                options.acCacheDir = std::string(value);
+            else if (strEquals(key, "packet_size")) {
+                // Side of the square, packet holds at most 64 rays
+                options.packetSize = strToInt(value);
+                if (options.packetSize < 0 || options.packetSize > 8) {
+                    LOG_ERROR();
+                    options.packetSize = 0;
+                }
+            }
+            else if (strEquals(key, "integrator")) {
+                if (strEquals(value, "recursive"))
+                    options.integrator = Integrator::Recursive;
+                else if (strEquals(value, "wavefront"))
+                    options.integrator = Integrator::Wavefront;
+                else
+                    LOG_ERROR();
+            }
+            else if (strEquals(key, "aa_samples")) {
+                options.aaSamples = strToInt(value);
+                if (options.aaSamples < 0) {
+                    LOG_ERROR();
+                    options.aaSamples = 0;
+                }
+            }
+            else if (strEquals(key, "aa_threshold"))
+                options.aaThreshold = strToFloat(value);
+            else if (strEquals(key, "progressive"))
+                options.progressive = strToInt(value) != 0;
+            else if (strEquals(key, "time_budget")) {
+                options.timeBudget = strToInt(value);
+                if (options.timeBudget < 0) {
+                    LOG_ERROR();
+                    options.timeBudget = 0;
+                }
+            }
+            else if (strEquals(key, "tile_scheduling")) {
+                if (strEquals(value, "fixed"))
+                    options.tileScheduling = TileScheduling::Fixed;
+                else if (strEquals(value, "cost"))
+                    options.tileScheduling = TileScheduling::Cost;
+                else
+                    LOG_ERROR();
+            }
+            else if (strEquals(key, "bvh_quality")) {
+                if (strEquals(value, "sah"))
+                    options.bvhQuality = BVHQuality::SAH;
+                else if (strEquals(value, "lbvh"))
+                    options.bvhQuality = BVHQuality::LBVH;
+                else if (strEquals(value, "hybrid"))
+                    options.bvhQuality = BVHQuality::Hybrid;
+                else
+                    LOG_ERROR();
+            }
             else if (strEquals(key, "background_color"))
                 options.backgroundColor = str3ToFloat(splitString(value, ','));
             else if (strEquals(key, "position"))
@@ -219,7 +361,7 @@ bool Scene::loadScene(const std::string& scenePath)
             if (strEquals(key, "direction")) {
 				if (light->type != LightType::DistantLight) 
 					LOG_ERROR();
-                static_cast<DistantLight*>(light)->dir = str3ToFloat(splitString(value, ','));
+                static_cast<DistantLight*>(light)->dir = str3ToFloat(splitString(value, ',')).normalize();
             }
             else if (strEquals(key, "position")) {
 				if (light->type != LightType::PointLight) 
@@ -260,6 +402,8 @@ bool Scene::loadScene(const std::string& scenePath)
                     object = new Sphere();
                 else if (strEquals(value, "mesh"))
                     object = new Mesh();
+                else if (strEquals(value, "instance"))
+                    object = new Instance();
             }
             else if (object == nullptr) {
                 std::cout << "Error, object type missing\n";
@@ -308,6 +452,30 @@ bool Scene::loadScene(const std::string& scenePath)
                 else if (strEquals(key, "rot")) {
                     mesh->rot = str3ToFloat(splitString(value, ','));
                 }
+                else if (strEquals(key, "accel")) {
+                    if (strEquals(value, "split"))
+                        mesh->accelType = AccelType::Split;
+                    else if (strEquals(value, "bvh"))
+                        mesh->accelType = AccelType::BVH;
+                    else if (strEquals(value, "bvh4"))
+                        mesh->accelType = AccelType::BVH4;
+                    else if (strEquals(value, "bvh8"))
+                        mesh->accelType = AccelType::BVH8;
+                    else if (strEquals(value, "qbvh"))
+                        mesh->accelType = AccelType::QBVH;
+                    else
+                        LOG_ERROR();
+                }
+                else if (strEquals(key, "intersector")) {
+                    if (strEquals(value, "moller"))
+                        mesh->triangleTest = TriangleTest::MollerTrumbore;
+                    else if (strEquals(value, "affine"))
+                        mesh->triangleTest = TriangleTest::Affine;
+                    else if (strEquals(value, "indexed"))
+                        mesh->triangleTest = TriangleTest::Indexed;
+                    else
+                        LOG_ERROR();
+                }
                 else if (strEquals(key, "name")) {
                     mesh->loadOBJ(std::string(value), options);
                 }
@@ -321,6 +489,47 @@ bool Scene::loadScene(const std::string& scenePath)
 					mesh->specularMapLoaded = mesh->loadSpecularMap(std::string(value));
 				}
             }
+            else if (object->objectType == ObjectType::Instance) {
+                Instance* instance = static_cast<Instance*>(object);
+                if (strEquals(key, "name"))
+                    instance->meshName = std::string(value);
+                else if (strEquals(key, "size"))
+                    instance->size = str3ToFloat(splitString(value, ','));
+                else if (strEquals(key, "rot"))
+                    instance->rot = str3ToFloat(splitString(value, ','));
+                else if (strEquals(key, "scale"))
+                    instance->scale = strToFloat(value);
+                else if (strEquals(key, "accel")) {
+                    if (strEquals(value, "split"))
+                        instance->accelType = AccelType::Split;
+                    else if (strEquals(value, "bvh"))
+                        instance->accelType = AccelType::BVH;
+                    else if (strEquals(value, "bvh4"))
+                        instance->accelType = AccelType::BVH4;
+                    else if (strEquals(value, "bvh8"))
+                        instance->accelType = AccelType::BVH8;
+                    else if (strEquals(value, "qbvh"))
+                        instance->accelType = AccelType::QBVH;
+                    else
+                        LOG_ERROR();
+                }
+                else if (strEquals(key, "intersector")) {
+                    if (strEquals(value, "moller"))
+                        instance->triangleTest = TriangleTest::MollerTrumbore;
+                    else if (strEquals(value, "affine"))
+                        instance->triangleTest = TriangleTest::Affine;
+                    else if (strEquals(value, "indexed"))
+                        instance->triangleTest = TriangleTest::Indexed;
+                    else
+                        LOG_ERROR();
+                }
+                else if (strEquals(key, "diffuse_map"))
+                    instance->diffuseMapName = std::string(value);
+                else if (strEquals(key, "normal_map"))
+                    instance->normalMapName = std::string(value);
+                else if (strEquals(key, "specular_map"))
+                    instance->specularMapName = std::string(value);
+            }
         }
     }
 
@@ -329,10 +538,41 @@ bool Scene::loadScene(const std::string& scenePath)
 	if (options::useSkybox) {
 		loadSkybox();
 	}
+
+	buildObjectBVH();
 	
 	return true;
 }
 
+void Scene::buildObjectBVH()
+{
+	std::vector<BVHPrimitive> prims;
+	unboundedObjects.clear();
+	for (size_t i = 0; i < objects.size(); i++) {
+		BVHPrimitive prim;
+		if (objects[i]->getBounds(prim.bounds)) {
+			prim.centroid = prim.bounds.centroid();
+			prim.index = (uint32_t)i;
+			prims.push_back(prim);
+		}
+		else {
+			unboundedObjects.push_back((uint32_t)i);
+		}
+	}
+	objectBVH.build(prims);
+	nextGeneration();
+}
+
+void Scene::refitObjectBVH()
+{
+	// Unbounded objects are not in the tree, their boxes stay empty
+	std::vector<BBox> objectBounds(objects.size());
+	for (size_t i = 0; i < objects.size(); i++)
+		objects[i]->getBounds(objectBounds[i]);
+	objectBVH.refit(objectBounds);
+	nextGeneration();
+}
+
 void Scene::loadSkybox()
 {
 	// Load skybox and transform it to Vec3f
@@ -366,10 +606,10 @@ std::vector<tileInfo> Scene::getTiles()
 	for (int i = 0; i < options.width / tileSize + 1; i++) {
 		for (int j = 0; j < options.height / tileSize + 1; j++) {
 			tileInfo tile{ i * tileSize, (i + 1) * tileSize, j * tileSize, (j + 1) * tileSize };
-			if (tile.y1 >= options.height)
-				tile.y1 = options.height - 1;
-			if (tile.x1 >= options.width)
-				tile.x1 = options.width - 1;
+			if (tile.y1 > options.height)
+				tile.y1 = options.height;
+			if (tile.x1 > options.width)
+				tile.x1 = options.width;
 			if (tile.x1 <= tile.x0 || tile.y1 <= tile.y0)
 				continue;
 			tileInfoVec.push_back(tile);
@@ -456,58 +696,91 @@ void Scene::renderWorker(Vec3f* frameBuffer, const tileInfo& tile)
 		yPix = -(2 * (y + 0.5f) / height - 1) * scale;
 	};
 
+	// First hits are kept for supersampling
+	SampleHit* hits = pixelHits.empty() ? nullptr : pixelHits.data();
+
+	if (options.packetSize > 0) {
+		// Square blocks of pixels are traced as packets
+		const size_t block = options.packetSize;
+		RayPacket packet;
+		size_t pixels[RayPacket::maxSize];
+		Vec3f colors[RayPacket::maxSize];
+		SampleHit packetHits[RayPacket::maxSize];
+		for (size_t by = tile.y0; by < tile.y1; by += block) {
+			if (stopRequested())
+				return;
+			for (size_t bx = tile.x0; bx < tile.x1; bx += block) {
+				packet.clear();
+				for (size_t y = by; y < std::min(by + block, tile.y1); y++) {
+					for (size_t x = bx; x < std::min(bx + block, tile.x1); x++) {
+						getPixels((float)x + 0.5f, (float)y + 0.5f, xPix, yPix);
+						pixels[packet.add(camera.getRay(xPix, yPix))] = x + y * options.width;
+					}
+				}
+				Render::castPacket(packet, *this, colors, hits ? packetHits : nullptr);
+				for (int i = 0; i < packet.size; i++) {
+					frameBuffer[pixels[i]] = colors[i];
+					if (hits)
+						hits[pixels[i]] = packetHits[i];
+				}
+				finishedPixels += packet.size;
+			}
+		}
+		return;
+	}
+
 	for (size_t y = tile.y0; y < tile.y1; y++) {
+		if (stopRequested())
+			return;
 		for (size_t x = tile.x0; x < tile.x1; x++) {
 			getPixels((float)x + 0.5f, (float)y + 0.5f, xPix, yPix);
 			Ray ray = camera.getRay(xPix, yPix);
-			frameBuffer[x + y * options.width] = Render::castRay(ray, *this, 0);
+			frameBuffer[x + y * options.width] = Render::castRay(ray, *this, 0, hits ? &hits[x + y * options.width] : nullptr);
 			finishedPixels++;
 		}
 	}
-	runningWorkers--;
 }
 
-void Scene::launchWorkers(Vec3f* frameBuffer)
+void Scene::launchWorkers(Vec3f* frameBuffer, bool supersample, ImageStream* image)
 {
 	Timer t("Render scene");
-	
-	// For progress updates
-	std::chrono::time_point lastProgressOutput = std::chrono::high_resolution_clock::now();
-
-	std::vector<tileInfo> tileInfoVec = getTiles();
-	int tileIndex = 0;
-	std::vector<std::thread> threadPool;
-	runningWorkers = 0;
-	do {
-		// Avoid loop running too fast
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-		// Print progress each second
-		if (options::outputProgress) {
-			if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - lastProgressOutput).count() > 1000) {
-				const float progressCoef = 100.0f / (options.width * options.height);
-				std::cout << std::fixed << std::setw(2) << std::setprecision(0) << progressCoef * finishedPixels << "%\n";
-				lastProgressOutput = std::chrono::high_resolution_clock::now();
-			}
-		}
-
-		// Keep launching threads until we run out of tiles
-		while (tileIndex < tileInfoVec.size() && runningWorkers < options.nWorkers) {
-			tileInfo tile = tileInfoVec.at(tileIndex++);
-			runningWorkers++;
-			threadPool.emplace_back(std::thread(&Scene::renderWorker, this, frameBuffer, tile));
-		}
-	} while (runningWorkers > 0);
+	if (options::enableSSAA)
+		pixelHits.assign(options.width * options.height, SampleHit());
+	else
+		pixelHits.clear();
+
+	// Calling thread renders tiles too, so it is one less worker
+	ThreadPool& pool = ThreadPool::shared(std::max(0, options.nWorkers - 1));
+	std::vector<tileInfo> tiles = getTiles();
+	TileScheduler scheduler(*this);
+	if (options.tileScheduling == TileScheduling::Cost)
+		tiles = scheduler.schedule(tiles, pool);
+
+	lastProgressOutput = std::chrono::high_resolution_clock::now();
+	std::vector<float> tileTimes(tiles.size());
+	FrameGraph(*this, frameBuffer, tiles, supersample, image).run(pool, tileTimes);
+
+	if (options.tileScheduling == TileScheduling::Cost && options::collectStatistics)
+		scheduler.report(tiles, tileTimes);
+}
 
-	// Check that no thread is running
-	for (auto& thread : threadPool) {
-		thread.join();
+void Scene::reportProgress()
+{
+	if (!options::outputProgress)
+		return;
+	// Print progress each second, when a tile is finished
+	std::lock_guard<std::mutex> lock(progressMutex);
+	const auto now = std::chrono::high_resolution_clock::now();
+	if (std::chrono::duration_cast<std::chrono::milliseconds>(now - lastProgressOutput).count() > 1000) {
+		const float progressCoef = 100.0f / (options.width * options.height);
+		std::cout << std::fixed << std::setw(2) << std::setprecision(0) << progressCoef * finishedPixels << "%\n";
+		lastProgressOutput = now;
 	}
 }
 
-void Scene::SSAAworker(Vec3f* frameBuffer, bool* sobelBuffer, const tileInfo& tile)
+void Scene::SSAAworker(Vec3f* frameBuffer, bool* edgeBuffer, const tileInfo& tile)
 {
-	// Render pixels in tile from (x0, y0) to (x1, y1)
+	// Supersample marked pixels in tile from (x0, y0) to (x1, y1)
 	const float scale = tanf(camera.fov * 0.5f / 180.0f * (float)(M_PI));
 	const float imageAspectRatio = (options.width) / (float)options.height;
 	const float width = (float)options.width;
@@ -520,90 +793,284 @@ void Scene::SSAAworker(Vec3f* frameBuffer, bool* sobelBuffer, const tileInfo& ti
 		yPix = -(2 * (y + 0.5f) / height - 1) * scale;
 	};
 
+	if (options.packetSize > 0) {
+		// Marked pixels of a block take samples in rounds. Samples of all pixels of the
+		// round that didn't converge go to packets, which are traced when full
+		const size_t block = options.packetSize;
+		RayPacket packet;
+		size_t pixels[RayPacket::maxSize];
+		Vec3f colors[RayPacket::maxSize];
+		std::vector<PixelSamples> samples(block * block);
+		auto castPacket = [&]()
+		{
+			Render::castPacket(packet, *this, colors);
+			for (int i = 0; i < packet.size; i++)
+				samples[pixels[i]].add(colors[i]);
+			packet.clear();
+		};
+		for (size_t by = tile.y0; by < tile.y1; by += block) {
+			if (stopRequested())
+				return;
+			for (size_t bx = tile.x0; bx < tile.x1; bx += block) {
+				const size_t yEnd = std::min(by + block, tile.y1), xEnd = std::min(bx + block, tile.x1);
+				bool active = false;
+				for (size_t y = by; y < yEnd; y++) {
+					for (size_t x = bx; x < xEnd; x++) {
+						PixelSamples& pixel = samples[(y - by) * block + x - bx];
+						pixel = PixelSamples();
+						if (edgeBuffer[y * options.width + x]) {
+							pixel.add(frameBuffer[x + y * options.width]);
+							pixel.active = active = true;
+						}
+					}
+				}
+				while (active) {
+					for (size_t y = by; y < yEnd; y++) {
+						for (size_t x = bx; x < xEnd; x++) {
+							const size_t i = (y - by) * block + x - bx;
+							if (!samples[i].active)
+								continue;
+							// Count changes when a full packet is traced
+							const int first = samples[i].count - 1, n = samples[i].nextRound(options.aaSamples);
+							for (int k = first; k < first + n; k++) {
+								if (packet.size == RayPacket::maxSize)
+									castPacket();
+								const Vec2f offset = sampleOffset(k);
+								getPixels((float)x + offset.x, (float)y + offset.y, xPix, yPix);
+								pixels[packet.add(camera.getRay(xPix, yPix))] = i;
+							}
+						}
+					}
+					if (packet.size > 0)
+						castPacket();
+					active = false;
+					for (PixelSamples& pixel : samples) {
+						if (pixel.active)
+							pixel.active = pixel.nextRound(options.aaSamples) > 0 && !pixel.converged(options.aaThreshold);
+						active |= pixel.active;
+					}
+				}
+				for (size_t y = by; y < yEnd; y++) {
+					for (size_t x = bx; x < xEnd; x++) {
+						const PixelSamples& pixel = samples[(y - by) * block + x - bx];
+						if (pixel.count > 0) {
+							frameBuffer[x + y * options.width] = pixel.colorSum / (float)pixel.count;
+							countSupersamples(pixel);
+						}
+					}
+				}
+			}
+		}
+		return;
+	}
+
 	for (size_t y = tile.y0; y < tile.y1; y++) {
+		if (stopRequested())
+			return;
 		for (size_t x = tile.x0; x < tile.x1; x++) {
-			if (sobelBuffer[y * options.width + x]) {
-				Vec3f color = { 0, 0, 0 };
-				getPixels((float)x + 0.25f, (float)y + 0.25f, xPix, yPix);
-				color += Render::castRay(camera.getRay(xPix, yPix), *this, 0);
-				getPixels((float)x + 0.25f, (float)y + 0.75f, xPix, yPix);
-				color += Render::castRay(camera.getRay(xPix, yPix), *this, 0);
-				getPixels((float)x + 0.75f, (float)y + 0.25f, xPix, yPix);
-				color += Render::castRay(camera.getRay(xPix, yPix), *this, 0);
-				getPixels((float)x + 0.75f, (float)y + 0.75f, xPix, yPix);
-				color += Render::castRay(camera.getRay(xPix, yPix), *this, 0);
-				frameBuffer[x + y * options.width] = color / 4;
-			}
+			if (!edgeBuffer[y * options.width + x])
+				continue;
+			PixelSamples pixel;
+			pixel.add(frameBuffer[x + y * options.width]);
+			do {
+				const int first = pixel.count - 1, n = pixel.nextRound(options.aaSamples);
+				for (int k = first; k < first + n; k++) {
+					const Vec2f offset = sampleOffset(k);
+					getPixels((float)x + offset.x, (float)y + offset.y, xPix, yPix);
+					pixel.add(Render::castRay(camera.getRay(xPix, yPix), *this, 0));
+				}
+			} while (pixel.nextRound(options.aaSamples) > 0 && !pixel.converged(options.aaThreshold));
+			frameBuffer[x + y * options.width] = pixel.colorSum / (float)pixel.count;
+			countSupersamples(pixel);
 		}
 	}
-	runningWorkers--;
 }
 
 void Scene::launchSSAA(Vec3f* frameBuffer)
 {
-	Timer t1("MSAA");
-	bool* sobelBuffer = new bool[options.height * options.width];
-
-	float sobelOperator[3][3] =
-	{ { -1, 0, 1 },
-	  { -2, 0, 2 },
-	  { -1, 0, 1 } };
+	Timer t1("Supersampling");
+	bool* edgeBuffer = new bool[options.height * options.width];
 
+	ThreadPool& pool = ThreadPool::shared(std::max(0, options.nWorkers - 1));
 	{
-		Timer t2("Sobel filter");
-		for (int i = 1; i < options.height - 1; i++) {
-			for (int j = 1; j < options.width - 1; j++) {
-				Vec3f x = { 0.0f }, y = { 0.0f };
-
-				for (int a = 0; a < 3; a++) {
-					for (int b = 0; b < 3; b++) {
-						x += frameBuffer[(i - 1 + a) * options.width + j - 1 + b] * sobelOperator[a][b];
-						y += frameBuffer[(i - 1 + a) * options.width + j - 1 + b] * sobelOperator[b][a];
-					}
-				}
+		Timer t2("Edge detection");
+		const bool useHits = pixelHits.size() == options.width * options.height;
+		detectEdges(frameBuffer, useHits ? pixelHits.data() : nullptr, options.width, options.height, edgeBuffer, pool);
+	}
+
+	// Wavefront pass can't stop halfway, so progressive render supersamples by tiles
+	if (options.integrator == Integrator::Wavefront && !stopToken) {
+		SSAAwavefront(frameBuffer, edgeBuffer);
+		delete[] edgeBuffer;
+		return;
+	}
+
+	TaskGroup tiles;
+	for (const tileInfo& tile : getTiles())
+		pool.submit(tiles, [this, frameBuffer, edgeBuffer, tile]() { SSAAworker(frameBuffer, edgeBuffer, tile); });
+	pool.wait(tiles);
+
+	delete[] edgeBuffer;
+}
 
-				float val = sqrtf(powf(x.length(), 2) + powf(y.length(), 2));
-				sobelBuffer[i * options.width + j] = val > 0.5f ? true : false;
+void Scene::launchWavefront(Vec3f* frameBuffer)
+{
+	Timer t("Render scene");
+	std::vector<Ray> rays;
+	rays.reserve(options.width * options.height);
+	for (size_t y = 0; y < options.height; y++)
+		for (size_t x = 0; x < options.width; x++)
+			rays.push_back(getCameraRay((float)x + 0.5f, (float)y + 0.5f));
+
+	std::vector<Vec3f> colors;
+	WavefrontRenderer(*this).render(rays, colors, options::enableSSAA ? &pixelHits : nullptr);
+	std::copy(colors.begin(), colors.end(), frameBuffer);
+}
+
+void Scene::SSAAwavefront(Vec3f* frameBuffer, bool* edgeBuffer)
+{
+	// Samples of a round of all marked pixels that didn't converge are traced together
+	std::vector<size_t> pixels;
+	std::vector<PixelSamples> samples;
+	for (size_t p = 0; p < options.width * options.height; p++) {
+		if (!edgeBuffer[p])
+			continue;
+		pixels.push_back(p);
+		samples.emplace_back();
+		samples.back().add(frameBuffer[p]);
+		samples.back().active = true;
+	}
+
+	std::vector<Ray> rays;
+	std::vector<size_t> owners;
+	std::vector<Vec3f> colors;
+	while (true) {
+		rays.clear();
+		owners.clear();
+		for (size_t i = 0; i < pixels.size(); i++) {
+			if (!samples[i].active)
+				continue;
+			const int first = samples[i].count - 1, n = samples[i].nextRound(options.aaSamples);
+			const float x = (float)(pixels[i] % options.width), y = (float)(pixels[i] / options.width);
+			for (int k = first; k < first + n; k++) {
+				const Vec2f offset = sampleOffset(k);
+				rays.push_back(getCameraRay(x + offset.x, y + offset.y));
+				owners.push_back(i);
 			}
 		}
+		if (rays.empty())
+			break;
+		WavefrontRenderer(*this).render(rays, colors);
+		for (size_t r = 0; r < rays.size(); r++)
+			samples[owners[r]].add(colors[r]);
+		for (PixelSamples& pixel : samples)
+			if (pixel.active)
+				pixel.active = pixel.nextRound(options.aaSamples) > 0 && !pixel.converged(options.aaThreshold);
 	}
 
-	std::vector<tileInfo> tileInfoVec = getTiles();
-	int tileIndex = 0;
-	std::vector<std::thread> threadPool;
-	runningWorkers = 0;
-	do {
-		// Avoid loop running too fast
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	for (size_t i = 0; i < pixels.size(); i++) {
+		frameBuffer[pixels[i]] = samples[i].colorSum / (float)samples[i].count;
+		countSupersamples(samples[i]);
+	}
+}
 
-		// Keep launching threads until we run out of tiles
-		while (tileIndex < tileInfoVec.size() && runningWorkers < options.nWorkers) {
-			tileInfo tile = tileInfoVec.at(tileIndex++);
-			runningWorkers++;
-			threadPool.emplace_back(std::thread(&Scene::SSAAworker, this, frameBuffer, sobelBuffer, tile));
+void Scene::launchProgressive(Vec3f* frameBuffer, const CancelToken& token)
+{
+	// Every pass starts from the complete image of the previous one and replaces
+	// a pixel only when its new color is ready, so the image is valid at any stop
+	stopToken = &token;
+	renderInterrupted = false;
+	const int passCount = options::enableSSAA ? 3 : 2;
+	int finishedPasses = 0;
+	for (int pass = 0; pass < passCount && !renderInterrupted && !stopRequested(); pass++) {
+		if (pass == 0) {
+			Timer t("Preview pass");
+			ThreadPool& pool = ThreadPool::shared(std::max(0, options.nWorkers - 1));
+			TaskGroup tiles;
+			for (const tileInfo& tile : getTiles())
+				pool.submit(tiles, [this, frameBuffer, tile]() { previewWorker(frameBuffer, tile); });
+			pool.wait(tiles);
 		}
-	} while (runningWorkers > 0);
+		else if (pass == 1)
+			launchWorkers(frameBuffer);
+		else
+			launchSSAA(frameBuffer);
+		if (!renderInterrupted)
+			finishedPasses++;
+	}
+	stopToken = nullptr;
+
+	if (options::enableOutput)
+		std::cout << "Progressive render: " << finishedPasses << " of " << passCount << " passes finished\n";
+}
 
-	// Check that no thread is running
-	for (auto& thread : threadPool) {
-		thread.join();
+void Scene::previewWorker(Vec3f* frameBuffer, const tileInfo& tile)
+{
+	// Color of the middle pixel of a block fills the whole block
+	for (size_t by = tile.y0; by < tile.y1; by += previewStep) {
+		if (stopRequested())
+			return;
+		const size_t yEnd = std::min(by + previewStep, tile.y1);
+		const size_t y = (by + yEnd - 1) / 2;
+		for (size_t bx = tile.x0; bx < tile.x1; bx += previewStep) {
+			const size_t xEnd = std::min(bx + previewStep, tile.x1);
+			const size_t x = (bx + xEnd - 1) / 2;
+			const Vec3f color = Render::castRay(getCameraRay((float)x + 0.5f, (float)y + 0.5f), *this, 0);
+			for (size_t py = by; py < yEnd; py++)
+				for (size_t px = bx; px < xEnd; px++)
+					frameBuffer[px + py * options.width] = color;
+		}
 	}
+}
 
-	delete[] sobelBuffer;
+bool Scene::stopRequested()
+{
+	if (!stopToken || !stopToken->stopped())
+		return false;
+	renderInterrupted = true;
+	return true;
+}
+
+Ray Scene::getCameraRay(const float x, const float y)
+{
+	const float scale = tanf(camera.fov * 0.5f / 180.0f * (float)(M_PI));
+	const float imageAspectRatio = (options.width) / (float)options.height;
+	const float xPix = (2 * (x + 0.5f) / (float)options.width - 1) * scale * imageAspectRatio;
+	const float yPix = -(2 * (y + 0.5f) / (float)options.height - 1) * scale;
+	return camera.getRay(xPix, yPix);
 }
 
-void Scene::render()
+void Scene::render(CancelToken* token)
 {
 	if (!sceneLoadSuccess) return;
 	Timer t("Total time");
+	// Objects may have moved since the last render
+	nextGeneration();
+	const auto start = std::chrono::steady_clock::now();
 	Vec3f* frameBuffer = new Vec3f[options.height * options.width];
+	std::unique_ptr<ImageStream> image;
+	bool imageStreamed = false;
 	
-	if (!options::showAC) {
-		launchWorkers(frameBuffer);
-
+	if (!options::showAC && (token || options.progressive || options.timeBudget > 0)) {
+		CancelToken ownToken;
+		if (!token)
+			token = &ownToken;
+		if (options.timeBudget > 0)
+			token->setDeadline(start + std::chrono::milliseconds(options.timeBudget));
+		launchProgressive(frameBuffer, *token);
+	}
+	else if (!options::showAC && options.integrator == Integrator::Wavefront) {
+		launchWavefront(frameBuffer);
 		if (options::enableSSAA)
 			launchSSAA(frameBuffer);
 	}
+	else if (!options::showAC) {
+		// Tiles are supersampled and written while others render
+		imageStreamed = true;
+		if (options::imageOutput)
+			image = openImage(options);
+		launchWorkers(frameBuffer, options::enableSSAA, image.get());
+	}
 	else {
 		// To show AC we need to another routine
 		const Vec3f orig = { 0, 0, 0 };
@@ -635,7 +1102,9 @@ void Scene::render()
 	}
 	
 
-	if (options::imageOutput) {
+	if (image)
+		closeImage(*image);
+	else if (options::imageOutput && !imageStreamed) {
 		saveImage(frameBuffer, options);
 	}
 
@@ -662,7 +1131,10 @@ int Scene::countAC(const Ray& ray)
 	for (auto& obj : objects) {
 		if (obj->objectType == ObjectType::Mesh) {
 			Mesh* mesh = dynamic_cast<Mesh*>(obj.get());
-			sum += mesh->ac.get()->recCountAC(ray);
+			sum += mesh->countAC(ray);
+		}
+		else if (obj->objectType == ObjectType::Instance) {
+			sum += static_cast<const Instance*>(obj.get())->countAC(ray);
 		}
 	}
 	return sum;
@@ -721,226 +1193,393 @@ float Render::fresnel(const Vec3f& dir, const Vec3f& normal, const float& indexO
 	return kr;
 }
 
-bool Render::trace(const Ray& ray, const ObjectVector& objects, IntersectInfo& intrInfo)
+bool Render::trace(const Ray& ray, const Scene& scene, IntersectInfo& intrInfo)
 {
 	// Try to intersect all objects, choose the closest one
 	if (options::collectStatistics) {
 		stats::raysCasted++;
 	}
 	intrInfo.hitObject = nullptr;
-	for (auto i = objects.begin(); i != objects.end(); i++) {
-		// transparent objects do not cast shadows
-		if (ray.rayType == RayType::ShadowRay && (*i).get()->materialType == MaterialType::Transparent)
-			continue;
-		float tNear = std::numeric_limits<float>::max();
-		const Triangle* ptr = nullptr;
-		Vec2f uv;
-
-		if ((*i).get()->objectType == ObjectType::Mesh) {
-			if (dynamic_cast<Mesh*>((*i).get())->intersectMesh(ray, tNear, ptr, uv) && tNear < intrInfo.tNear) {
-				intrInfo.hitObject = (*i).get();
-				intrInfo.tNear = tNear;
-				intrInfo.triPtr = ptr;
-				intrInfo.uv = uv;
-			}
-		}
-		else {
-			if ((*i).get()->intersectObject(ray, tNear, uv) && tNear < intrInfo.tNear) {
-				intrInfo.hitObject = (*i).get();
-				intrInfo.tNear = tNear;
-				intrInfo.uv = uv;
+	for (uint32_t object : scene.unboundedObjects)
+		traceObject(ray, scene.objects[object].get(), intrInfo);
+
+	// Only objects whose boxes are crossed before the closest hit are tested
+	scene.objectBVH.intersect(ray, intrInfo.tNear, [&](uint32_t begin, uint32_t end, float&)
+		{
+			bool hit = false;
+			for (uint32_t i = begin; i < end; i++) {
+				if (traceObject(ray, scene.objects[scene.objectBVH.primIndices[i]].get(), intrInfo))
+					hit = true;
 			}
-		}
-	}
+			return hit;
+		});
 	return (intrInfo.hitObject != nullptr);
 }
 
-Vec3f Render::castRay(const Ray& ray, const Scene& scene, const int depth)
+void Render::tracePacket(RayPacket& packet, const Scene& scene, IntersectInfo intrInfos[])
 {
-	if (depth > scene.options.maxRayDepth) return scene.getSkybox(ray.dir);
-	IntersectInfo intrInfo;
-	if (trace(ray, scene.objects, intrInfo)) {
-		Vec3f objectColor = intrInfo.hitObject->color;
-
-		Vec2f hitTexCoordinates;
-		Vec3f hitNormal, hitColor = { 0 };
-		// Get point coordinate and normal
-		Vec3f hitPoint = ray.orig + ray.dir * intrInfo.tNear;
-		intrInfo.hitObject->getSurfaceData(hitPoint, intrInfo.triPtr, intrInfo.uv, hitNormal, hitTexCoordinates);
-
-		if (options::showNormals)
-			return hitNormal / 2.0f + Vec3f{ 0.5f };
-
-		if (intrInfo.hitObject->objectType == ObjectType::Mesh)
-			objectColor = static_cast<const Mesh*>(intrInfo.hitObject)->getDiffuseColor(hitTexCoordinates);
-
-		Vec3f diffuseComponent = 0, specularComponent = 0;
-		IntersectInfo intrShadInfo;
-		Vec3f lightDir, lightIntensity;
-		if (intrInfo.hitObject->materialType == MaterialType::Diffuse) {
-			// For diffuse objects collect light from all visible sources
-			for (size_t i = 0; i < scene.lights.size(); ++i) {
-				if (scene.lights[i]->type != LightType::AreaLight) {
-					// Get light direction, intensity and distance
-					scene.lights[i]->illuminate(hitPoint, lightDir, lightIntensity, intrShadInfo.tNear);
-					// Check that light source is visible
-					bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir, RayType::ShadowRay }, scene.objects, intrShadInfo);
-					diffuseComponent += lightIntensity * (vis * std::max(0.f, hitNormal.dotProduct(-lightDir)));
-				}
-				else {
-					// Area light requires different routine
-					AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[i].get());
-
-					light->setPoints();
-					float diffuseSum = 0;
-					lightIntensity = light->color * std::min(1.0f, (float)(light->intensity / (4 * M_PI * (hitPoint - light->pos).length2() / 1000)));
-
-					// Add all light samples
-					for (const auto& p : light->points) {
-						lightDir = hitPoint - p;
-						intrShadInfo.tNear = lightDir.length();
-						bool vis = !Render::trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir.normalize(), RayType::ShadowRay }, scene.objects, intrShadInfo);
-						diffuseSum += vis * std::max(0.f, hitNormal.dotProduct(-lightDir));
-					}
-					diffuseComponent += diffuseSum / light->points.size() * lightIntensity;
-				}
-			}
-			hitColor = objectColor * diffuseComponent;
-		}
-		else if (intrInfo.hitObject->materialType == MaterialType::Phong) {
-			// For Phong object we will combine colors of object color, diffuse and specular
-			for (uint32_t i = 0; i < scene.lights.size(); ++i) {
-				if (scene.lights[i]->type != LightType::AreaLight) {
-					// Get light direction, intensity and distance
-					scene.lights[i]->illuminate(hitPoint, lightDir, lightIntensity, intrShadInfo.tNear);
-					// Check that light source is visible
-					bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir, RayType::ShadowRay }, scene.objects, intrShadInfo);
-
-					// Compute the diffuse component
-					diffuseComponent += vis * lightIntensity * std::max(0.f, hitNormal.dotProduct(-lightDir));
-
-					// Compute the specular component
-					Vec3f reflectedRay = reflect(lightDir, hitNormal);
-					specularComponent += vis * lightIntensity * std::pow(std::max(0.f, reflectedRay.dotProduct(-ray.dir)), intrInfo.hitObject->nSpecular);
-				}
+	packet.finish();
+	if (!packet.coherent) {
+		// Every ray would take its own path through the trees anyway
+		for (int r = 0; r < packet.size; r++) {
+			intrInfos[r] = IntersectInfo();
+			intrInfos[r].tNear = packet.tMax[r];
+			trace(packet.rays[r], scene, intrInfos[r]);
+		}
+		return;
+	}
+
+	if (options::collectStatistics) {
+		stats::raysCasted += packet.size;
+	}
+	// Hits are searched up to the distance given when the ray was added
+	uint64_t shadowMask = 0;
+	for (int r = 0; r < packet.size; r++) {
+		intrInfos[r] = IntersectInfo();
+		intrInfos[r].tNear = packet.tMax[r];
+		for (uint32_t object : scene.unboundedObjects)
+			traceObject(packet.rays[r], scene.objects[object].get(), intrInfos[r]);
+		packet.tMax[r] = intrInfos[r].tNear;
+		if (packet.rays[r].rayType == RayType::ShadowRay)
+			shadowMask |= 1ull << r;
+	}
+
+	// Meshes trace the rays reaching them together, other objects take them one by one
+	const Triangle* triPtrs[RayPacket::maxSize];
+	Vec2f uvs[RayPacket::maxSize];
+	scene.objectBVH.intersectPacket(packet, packet.fullMask(), [&](uint32_t begin, uint32_t end, uint64_t rayMask)
+		{
+			for (uint32_t i = begin; i < end; i++) {
+				const Object* object = scene.objects[scene.objectBVH.primIndices[i]].get();
+				// transparent objects do not cast shadows
+				const uint64_t objectMask = object->materialType == MaterialType::Transparent ? rayMask & ~shadowMask : rayMask;
+				if (objectMask == 0)
+					continue;
+				uint64_t hitMask = 0;
+				if (object->objectType == ObjectType::Mesh)
+					hitMask = static_cast<const Mesh*>(object)->intersectMeshPacket(packet, objectMask, triPtrs, uvs);
+				else if (object->objectType == ObjectType::Instance)
+					hitMask = static_cast<const Instance*>(object)->intersectInstancePacket(packet, objectMask, triPtrs, uvs);
 				else {
-					// Area light requires different routine
-					AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[i].get());
-
-					light->setPoints();
-					float areaIntensity = 0;
-					lightIntensity = light->color * std::min(1.0f, (float)(light->intensity / (4 * M_PI * (hitPoint - light->pos).length2() / 1000)));
-					
-					float specularSum = 0;
-					float diffuseSum = 0;
-					// Add all light samples
-					for (const auto& p : light->points) {
-						lightDir = hitPoint - p;
-						intrShadInfo.tNear = lightDir.length();
-						bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir.normalize(), RayType::ShadowRay }, scene.objects, intrShadInfo);
-						diffuseSum += vis * std::max(0.f, hitNormal.dotProduct(-lightDir));
-						Vec3f reflectedRay = reflect(lightDir, hitNormal);
-						specularSum += vis * std::max(0.f, reflectedRay.dotProduct(-ray.dir));
+					for (int r = 0; r < packet.size; r++) {
+						if ((objectMask >> r & 1) && traceObject(packet.rays[r], object, intrInfos[r]))
+							packet.tMax[r] = intrInfos[r].tNear;
 					}
-					diffuseComponent += diffuseSum / light->points.size() * lightIntensity;
-					specularComponent += std::pow(specularSum / light->points.size(), intrInfo.hitObject->nSpecular) * lightIntensity;
 				}
-			}
-			float specularCoefficient = intrInfo.hitObject->specular;
-			if (intrInfo.hitObject->objectType == ObjectType::Mesh)
-				specularCoefficient = static_cast<const Mesh*>(intrInfo.hitObject)->getSpecularValue(hitTexCoordinates);
-			hitColor = objectColor * intrInfo.hitObject->ambient + diffuseComponent * intrInfo.hitObject->diffuse + specularComponent * specularCoefficient;
-		}
-		else if (intrInfo.hitObject->materialType == MaterialType::Reflective) {
-			// Get info from reflected ray
-			Ray reflectedRay{ hitPoint + scene.options.bias * hitNormal, ray.dir - 2 * ray.dir.dotProduct(hitNormal) * hitNormal };
-
-			hitColor = 0.8f * castRay(reflectedRay, scene, depth + 1);
-
-			// Add light reflections
-			specularComponent = 0;
-			for (uint32_t i = 0; i < scene.lights.size(); ++i) {
-				if (scene.lights[i]->type != LightType::AreaLight) {
-					scene.lights[i]->illuminate(hitPoint, lightDir, lightIntensity, intrShadInfo.tNear);
-					bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir, RayType::ShadowRay }, scene.objects, intrShadInfo);
-					Vec3f reflectedRay = reflect(lightDir, hitNormal);
-					specularComponent += vis * lightIntensity * std::pow(std::max(0.f, reflectedRay.dotProduct(-ray.dir)), intrInfo.hitObject->nSpecular);
-				}
-				else {
-					// Area light requires different routine
-					AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[i].get());
-
-					light->setPoints();
-					float areaIntensity = 0;
-					lightIntensity = light->color * std::min(1.0f, (float)(light->intensity / (4 * M_PI * (hitPoint - light->pos).length2() / 1000)));
-
-					float specularSum = 0;
-					float diffuseSum = 0;
-					// Add all light samples
-					for (const auto& p : light->points) {
-						lightDir = hitPoint - p;
-						intrShadInfo.tNear = lightDir.length();
-						bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir.normalize(), RayType::ShadowRay }, scene.objects, intrShadInfo);
-						Vec3f reflectedRay = reflect(lightDir, hitNormal);
-						specularSum += vis * std::max(0.f, reflectedRay.dotProduct(-ray.dir));
+				if (hitMask == 0)
+					continue;
+				for (int r = 0; r < packet.size; r++) {
+					if (hitMask >> r & 1) {
+						intrInfos[r].hitObject = object;
+						intrInfos[r].tNear = packet.tMax[r];
+						intrInfos[r].triPtr = triPtrs[r];
+						intrInfos[r].uv = uvs[r];
 					}
-					specularComponent += std::pow(specularSum / light->points.size(), intrInfo.hitObject->nSpecular) * lightIntensity;
 				}
 			}
-			hitColor += specularComponent;
-		}
-		else if (intrInfo.hitObject->materialType == MaterialType::Transparent) {
-			float kr = fresnel(ray.dir, hitNormal, intrInfo.hitObject->indexOfRefraction);
-			bool outside = ray.dir.dotProduct(hitNormal) < 0;
-			Vec3f biasVec = scene.options.bias * hitNormal;
-			hitColor = { 0 };
-			if (kr < 1) {
-				// Compute refraction if it is not a case of total internal reflection
-				Vec3f refractionDirection = refract(ray.dir, hitNormal, intrInfo.hitObject->indexOfRefraction).normalize();
-				Vec3f refractionRayOrig = outside ? hitPoint - biasVec : hitPoint + biasVec; // add bias
-				Vec3f refractionColor = castRay(Ray{ refractionRayOrig, refractionDirection }, scene, depth + 1);
-				hitColor += refractionColor * (1 - kr);
+		});
+}
+
+bool Render::traceObject(const Ray& ray, const Object* object, IntersectInfo& intrInfo)
+{
+	// transparent objects do not cast shadows
+	if (ray.rayType == RayType::ShadowRay && object->materialType == MaterialType::Transparent)
+		return false;
+	float tNear = std::numeric_limits<float>::max();
+	const Triangle* ptr = nullptr;
+	Vec2f uv;
+
+	if (object->objectType == ObjectType::Mesh) {
+		if (static_cast<const Mesh*>(object)->intersectMesh(ray, tNear, ptr, uv) && tNear < intrInfo.tNear) {
+			intrInfo.hitObject = object;
+			intrInfo.tNear = tNear;
+			intrInfo.triPtr = ptr;
+			intrInfo.uv = uv;
+			return true;
+		}
+	}
+	else if (object->objectType == ObjectType::Instance) {
+		if (static_cast<const Instance*>(object)->intersectInstance(ray, tNear, ptr, uv) && tNear < intrInfo.tNear) {
+			intrInfo.hitObject = object;
+			intrInfo.tNear = tNear;
+			intrInfo.triPtr = ptr;
+			intrInfo.uv = uv;
+			return true;
+		}
+	}
+	else {
+		if (object->intersectObject(ray, tNear, uv) && tNear < intrInfo.tNear) {
+			intrInfo.hitObject = object;
+			intrInfo.tNear = tNear;
+			intrInfo.uv = uv;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Render::occluded(const Ray& ray, const Scene& scene, float maxT)
+{
+	uint32_t object;
+	const Triangle* triPtr;
+	return occluded(ray, scene, maxT, object, triPtr);
+}
+
+bool Render::occluded(const Ray& ray, const Scene& scene, float maxT, uint32_t& object, const Triangle*& triPtr)
+{
+	if (options::collectStatistics) {
+		stats::raysCasted++;
+	}
+	auto occludedBy = [&](uint32_t index)
+	{
+		if (!occludedObject(ray, scene.objects[index].get(), maxT, triPtr))
+			return false;
+		object = index;
+		return true;
+	};
+	for (uint32_t index : scene.unboundedObjects) {
+		if (occludedBy(index))
+			return true;
+	}
+	return scene.objectBVH.occluded(ray, maxT, [&](uint32_t begin, uint32_t end, float)
+		{
+			for (uint32_t i = begin; i < end; i++) {
+				if (occludedBy(scene.objectBVH.primIndices[i]))
+					return true;
 			}
+			return false;
+		});
+}
 
-			Vec3f reflectionDirection = reflect(ray.dir, hitNormal).normalize();
-			Vec3f reflectionRayOrig = outside ? hitPoint + biasVec : hitPoint - biasVec;    // add bias
-			Vec3f reflectionColor = castRay(Ray{ reflectionRayOrig, reflectionDirection }, scene, depth + 1);
-			hitColor += reflectionColor * kr;
-
-			// Add light reflections
-			specularComponent = 0;
-			for (uint32_t i = 0; i < scene.lights.size(); ++i) {
-				if (scene.lights[i]->type != LightType::AreaLight) {
-					scene.lights[i]->illuminate(hitPoint, lightDir, lightIntensity, intrShadInfo.tNear);
-					bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir, RayType::ShadowRay }, scene.objects, intrShadInfo);
-					Vec3f reflectedRay = reflect(lightDir, hitNormal);
-					specularComponent += vis * lightIntensity * std::pow(std::max(0.f, reflectedRay.dotProduct(-ray.dir)), intrInfo.hitObject->nSpecular);
-				}
-				else {
-					// Area light requires different routine
-					AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[i].get());
-
-					light->setPoints();
-					float areaIntensity = 0;
-					lightIntensity = light->color * std::min(1.0f, (float)(light->intensity / (4 * M_PI * (hitPoint - light->pos).length2() / 1000)));
-
-					float specularSum = 0;
-					float diffuseSum = 0;
-					// Add all light samples
-					for (const auto& p : light->points) {
-						lightDir = hitPoint - p;
-						intrShadInfo.tNear = lightDir.length();
-						bool vis = !trace(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir.normalize(), RayType::ShadowRay }, scene.objects, intrShadInfo);
-						Vec3f reflectedRay = reflect(lightDir, hitNormal);
-						specularSum += vis * std::max(0.f, reflectedRay.dotProduct(-ray.dir));
-					}
-					specularComponent += std::pow(specularSum / light->points.size(), intrInfo.hitObject->nSpecular) * lightIntensity;
-				}
+bool Render::occludedObject(const Ray& ray, const Object* object, float maxT, const Triangle*& triPtr)
+{
+	// transparent objects do not cast shadows
+	if (ray.rayType == RayType::ShadowRay && object->materialType == MaterialType::Transparent)
+		return false;
+	if (object->objectType == ObjectType::Mesh)
+		return static_cast<const Mesh*>(object)->occludedMesh(ray, maxT, triPtr);
+	if (object->objectType == ObjectType::Instance)
+		return static_cast<const Instance*>(object)->occludedInstance(ray, maxT, triPtr);
+	float t;
+	Vec2f uv;
+	triPtr = nullptr;
+	return object->intersectObject(ray, t, uv) && t < maxT;
+}
+
+bool Render::occludedCached(const Ray& ray, const Scene& scene, float maxT, uint32_t light)
+{
+	// Pointers would dangle after the scene is destroyed or a rebuilt tree reorders triangles,
+	// so the occluder is kept by indices, and only for the generation of the scene shaded last
+	struct Occluder
+	{
+		uint32_t object = Triangle::noIndex;
+		uint32_t triangle = Triangle::noIndex;		// of meshes and instances
+	};
+	thread_local uint64_t cachedGeneration = 0;
+	thread_local std::vector<Occluder> lastOccluders;
+	if (cachedGeneration != scene.generation || lastOccluders.size() != scene.lights.size()) {
+		cachedGeneration = scene.generation;
+		lastOccluders.assign(scene.lights.size(), Occluder());
+	}
+
+	// Neighbouring hit points are often shadowed by the same triangle
+	Occluder& last = lastOccluders[light];
+	if (last.object < scene.objects.size()) {
+		const Object* object = scene.objects[last.object].get();
+		bool hit;
+		if (last.triangle == Triangle::noIndex) {
+			const Triangle* triPtr;
+			hit = occludedObject(ray, object, maxT, triPtr);
+		}
+		else if (object->objectType == ObjectType::Instance)
+			hit = static_cast<const Instance*>(object)->occludedTriangle(ray, last.triangle, maxT);
+		else if (object->objectType == ObjectType::Mesh)
+			hit = static_cast<const Mesh*>(object)->occludedTriangle(ray, last.triangle, maxT);
+		else
+			hit = false;
+		if (hit) {
+			if (options::collectStatistics) {
+				stats::raysCasted++;
+				stats::shadowCacheHits++;
 			}
-			hitColor += specularComponent * kr;
+			return true;
+		}
+		if (options::collectStatistics) {
+			stats::shadowCacheMisses++;
 		}
-		
-		return hitColor;
 	}
+
+	// Lit points forget the occluder, so rays in light do not pay for the extra test
+	last = Occluder();
+	uint32_t object;
+	const Triangle* triPtr = nullptr;
+	if (!occluded(ray, scene, maxT, object, triPtr))
+		return false;
+	last.object = object;
+	if (triPtr) {
+		const Object* occluder = scene.objects[object].get();
+		const Mesh* mesh = occluder->objectType == ObjectType::Instance ? static_cast<const Instance*>(occluder)->mesh.get()
+			: static_cast<const Mesh*>(occluder);
+		last.triangle = (uint32_t)(triPtr - mesh->triangles.data());
+	}
+	return true;
+}
+
+Vec3f Render::castRay(const Ray& ray, const Scene& scene, const int depth, SampleHit* firstHit)
+{
+	if (depth > scene.options.maxRayDepth) return scene.getSkybox(ray.dir);
+	IntersectInfo intrInfo;
+	if (trace(ray, scene, intrInfo))
+		return shade(ray, scene, intrInfo, depth, firstHit);
+	if (firstHit)
+		*firstHit = SampleHit();
 	return scene.getSkybox(ray.dir);
 }
+
+void Render::castPacket(RayPacket& packet, const Scene& scene, Vec3f colors[], SampleHit hits[])
+{
+	IntersectInfo intrInfos[RayPacket::maxSize];
+	tracePacket(packet, scene, intrInfos);
+	for (int r = 0; r < packet.size; r++) {
+		if (intrInfos[r].hitObject)
+			colors[r] = shade(packet.rays[r], scene, intrInfos[r], 0, hits ? &hits[r] : nullptr);
+		else {
+			colors[r] = scene.getSkybox(packet.rays[r].dir);
+			if (hits)
+				hits[r] = SampleHit();
+		}
+	}
+}
+
+Vec3f Render::shade(const Ray& ray, const Scene& scene, const IntersectInfo& intrInfo, const int depth,
+	SampleHit* firstHit)
+{
+	Vec2f hitTexCoordinates;
+	Vec3f hitNormal;
+	// Get point coordinate and normal
+	Vec3f hitPoint = ray.orig + ray.dir * intrInfo.tNear;
+	intrInfo.hitObject->getSurfaceData(hitPoint, intrInfo.triPtr, intrInfo.uv, hitNormal, hitTexCoordinates);
+	if (firstHit)
+		*firstHit = SampleHit{ intrInfo.hitObject, hitNormal };
+
+	if (options::showNormals)
+		return hitNormal / 2.0f + Vec3f{ 0.5f };
+
+	// Colors of reflected and refracted rays come first
+	Ray rays[2];
+	float weights[2];
+	const int nRays = secondaryRays(ray, scene, intrInfo.hitObject, hitPoint, hitNormal, rays, weights);
+	Vec3f hitColor = { 0 };
+	for (int i = 0; i < nRays; i++)
+		hitColor += castRay(rays[i], scene, depth + 1) * weights[i];
+
+	auto visible = [&](const Ray& shadowRay, float distance, uint32_t light)
+	{
+		return !occludedCached(shadowRay, scene, distance, light);
+	};
+	return hitColor + directLight(ray, scene, intrInfo.hitObject, hitPoint, hitNormal, hitTexCoordinates, visible);
+}
+
+Vec3f Render::directLight(const Ray& ray, const Scene& scene, const Object* object, const Vec3f& hitPoint,
+	const Vec3f& hitNormal, const Vec2f& hitTexCoordinates, const std::function<bool(const Ray&, float, uint32_t)>& visible)
+{
+	Vec3f objectColor = object->color;
+	if (object->objectType == ObjectType::Mesh)
+		objectColor = static_cast<const Mesh*>(object)->getDiffuseColor(hitTexCoordinates);
+	else if (object->objectType == ObjectType::Instance)
+		objectColor = static_cast<const Instance*>(object)->getDiffuseColor(hitTexCoordinates);
+
+	// Diffuse light is needed only by diffuse and Phong materials, others just reflect lights
+	const bool needDiffuse = object->materialType == MaterialType::Diffuse || object->materialType == MaterialType::Phong;
+	const bool needSpecular = object->materialType != MaterialType::Diffuse;
+
+	Vec3f diffuseComponent = 0, specularComponent = 0;
+	Vec3f lightDir, lightIntensity;
+	float distance;
+	for (uint32_t i = 0; i < scene.lights.size(); ++i) {
+		if (scene.lights[i]->type != LightType::AreaLight) {
+			// Get light direction, intensity and distance
+			scene.lights[i]->illuminate(hitPoint, lightDir, lightIntensity, distance);
+			// Check that light source is visible
+			bool vis = visible(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir, RayType::ShadowRay }, distance, i);
+
+			// Compute the diffuse component
+			if (needDiffuse)
+				diffuseComponent += vis * lightIntensity * std::max(0.f, hitNormal.dotProduct(-lightDir));
+
+			// Compute the specular component
+			if (needSpecular) {
+				Vec3f reflectedRay = reflect(lightDir, hitNormal);
+				specularComponent += vis * lightIntensity * std::pow(std::max(0.f, reflectedRay.dotProduct(-ray.dir)), object->nSpecular);
+			}
+		}
+		else {
+			// Area light requires different routine
+			AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[i].get());
+
+			light->setPoints();
+			lightIntensity = light->color * std::min(1.0f, (float)(light->intensity / (4 * M_PI * (hitPoint - light->pos).length2() / 1000)));
+
+			float specularSum = 0;
+			float diffuseSum = 0;
+			// Add all light samples
+			for (const auto& p : light->points) {
+				lightDir = hitPoint - p;
+				distance = lightDir.length();
+				bool vis = visible(Ray{ hitPoint + hitNormal * scene.options.bias, -lightDir.normalize(), RayType::ShadowRay }, distance, i);
+				diffuseSum += vis * std::max(0.f, hitNormal.dotProduct(-lightDir));
+				Vec3f reflectedRay = reflect(lightDir, hitNormal);
+				specularSum += vis * std::max(0.f, reflectedRay.dotProduct(-ray.dir));
+			}
+			if (needDiffuse)
+				diffuseComponent += diffuseSum / light->points.size() * lightIntensity;
+			if (needSpecular)
+				specularComponent += std::pow(specularSum / light->points.size(), object->nSpecular) * lightIntensity;
+		}
+	}
+
+	if (object->materialType == MaterialType::Diffuse)
+		return objectColor * diffuseComponent;
+	if (object->materialType == MaterialType::Phong) {
+		// For Phong object we will combine colors of object color, diffuse and specular
+		float specularCoefficient = object->specular;
+		if (object->objectType == ObjectType::Mesh)
+			specularCoefficient = static_cast<const Mesh*>(object)->getSpecularValue(hitTexCoordinates);
+		else if (object->objectType == ObjectType::Instance)
+			specularCoefficient = static_cast<const Instance*>(object)->getSpecularValue(hitTexCoordinates);
+		return objectColor * object->ambient + diffuseComponent * object->diffuse + specularComponent * specularCoefficient;
+	}
+	if (object->materialType == MaterialType::Transparent)
+		return specularComponent * fresnel(ray.dir, hitNormal, object->indexOfRefraction);
+	return specularComponent;
+}
+
+int Render::secondaryRays(const Ray& ray, const Scene& scene, const Object* object, const Vec3f& hitPoint,
+	const Vec3f& hitNormal, Ray rays[2], float weights[2])
+{
+	if (object->materialType == MaterialType::Reflective) {
+		rays[0] = Ray{ hitPoint + scene.options.bias * hitNormal, ray.dir - 2 * ray.dir.dotProduct(hitNormal) * hitNormal };
+		weights[0] = 0.8f;
+		return 1;
+	}
+	if (object->materialType != MaterialType::Transparent)
+		return 0;
+
+	int nRays = 0;
+	float kr = fresnel(ray.dir, hitNormal, object->indexOfRefraction);
+	bool outside = ray.dir.dotProduct(hitNormal) < 0;
+	Vec3f biasVec = scene.options.bias * hitNormal;
+	if (kr < 1) {
+		// Compute refraction if it is not a case of total internal reflection
+		Vec3f refractionDirection = refract(ray.dir, hitNormal, object->indexOfRefraction).normalize();
+		Vec3f refractionRayOrig = outside ? hitPoint - biasVec : hitPoint + biasVec; // add bias
+		rays[nRays] = Ray{ refractionRayOrig, refractionDirection };
+		weights[nRays++] = 1 - kr;
+	}
+
+	Vec3f reflectionDirection = reflect(ray.dir, hitNormal).normalize();
+	Vec3f reflectionRayOrig = outside ? hitPoint + biasVec : hitPoint - biasVec;    // add bias
+	rays[nRays] = Ray{ reflectionRayOrig, reflectionDirection };
+	weights[nRays++] = kr;
+	return nRays;
+}
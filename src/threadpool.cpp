@@ -0,0 +1,122 @@
+// Pool of worker threads executing submitted tasks
+#include "threadpool.h"
+
+namespace
+{
+	// Pool and deque of the worker running on this thread
+	thread_local const ThreadPool* currentPool = nullptr;
+	thread_local int currentIndex = 0;
+}
+
+ThreadPool::ThreadPool(int nThreads)
+	: queues(new WorkQueue[nThreads + 1])
+{
+	for (int i = 0; i < nThreads; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wakeCondition.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+}
+
+ThreadPool& ThreadPool::shared(int nThreads)
+{
+	static ThreadPool pool(nThreads);
+	return pool;
+}
+
+int ThreadPool::queueIndex() const
+{
+	return currentPool == this ? currentIndex : (int)workers.size();
+}
+
+void ThreadPool::submit(TaskGroup& group, std::function<void()> task)
+{
+	group.pending++;
+	WorkQueue& queue = queues[queueIndex()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(Task{ std::move(task), &group });
+		queuedTasks++;
+	}
+	// Sleeping thread checks the counter under the lock, so it cannot miss the task
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeCondition.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup& group)
+{
+	while (!group.done()) {
+		Task task;
+		if (takeTask(task)) {
+			runTask(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeCondition.wait(lock, [&]() { return group.done() || queuedTasks > 0; });
+	}
+}
+
+void ThreadPool::workerLoop(int index)
+{
+	currentPool = this;
+	currentIndex = index;
+	while (true) {
+		Task task;
+		if (takeTask(task)) {
+			runTask(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeCondition.wait(lock, [this]() { return stopping || queuedTasks > 0; });
+		if (stopping && queuedTasks == 0)
+			return;
+	}
+}
+
+bool ThreadPool::takeTask(Task& task)
+{
+	if (queuedTasks == 0)
+		return false;
+
+	// Newest task of own deque first, it is most likely the one waiting thread needs
+	const int own = queueIndex();
+	const int count = (int)workers.size() + 1;
+	for (int k = 0; k < count; k++) {
+		const int i = (own + k) % count;
+		WorkQueue& queue = queues[i];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+		if (i == own) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		queuedTasks--;
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::runTask(Task& task)
+{
+	task.func();
+	// Group may be destroyed as soon as the waiting thread sees it done
+	if (--task.group->pending == 0) {
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		wakeCondition.notify_all();
+	}
+}
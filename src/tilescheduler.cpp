@@ -0,0 +1,151 @@
+// Order of render tiles from costs measured by a sparse low resolution pass
+#include "tilescheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+
+#include "options.h"
+
+TileScheduler::TileScheduler(Scene& a_scene)
+	: scene(a_scene) {}
+
+std::vector<tileInfo> TileScheduler::schedule(const std::vector<tileInfo>& tiles, ThreadPool& pool)
+{
+	using Clock = std::chrono::high_resolution_clock;
+	const auto passStart = Clock::now();
+
+	// Time one ray through the centre of every cell
+	cellsX = (scene.options.width + cellSize - 1) / cellSize;
+	cellsY = (scene.options.height + cellSize - 1) / cellSize;
+	cellTimes.assign(cellsX * cellsY, 0.0f);
+	pool.parallelFor(0, cellsY, 1, [&](size_t, size_t cy, size_t)
+		{
+			const size_t y = std::min(cy * cellSize + cellSize / 2, scene.options.height - 1);
+			for (size_t cx = 0; cx < cellsX; cx++) {
+				const size_t x = std::min(cx * cellSize + cellSize / 2, scene.options.width - 1);
+				const Ray ray = scene.getCameraRay((float)x + 0.5f, (float)y + 0.5f);
+				const auto start = Clock::now();
+				Render::castRay(ray, scene, 0);
+				cellTimes[cy * cellsX + cx] = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+			}
+		});
+	passTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - passStart).count();
+
+	// Split tiles until each is a small part of the work of one thread
+	float total = 0;
+	for (const tileInfo& tile : tiles)
+		total += predict(tile);
+	const float target = total / (pool.concurrency() * tilesPerThread);
+	std::vector<tileInfo> result, stack(tiles.rbegin(), tiles.rend());
+	splitCount = 0;
+	while (!stack.empty()) {
+		const tileInfo tile = stack.back();
+		stack.pop_back();
+		const bool splitX = tile.x1 - tile.x0 >= 2 * minTileSize;
+		const bool splitY = tile.y1 - tile.y0 >= 2 * minTileSize;
+		if (predict(tile) <= target || (!splitX && !splitY)) {
+			result.push_back(tile);
+			continue;
+		}
+		// Middle is on the cell grid, so every cell is in one part
+		const size_t xMid = splitX ? tile.x0 + (tile.x1 - tile.x0) / 2 / cellSize * cellSize : tile.x1;
+		const size_t yMid = splitY ? tile.y0 + (tile.y1 - tile.y0) / 2 / cellSize * cellSize : tile.y1;
+		for (const tileInfo& part : { tileInfo{ tile.x0, xMid, tile.y0, yMid }, tileInfo{ xMid, tile.x1, tile.y0, yMid },
+			tileInfo{ tile.x0, xMid, yMid, tile.y1 }, tileInfo{ xMid, tile.x1, yMid, tile.y1 } }) {
+			if (part.x1 > part.x0 && part.y1 > part.y0)
+				stack.push_back(part);
+		}
+		splitCount++;
+	}
+
+	// Costliest first, costs within a power of two count as equal and go along the curve
+	struct Key
+	{
+		int costClass;
+		uint64_t hilbert;
+	};
+	std::vector<std::pair<Key, size_t>> keys(result.size());
+	for (size_t i = 0; i < result.size(); i++) {
+		const float cost = std::max(predict(result[i]) / std::max(target, 1e-6f), 1e-6f);
+		keys[i] = { { (int)std::floor(std::log2(cost)), hilbertIndex(result[i]) }, i };
+	}
+	std::sort(keys.begin(), keys.end(), [](const auto& a, const auto& b)
+		{
+			if (a.first.costClass != b.first.costClass)
+				return a.first.costClass > b.first.costClass;
+			return a.first.hilbert < b.first.hilbert;
+		});
+	std::vector<tileInfo> ordered(result.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		ordered[i] = result[keys[i].second];
+	return ordered;
+}
+
+float TileScheduler::predict(const tileInfo& tile) const
+{
+	float time = 0;
+	for (size_t cy = tile.y0 / cellSize; cy * cellSize < tile.y1; cy++) {
+		const size_t rows = std::min(tile.y1, (cy + 1) * cellSize) - std::max(tile.y0, cy * cellSize);
+		for (size_t cx = tile.x0 / cellSize; cx * cellSize < tile.x1; cx++) {
+			const size_t columns = std::min(tile.x1, (cx + 1) * cellSize) - std::max(tile.x0, cx * cellSize);
+			time += cellTimes[cy * cellsX + cx] * (float)(rows * columns);
+		}
+	}
+	return time;
+}
+
+uint64_t TileScheduler::hilbertIndex(const tileInfo& tile) const
+{
+	uint64_t n = 1;
+	while (n * minTileSize < std::max(scene.options.width, scene.options.height))
+		n *= 2;
+	uint64_t x = tile.x0 / minTileSize, y = tile.y0 / minTileSize;
+	uint64_t d = 0;
+	for (uint64_t s = n / 2; s > 0; s /= 2) {
+		const uint64_t rx = (x & s) > 0;
+		const uint64_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant, so the curve continues from its end
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+void TileScheduler::report(const std::vector<tileInfo>& tiles, const std::vector<float>& times) const
+{
+	float predicted = 0, actual = 0;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		predicted += predict(tiles[i]);
+		actual += times[i];
+	}
+	// Tiles of parallel threads take longer than alone, so only relative costs are compared
+	const float scale = predicted > 0 ? actual / predicted : 0;
+	float error = 0;
+	for (size_t i = 0; i < tiles.size(); i++)
+		error += std::fabs(predict(tiles[i]) * scale - times[i]);
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "Tile schedule:     " << tiles.size() << " tiles, " << splitCount << " split, cost pass "
+		<< passTime << " ms\n";
+	std::cout << "Tile time:         predicted " << predicted << " ms, actual " << actual << " ms, error of scaled "
+		<< (actual > 0 ? 100 * error / actual : 0) << "%\n";
+
+	// Tiles that took longest decide the tail of the frame
+	std::vector<size_t> order(tiles.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return times[a] > times[b]; });
+	std::cout << "Slowest tiles, predicted / actual ms:\n";
+	for (size_t k = 0; k < std::min<size_t>(5, order.size()); k++) {
+		const tileInfo& tile = tiles[order[k]];
+		std::cout << "  " << tile.x0 << ',' << tile.y0 << ' ' << tile.x1 - tile.x0 << 'x' << tile.y1 - tile.y0 << "  "
+			<< predict(tile) << " / " << times[order[k]] << '\n';
+	}
+}
@@ -11,57 +11,29 @@
 #include <cstring>
 
 #include "options.h"
+#include "postprocess.h"
+#include "timer.h"
 
-int saveImage(Vec3f* frameBuffer, const Options& options)
+std::unique_ptr<ImageStream> openImage(const Options& options)
 {
     std::string path = options.imageName + std::string(".bmp");
-    std::ofstream of(path, std::ios::out | std::ios::binary);
-    if (!of.good()) {
+    auto image = std::make_unique<ImageStream>(path, options.width, options.height);
+    if (!image->good()) {
         std::cout << "Could not open output file " << path << '\n';
-        return -1;
+        return nullptr;
     }
-    
-    std::cout << "Successfully wrote to output file " << path << '\n';
-
-    const size_t headerSize = 54;
-    char header[headerSize] = { 0 };
-    int paddingBytes = options.width % 4 == 0 ? 0 : 4 - options.width * 3 % 4;
-    size_t arraySize = options.height * (options.width + paddingBytes) * 3;
-    size_t totalSize = headerSize + arraySize;
-
-    
-    memcpy(header, "BM", 2);
-    *(size_t*)(header + 0x2) = totalSize;
-    *(size_t*)(header + 0xA) = headerSize;
-    *(size_t*)(header + 0xE) = headerSize - 14;
-    *(size_t*)(header + 0x12) = options.width;
-    *(size_t*)(header + 0x16) = options.height;
-    *(header + 0x1A) = 1;
-    *(header + 0x1C) = 24;
-    *(size_t*)(header + 0x22) = arraySize;
-    *(size_t*)(header + 0x26) = 2835;
-    *(size_t*)(header + 0x2A) = 2835;
+    return image;
+}
 
-    // intermediate buffer significantly speeds up file write process
-    char* data = new char[options.height * options.width * 3];
-    char* dataPtr = data;
-    for (size_t i = 0; i < options.height; i++) {
-        for (size_t j = 0; j < options.width; j++) {
-            size_t v = (options.height - 1 - i) * options.width + j;
-            for (int k = 2; k >= 0; k--) {
-                *dataPtr++ = static_cast<char>(clamp(0.0f, 1.0f, frameBuffer[v][k]) * 255);
-            }
-        }
-        for (int j = 0; j < paddingBytes; j++) {
-            dataPtr++;
-        }
+int closeImage(ImageStream& image)
+{
+    if (!image.close()) {
+        std::cout << "Could not write output file " << image.path << '\n';
+        return -1;
     }
+    std::cout << "Successfully wrote to output file " << image.path << '\n';
 
-    of.write(header, headerSize);
-    of.write(data, arraySize);
-    of.close();
-
-    std::string fullPath = (std::filesystem::current_path() / path).string();
+    std::string fullPath = (std::filesystem::current_path() / image.path).string();
     #ifdef _WIN32
         wchar_t* wPath = new wchar_t[strlen(fullPath.c_str()) + 1];
         mbstowcs(wPath, fullPath.c_str(), strlen(fullPath.c_str()) + 1);
@@ -71,10 +43,22 @@ int saveImage(Vec3f* frameBuffer, const Options& options)
         auto linuxCmd = "xdg-open " + fullPath;
         system(linuxCmd.c_str());
     #endif
-    delete[] data;
     return 0;
 }
 
+int saveImage(Vec3f* frameBuffer, const Options& options)
+{
+    std::unique_ptr<ImageStream> image = openImage(options);
+    if (!image)
+        return -1;
+
+    {
+        Timer t("Save image");
+        image->addFrame(frameBuffer, ThreadPool::shared(std::max(0, options.nWorkers - 1)));
+    }
+    return closeImage(*image);
+}
+
 unsigned char* loadBMP(const char* filename, int& width, int& height)
 {
     int i;
@@ -0,0 +1,233 @@
+// Wavefront renderer, traces paths of all camera rays together bounce by bounce
+#include "wavefront.h"
+
+#include <algorithm>
+
+#include "options.h"
+
+namespace
+{
+	// Insert two zero bits before each of the lower 21 bits
+	uint64_t expandBits(uint64_t v)
+	{
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffull;
+		v = (v | v << 16) & 0x1f0000ff0000ffull;
+		v = (v | v << 8) & 0x100f00f00f00f00full;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
+
+	// Octant of the direction is the top key, so packets rarely mix opposite directions.
+	// Below it are Morton codes of the direction quantized to 8 bits and of the origin
+	// quantized to 10 bits inside the bounds of all origins
+	uint64_t rayKey(const Ray& ray, const BBox& origBounds, const Vec3f& origScale)
+	{
+		Vec3f dir = ray.dir;
+		dir.normalize();
+		uint64_t key = (uint64_t)(dir.x < 0) | (uint64_t)(dir.y < 0) << 1 | (uint64_t)(dir.z < 0) << 2;
+		uint64_t dirCode = 0, origCode = 0;
+		for (uint8_t i = 0; i < 3; i++) {
+			dirCode |= expandBits((uint64_t)((dir[i] + 1) * 127.5f)) << (2 - i);
+			origCode |= expandBits((uint64_t)((ray.orig[i] - origBounds[0][i]) * origScale[i])) << (2 - i);
+		}
+		return key << 54 | dirCode << 30 | origCode;
+	}
+}
+
+WavefrontRenderer::WavefrontRenderer(const Scene& a_scene)
+	: scene(a_scene), pool(ThreadPool::shared(std::max(0, a_scene.options.nWorkers - 1))) {}
+
+void WavefrontRenderer::render(const std::vector<Ray>& cameraRays, std::vector<Vec3f>& colors, std::vector<SampleHit>* firstHits)
+{
+	// Points of area lights are created before the stages read them in parallel
+	for (const auto& light : scene.lights) {
+		if (light->type == LightType::AreaLight)
+			static_cast<AreaLight*>(light.get())->setPoints();
+	}
+
+	colors.assign(cameraRays.size(), Vec3f(0));
+	std::vector<PathRay> queue(cameraRays.size()), nextQueue;
+	for (uint32_t i = 0; i < cameraRays.size(); i++) {
+		queue[i].ray = cameraRays[i];
+		queue[i].sample = i;
+		queue[i].weight = 1;
+		queue[i].depth = 0;
+	}
+
+	if (firstHits)
+		firstHits->assign(cameraRays.size(), SampleHit());
+
+	std::vector<IntersectInfo> hits;
+	for (bool firstWave = true; !queue.empty(); firstWave = false) {
+		// Paths deeper than the limit end with the skybox
+		size_t size = 0;
+		for (const PathRay& path : queue) {
+			if (path.depth > scene.options.maxRayDepth)
+				colors[path.sample] += scene.getSkybox(path.ray.dir) * path.weight;
+			else
+				queue[size++] = path;
+		}
+		queue.resize(size);
+
+		// Extend stage traces path rays in packets of neighbours
+		sortQueue(queue);
+		hits.resize(queue.size());
+		pool.parallelFor(0, queue.size(), chunkSize, [&](size_t, size_t begin, size_t end)
+			{
+				tracePackets(&queue[begin], end - begin, &hits[begin]);
+			});
+
+		shadeStage(queue, hits);
+		if (firstHits && firstWave) {
+			for (size_t i = 0; i < queue.size(); i++)
+				if (hits[i].hitObject)
+					(*firstHits)[queue[i].sample] = SampleHit{ hits[i].hitObject, points[i].hitNormal };
+		}
+		shadowStage();
+		resolveStage(queue);
+
+		// Hits of one camera ray may be in different chunks, so colors are summed serially
+		nextQueue.clear();
+		for (size_t i = 0; i < queue.size(); i++)
+			colors[queue[i].sample] += points[i].color;
+		for (const ShadeChunk& chunk : chunks)
+			nextQueue.insert(nextQueue.end(), chunk.pathRays.begin(), chunk.pathRays.end());
+		queue.swap(nextQueue);
+	}
+}
+
+void WavefrontRenderer::sortQueue(std::vector<PathRay>& queue)
+{
+	BBox origBounds;
+	for (const PathRay& item : queue)
+		origBounds.extend(item.ray.orig);
+	Vec3f origScale;
+	for (uint8_t i = 0; i < 3; i++) {
+		const float extent = origBounds[1][i] - origBounds[0][i];
+		origScale[i] = extent > 0 ? 1023 / extent : 0;
+	}
+
+	// Index breaks ties, so the order does not depend on the sort implementation
+	std::vector<std::pair<uint64_t, uint32_t>> keys(queue.size());
+	for (uint32_t i = 0; i < queue.size(); i++)
+		keys[i] = { rayKey(queue[i].ray, origBounds, origScale), i };
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<PathRay> sorted(queue.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		sorted[i] = queue[keys[i].second];
+	queue.swap(sorted);
+}
+
+template<typename T>
+void WavefrontRenderer::tracePackets(const T* rays, size_t count, IntersectInfo hits[])
+{
+	RayPacket packet;
+	for (size_t first = 0; first < count; first += RayPacket::maxSize) {
+		packet.clear();
+		for (size_t i = first; i < std::min(count, first + RayPacket::maxSize); i++)
+			packet.add(rays[i].ray, rays[i].tMax);
+		Render::tracePacket(packet, scene, &hits[first]);
+	}
+}
+
+void WavefrontRenderer::shadeStage(const std::vector<PathRay>& queue, const std::vector<IntersectInfo>& hits)
+{
+	points.resize(queue.size());
+	chunks.resize((queue.size() + chunkSize - 1) / chunkSize);
+	pool.parallelFor(0, queue.size(), chunkSize, [&](size_t chunkIndex, size_t begin, size_t end)
+		{
+			ShadeChunk& chunk = chunks[chunkIndex];
+			for (auto& group : chunk.shadowRays)
+				group.clear();
+			chunk.shadowRayPositions.clear();
+			chunk.pathRays.clear();
+			size_t firstShadowRay = 0;
+			// Shadow rays are only queued here, every light counts as visible for now
+			auto queueShadowRay = [&](const Ray& shadowRay, float distance, uint32_t)
+			{
+				const size_t group = chunk.shadowRayPositions.size() - firstShadowRay;
+				if (group == chunk.shadowRays.size())
+					chunk.shadowRays.emplace_back();
+				chunk.shadowRayPositions.push_back((uint32_t)chunk.shadowRays[group].size());
+				chunk.shadowRays[group].push_back(QueuedRay{ shadowRay, distance });
+				return true;
+			};
+
+			for (size_t i = begin; i < end; i++) {
+				const PathRay& path = queue[i];
+				ShadePoint& point = points[i];
+				point.object = hits[i].hitObject;
+				point.color = 0;
+				if (!point.object) {
+					point.color = scene.getSkybox(path.ray.dir) * path.weight;
+					continue;
+				}
+
+				point.hitPoint = path.ray.orig + path.ray.dir * hits[i].tNear;
+				point.object->getSurfaceData(point.hitPoint, hits[i].triPtr, hits[i].uv, point.hitNormal, point.hitTexCoordinates);
+				if (options::showNormals) {
+					point.color = (point.hitNormal / 2.0f + Vec3f{ 0.5f }) * path.weight;
+					point.object = nullptr;
+					continue;
+				}
+
+				point.firstShadowRay = firstShadowRay = chunk.shadowRayPositions.size();
+				Render::directLight(path.ray, scene, point.object, point.hitPoint, point.hitNormal, point.hitTexCoordinates, queueShadowRay);
+
+				Ray rays[2];
+				float weights[2];
+				const int nRays = Render::secondaryRays(path.ray, scene, point.object, point.hitPoint, point.hitNormal, rays, weights);
+				for (int k = 0; k < nRays; k++) {
+					PathRay next;
+					next.ray = rays[k];
+					next.sample = path.sample;
+					next.weight = path.weight * weights[k];
+					next.depth = path.depth + 1;
+					chunk.pathRays.push_back(next);
+				}
+			}
+		});
+}
+
+void WavefrontRenderer::shadowStage()
+{
+	// Shade points are sorted, so a group of rays towards one light sample
+	// from neighbouring points is coherent. Only visibility is needed, so
+	// every ray stops at its first hit
+	pool.parallelFor(0, chunks.size(), 1, [&](size_t chunkIndex, size_t, size_t)
+		{
+			ShadeChunk& chunk = chunks[chunkIndex];
+			chunk.visible.resize(chunk.shadowRays.size());
+			for (size_t group = 0; group < chunk.shadowRays.size(); group++) {
+				const std::vector<QueuedRay>& rays = chunk.shadowRays[group];
+				chunk.visible[group].resize(rays.size());
+				for (size_t i = 0; i < rays.size(); i++)
+					chunk.visible[group][i] = !Render::occluded(rays[i].ray, scene, rays[i].tMax);
+			}
+		});
+}
+
+void WavefrontRenderer::resolveStage(const std::vector<PathRay>& queue)
+{
+	pool.parallelFor(0, queue.size(), chunkSize, [&](size_t chunkIndex, size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++) {
+				ShadePoint& point = points[i];
+				if (!point.object)
+					continue;
+				// Lights are visited in the same order as in the shade stage
+				const ShadeChunk& chunk = chunks[chunkIndex];
+				size_t group = 0;
+				auto isVisible = [&](const Ray&, float, uint32_t)
+				{
+					const uint32_t position = chunk.shadowRayPositions[point.firstShadowRay + group];
+					return chunk.visible[group++][position] != 0;
+				};
+				const Vec3f light = Render::directLight(queue[i].ray, scene, point.object, point.hitPoint, point.hitNormal, point.hitTexCoordinates, isVisible);
+				point.color = light * queue[i].weight;
+			}
+		});
+}